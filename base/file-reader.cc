@@ -1,44 +1,62 @@
 #include "base/file-reader.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <utility>
 
 // static
 Result<FileReader> FileReader::Create(absl::string_view path) {
-  // We must make a string because fopen requires a C string.
+  // We must make a string because open requires a C string.
   std::string path_str(path);
 
-  // Can't construct inside of the wrapped FilePtr type because fclose(NULL) is
-  // undefined behavior.
-  FILE* fp = fopen(path_str.c_str(), "r");
-  if (!fp) {
+  // Plain file descriptors avoid the extra buffering and the seeks the C file
+  // API needed to find the size.
+  ScopedFd fd(open(path_str.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!fd) {
     return BuildPosixErr(absl::StrCat("Failed to open ", path_str));
   }
 
-  FilePtr ptr(fp, &fclose);
+  struct stat stat_buf;
+  if (fstat(*fd, &stat_buf) < 0) {
+    return BuildPosixErr(absl::StrCat("fstat failed on ", path_str));
+  }
 
-  if (fseek(ptr.get(), 0L, SEEK_END) < 0) {
-    return BuildPosixErr(absl::StrCat("fseek failed on ", path_str));
+  return FileReader(std::move(path_str), std::move(fd), stat_buf.st_size);
+}
+
+// static
+Result<FileReader> FileReader::CreateFromFd(int fd, size_t size,
+                                            absl::string_view path) {
+  std::string path_str(path);
+  ScopedFd dup_fd(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+  if (!dup_fd) {
+    return BuildPosixErr(absl::StrCat("Failed to duplicate fd of ", path_str));
   }
-  size_t size = ftell(fp);
-  rewind(fp);
 
-  return FileReader(std::move(path_str), std::move(ptr), size);
+  return FileReader(std::move(path_str), std::move(dup_fd), size);
 }
 
-FileReader::FileReader(std::string path, FilePtr file, size_t size)
-    : path_(std::move(path)), file_(std::move(file)), size_(size) {}
+FileReader::FileReader(std::string path, ScopedFd fd, size_t size)
+    : path_(std::move(path)), fd_(std::move(fd)), size_(size) {}
 
 Result<ssize_t> FileReader::Read(absl::Span<char> buf) {
-  if (eof_) {
+  if (offset_ >= size_) {
     return -1;
   }
-  size_t amount = fread(buf.data(), /*size=*/1, buf.size(), file_.get());
-  if (amount != buf.size()) {
-    if (ferror(file_.get())) {
-      return BuildPosixErr(absl::StrCat("Read failed on ", path_));
-    }
-    eof_ = true;
+
+  ssize_t amount = pread(*fd_, buf.data(), buf.size(), offset_);
+  if (amount < 0) {
+    return BuildPosixErr(absl::StrCat("Read failed on ", path_));
+  }
+
+  // The file was truncated under us.
+  if (amount == 0) {
+    size_ = offset_;
+    return -1;
   }
 
+  offset_ += amount;
   return amount;
 }
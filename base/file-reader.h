@@ -1,18 +1,24 @@
 #ifndef BASE_FILE_READER_H_
 #define BASE_FILE_READER_H_
 
-#include <cstdio>
-#include <memory>
+#include <sys/types.h>
+
 #include <string>
 
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "base/err.h"
 #include "base/reader.h"
+#include "base/scoped-fd.h"
 
 class FileReader : public Reader {
  public:
   static Result<FileReader> Create(absl::string_view path);
+  // Reads the first |size| bytes of the file open as |fd|, through a
+  // duplicate of it. Only positional reads are used, so |fd| may be shared.
+  // |path| is only used in errors.
+  static Result<FileReader> CreateFromFd(int fd, size_t size,
+                                         absl::string_view path);
 
   FileReader(FileReader&&) = default;
   FileReader& operator=(FileReader&&) = default;
@@ -22,16 +28,12 @@ class FileReader : public Reader {
   size_t size() const { return size_; }
 
  private:
-  // Use C file API because it's faster than C++ streams.
-  using FilePtr = std::unique_ptr<FILE, decltype(&fclose)>;
-
-  // Reader implementation:
-  FileReader(std::string path, FilePtr file, size_t size);
+  FileReader(std::string path, ScopedFd fd, size_t size);
 
   std::string path_;
-  FilePtr file_;
+  ScopedFd fd_;
   size_t size_ = 0;
-  bool eof_ = false;
+  size_t offset_ = 0;
 };
 
 #endif  // BASE_FILE_READER_H_
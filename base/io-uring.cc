@@ -0,0 +1,252 @@
+#include "base/io-uring.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <utility>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+
+// static
+Result<std::unique_ptr<IoUring>> IoUring::Create(unsigned entries,
+                                                 unsigned num_buffers,
+                                                 size_t buffer_size) {
+  io_uring_params params = {};
+  // Completions are only reaped from io_uring_enter(), so the kernel doesn't
+  // need to interrupt the thread to post them.
+  params.flags = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN;
+  ScopedFd fd(syscall(__NR_io_uring_setup, entries, &params));
+  if (!fd) {
+    return BuildPosixErr("io_uring_setup failed");
+  }
+  if (!(params.features & IORING_FEAT_NODROP)) {
+    return Err("io_uring may drop completions");
+  }
+
+  auto ret = absl::WrapUnique(new IoUring(std::move(fd), params, buffer_size));
+  TRY(ret->MapRings(params));
+  TRY(ret->RegisterBuffers(num_buffers));
+  TRY(ret->Probe());
+  return ret;
+}
+
+IoUring::IoUring(ScopedFd fd, const io_uring_params& params,
+                 size_t buffer_size)
+    : fd_(std::move(fd)),
+      buffer_size_(buffer_size),
+      sq_entries_(params.sq_entries) {}
+
+IoUring::~IoUring() {
+  fd_.reset();
+  if (buffer_ring_) {
+    munmap(buffer_ring_, buffer_ring_size_);
+  }
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ && cq_ring_ != rings_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (rings_) {
+    munmap(rings_, rings_size_);
+  }
+}
+
+Result<void> IoUring::MapRings(const io_uring_params& params) {
+  rings_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    rings_size_ = cq_ring_size_ = std::max(rings_size_, cq_ring_size_);
+  }
+
+  void* rings = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, *fd_, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    return BuildPosixErr("Failed to map io_uring submission queue");
+  }
+  rings_ = rings;
+
+  if (single_mmap) {
+    cq_ring_ = rings_;
+  } else {
+    void* cq_ring = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, *fd_, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      return BuildPosixErr("Failed to map io_uring completion queue");
+    }
+    cq_ring_ = cq_ring;
+  }
+
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, *fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return BuildPosixErr("Failed to map io_uring submission entries");
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  char* sq = static_cast<char*>(rings_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_local_tail_ = *sq_tail_;
+  // Entries are submitted in order, so the indirection array is the
+  // identity.
+  unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; ++i) {
+    array[i] = i;
+  }
+
+  char* cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  return {};
+}
+
+Result<void> IoUring::RegisterBuffers(unsigned num_buffers) {
+  buffer_ring_size_ = num_buffers * sizeof(io_uring_buf);
+  void* ring = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, /*fd=*/-1, /*offset=*/0);
+  if (ring == MAP_FAILED) {
+    return BuildPosixErr("Failed to map io_uring buffer ring");
+  }
+  buffer_ring_ = static_cast<io_uring_buf_ring*>(ring);
+
+  io_uring_buf_reg reg = {};
+  reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+  reg.ring_entries = num_buffers;
+  reg.bgid = kBufferGroup;
+  if (syscall(__NR_io_uring_register, *fd_, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0) {
+    return BuildPosixErr("Failed to register io_uring buffer ring");
+  }
+
+  buffer_ring_mask_ = num_buffers - 1;
+  buffers_.reset(new char[num_buffers * buffer_size_]);
+  for (unsigned i = 0; i < num_buffers; ++i) {
+    RecycleBuffer(i);
+  }
+  return {};
+}
+
+Result<void> IoUring::Probe() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, /*protocol=*/0, fds) <
+      0) {
+    return BuildPosixErr("socketpair failed");
+  }
+  ScopedFd receiver(fds[0]);
+  ScopedFd sender(fds[1]);
+  if (write(*sender, "x", 1) != 1) {
+    return BuildPosixErr("Failed to write to socketpair");
+  }
+
+  io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = *receiver;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufferGroup;
+
+  // Kernels without multishot receives fail it right away. Otherwise it goes
+  // on after the first byte, until the sender shuts down.
+  int error = 0;
+  bool multishot = false;
+  bool ended = false;
+  auto on_completion = [&](const io_uring_cqe& cqe) {
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      RecycleBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (cqe.res < 0) {
+      error = -cqe.res;
+    }
+    if (cqe.flags & IORING_CQE_F_MORE) {
+      multishot = true;
+    } else {
+      ended = true;
+    }
+  };
+  TRY(SubmitAndWait(1));
+  ForEachCompletion(on_completion);
+  shutdown(*sender, SHUT_WR);
+  while (!ended) {
+    TRY(SubmitAndWait(1));
+    ForEachCompletion(on_completion);
+  }
+
+  if (error != 0) {
+    return Err(absl::StrCat("Multishot receive failed: ", strerror(error)));
+  }
+  if (!multishot) {
+    return Err("Multishot receive isn't supported");
+  }
+  return {};
+}
+
+io_uring_sqe* IoUring::GetSqe() {
+  while (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) ==
+         sq_entries_) {
+    auto result = SubmitAndWait(0);
+    if (!result.ok()) {
+      LOG(ERR) << result.err();
+    }
+  }
+
+  io_uring_sqe* sqe = &sqes_[sq_local_tail_ & sq_mask_];
+  ++sq_local_tail_;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+Result<void> IoUring::SubmitAndWait(unsigned min_complete) {
+  // Publishes the entries after they were filled in.
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  unsigned to_submit =
+      sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (to_submit == 0 && min_complete == 0) {
+    return {};
+  }
+
+  unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  if (syscall(__NR_io_uring_enter, *fd_, to_submit, min_complete, flags,
+              /*sig=*/nullptr, /*sigsz=*/0) < 0 &&
+      errno != EINTR) {
+    return BuildPosixErr("io_uring_enter failed");
+  }
+  return {};
+}
+
+void IoUring::ForEachCompletion(
+    const std::function<void(const io_uring_cqe&)>& callback) {
+  unsigned head = *cq_head_;
+  while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    io_uring_cqe cqe = cqes_[head & cq_mask_];
+    // Frees the entry before |callback| queues more work.
+    __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+    callback(cqe);
+  }
+}
+
+void IoUring::RecycleBuffer(uint16_t id) {
+  // Not |buffer_ring_->bufs|: C++ moves it past the empty struct in front of
+  // it. The buffers start at the beginning of the ring.
+  io_uring_buf* buf = reinterpret_cast<io_uring_buf*>(buffer_ring_) +
+                      (buffer_ring_tail_ & buffer_ring_mask_);
+  buf->addr = reinterpret_cast<uint64_t>(buffers_.get() + id * buffer_size_);
+  buf->len = buffer_size_;
+  buf->bid = id;
+  // Publishes the buffer after it was filled in.
+  __atomic_store_n(&buffer_ring_->tail, ++buffer_ring_tail_,
+                   __ATOMIC_RELEASE);
+}
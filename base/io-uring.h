@@ -0,0 +1,88 @@
+#ifndef BASE_IO_URING_H_
+#define BASE_IO_URING_H_
+
+#include <linux/io_uring.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "absl/strings/string_view.h"
+#include "base/err.h"
+#include "base/scoped-fd.h"
+
+// An io_uring instance, driven through the raw syscalls. Comes with a ring of
+// provided buffers which receives with IOSQE_BUFFER_SELECT pick from, in
+// group |kBufferGroup|. Not thread safe.
+class IoUring {
+ public:
+  static constexpr uint16_t kBufferGroup = 0;
+
+  // |num_buffers| must be a power of 2. Fails if the kernel lacks io_uring,
+  // or multishot receives into provided buffers (Linux 6.0).
+  static Result<std::unique_ptr<IoUring>> Create(unsigned entries,
+                                                 unsigned num_buffers,
+                                                 size_t buffer_size);
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+  ~IoUring();
+
+  // Returns a zeroed submission queue entry to fill. Submits the queued ones
+  // first if the queue is full.
+  io_uring_sqe* GetSqe();
+
+  // Submits the queued entries and waits until at least |min_complete|
+  // completions are available. Returns early if interrupted by a signal.
+  Result<void> SubmitAndWait(unsigned min_complete);
+
+  // Calls |callback| for every available completion.
+  void ForEachCompletion(
+      const std::function<void(const io_uring_cqe&)>& callback);
+
+  // The first |size| bytes of the buffer a completion with
+  // IORING_CQE_F_BUFFER picked. It must be given back with |RecycleBuffer|.
+  absl::string_view Buffer(uint16_t id, size_t size) const {
+    return {buffers_.get() + id * buffer_size_, size};
+  }
+  void RecycleBuffer(uint16_t id);
+
+ private:
+  IoUring(ScopedFd fd, const io_uring_params& params, size_t buffer_size);
+
+  Result<void> MapRings(const io_uring_params& params);
+  Result<void> RegisterBuffers(unsigned num_buffers);
+  // Checks that multishot receives work, on a socket pair.
+  Result<void> Probe();
+
+  // Closed before the rings are unmapped.
+  ScopedFd fd_;
+  const size_t buffer_size_;
+
+  void* rings_ = nullptr;
+  size_t rings_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned sq_entries_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  // Entries handed out by |GetSqe|, published to the kernel on submit.
+  unsigned sq_local_tail_ = 0;
+
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+
+  io_uring_buf_ring* buffer_ring_ = nullptr;
+  size_t buffer_ring_size_ = 0;
+  uint16_t buffer_ring_mask_ = 0;
+  uint16_t buffer_ring_tail_ = 0;
+  std::unique_ptr<char[]> buffers_;
+};
+
+#endif  // BASE_IO_URING_H_
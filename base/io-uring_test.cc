@@ -0,0 +1,70 @@
+#include "base/io-uring.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "base/logging.h"
+#include "base/scoped-fd.h"
+#include "gtest/gtest.h"
+
+TEST(IoUringTest, ReceivesIntoProvidedBuffers) {
+  auto io_uring = IoUring::Create(/*entries=*/8, /*num_buffers=*/2,
+                                  /*buffer_size=*/4);
+  if (!io_uring.ok()) {
+    // E.g. a seccomp policy blocks io_uring. The server falls back to epoll.
+    LOG(WARN) << "Skipping: " << io_uring.err();
+    return;
+  }
+
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, /*protocol=*/0, fds));
+  ScopedFd receiver(fds[0]);
+  ScopedFd sender(fds[1]);
+
+  io_uring_sqe* sqe = (*io_uring)->GetSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = *receiver;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = IoUring::kBufferGroup;
+  sqe->user_data = 42;
+
+  // Buffers are given back as soon as they're read, so the receive goes on
+  // with only two of them.
+  std::string received;
+  bool ended = false;
+  auto on_completion = [&](const io_uring_cqe& cqe) {
+    EXPECT_EQ(42u, cqe.user_data);
+    ASSERT_GE(cqe.res, 0);
+    if (cqe.res > 0) {
+      ASSERT_TRUE(cqe.flags & IORING_CQE_F_BUFFER);
+      uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      received += std::string((*io_uring)->Buffer(id, cqe.res));
+      (*io_uring)->RecycleBuffer(id);
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      ended = true;
+    }
+  };
+
+  for (const char* data : {"hello", " ", "world"}) {
+    size_t size = strlen(data);
+    ASSERT_EQ(static_cast<ssize_t>(size), write(*sender, data, size));
+    size_t expected = received.size() + size;
+    while (received.size() < expected) {
+      ASSERT_TRUE((*io_uring)->SubmitAndWait(1).ok());
+      (*io_uring)->ForEachCompletion(on_completion);
+    }
+  }
+  EXPECT_EQ("hello world", received);
+  EXPECT_FALSE(ended);
+
+  shutdown(*sender, SHUT_WR);
+  while (!ended) {
+    ASSERT_TRUE((*io_uring)->SubmitAndWait(1).ok());
+    (*io_uring)->ForEachCompletion(on_completion);
+  }
+}
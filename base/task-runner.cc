@@ -1,5 +1,7 @@
 #include "base/task-runner.h"
 
+#include <unistd.h>
+
 #include <utility>
 
 // static
@@ -26,12 +28,38 @@ void TaskRunner::Stop() {
   thread_.join();
 }
 
-void TaskRunner::PostTask(OnceCallback task) { tasks_.Push(std::move(task)); }
+void TaskRunner::PostTask(OnceCallback task) {
+  num_posted_.fetch_add(1, std::memory_order_relaxed);
+  tasks_.Push(std::move(task));
+
+  int wakeup_fd = wakeup_fd_.load(std::memory_order_acquire);
+  if (wakeup_fd >= 0) {
+    // Failure is fine. If the pipe is full, the reader will wake up anyway.
+    char byte = 0;
+    ssize_t ret = write(wakeup_fd, &byte, sizeof(byte));
+    static_cast<void>(ret);
+  }
+}
 
 bool TaskRunner::IsCurrentThread() {
   return current_task_runner_.get() == this;
 }
 
+void TaskRunner::RunPendingTasks() {
+  ABSL_ASSERT(IsCurrentThread());
+  // Tasks may call this again, which is accounted for in |num_run_|.
+  uint64_t end = num_posted_.load(std::memory_order_relaxed);
+  while (num_run_ < end && !tasks_.Empty()) {
+    ++num_run_;
+    OnceCallback task = tasks_.Pop();
+    task();
+  }
+}
+
+void TaskRunner::SetWakeupFd(int fd) {
+  wakeup_fd_.store(fd, std::memory_order_release);
+}
+
 void TaskRunner::Init(std::shared_ptr<TaskRunner> shared_this) {
   thread_ =
       std::thread([ this, shared_this = std::move(shared_this) ]() mutable {
@@ -43,9 +71,11 @@ void TaskRunner::Init(std::shared_ptr<TaskRunner> shared_this) {
 void TaskRunner::RunLoop() {
   while (running_.load(std::memory_order_acquire)) {
     tasks_.WaitNotEmpty();
-    while (!tasks_.Empty()) {
-      OnceCallback task = tasks_.Pop();
-      task();
-    }
+    RunPendingTasks();
+  }
+
+  // Run what the last tasks posted.
+  while (!tasks_.Empty()) {
+    RunPendingTasks();
   }
 }
@@ -2,6 +2,7 @@
 #define BASE_TASK_RUNNER_H_
 
 #include <atomic>
+#include <cstdint>
 #include <memory>
 #include <thread>
 
@@ -32,6 +33,17 @@ class TaskRunner {
 
   bool IsCurrentThread();
 
+  // Runs the tasks queued when called. Tasks they post wait for the next call,
+  // so a task which keeps posting itself doesn't hold up the caller. Must be
+  // called on this TaskRunner's thread. Meant for long running tasks which run
+  // their own event loop.
+  void RunPendingTasks();
+
+  // If set, a byte is written to |fd| every time a task is posted. This lets a
+  // long running task blocked in e.g. epoll_wait() wake up and call
+  // |RunPendingTasks|. Pass -1 to disable.
+  void SetWakeupFd(int fd);
+
  private:
   static thread_local std::shared_ptr<TaskRunner> current_task_runner_;
 
@@ -46,6 +58,13 @@ class TaskRunner {
   // True if the task runner is still running.
   std::atomic<bool> running_{true};
 
+  std::atomic<int> wakeup_fd_{-1};
+
+  // Incremented before a task is queued, so it's never behind |tasks_|.
+  std::atomic<uint64_t> num_posted_{0};
+  // Only used on |thread_|.
+  uint64_t num_run_ = 0;
+
   MpscQueue<OnceCallback> tasks_;
 };
 
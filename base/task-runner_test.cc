@@ -1,3 +1,5 @@
+#include <unistd.h>
+
 #include <atomic>
 #include <set>
 #include <thread>
@@ -72,3 +74,57 @@ TEST(TaskRunnerTest, MultiProducers) {
     EXPECT_EQ(got_values.count(i), 1ul);
   }
 }
+
+TEST(TaskRunnerTest, RunPendingTasksFromLongRunningTask) {
+  int pipe_fds[2];
+  ASSERT_EQ(0, pipe(pipe_fds));
+
+  std::atomic<bool> inner_ran{false};
+  std::atomic<bool> wakeup_fd_set{false};
+  auto tr = TaskRunner::Create();
+
+  tr->PostTask(BindOnce([&] {
+    tr->SetWakeupFd(pipe_fds[1]);
+    wakeup_fd_set = true;
+
+    // Block like an event loop would until another task is posted.
+    char byte;
+    ASSERT_EQ(1, read(pipe_fds[0], &byte, sizeof(byte)));
+    EXPECT_FALSE(inner_ran);
+    tr->RunPendingTasks();
+    EXPECT_TRUE(inner_ran);
+    tr->SetWakeupFd(-1);
+  }));
+
+  while (!wakeup_fd_set) {
+    std::this_thread::yield();
+  }
+  tr->PostTask(BindOnce([&] { inner_ran = true; }));
+  tr->Stop();
+
+  EXPECT_TRUE(inner_ran);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+
+TEST(TaskRunnerTest, RunPendingTasksLeavesTasksPostedMeanwhile) {
+  auto tr = TaskRunner::Create();
+  std::atomic<int> num_checked{0};
+
+  tr->PostTask(BindOnce([&] {
+    int num_run = 0;
+    tr->PostTask(BindOnce([&] {
+      ++num_run;
+      tr->PostTask(BindOnce([&] { ++num_run; }));
+    }));
+
+    tr->RunPendingTasks();
+    EXPECT_EQ(1, num_run);
+    tr->RunPendingTasks();
+    EXPECT_EQ(2, num_run);
+    ++num_checked;
+  }));
+  tr->Stop();
+
+  EXPECT_EQ(1, num_checked);
+}
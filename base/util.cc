@@ -1,5 +1,10 @@
 #include "base/util.h"
 
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 
 namespace util {
@@ -13,4 +18,26 @@ Result<std::string> CanonicalizePath(const std::string& input) {
   return std::string(tmp_path);
 }
 
+bool IsPathWithin(absl::string_view path, absl::string_view dir) {
+  if (!absl::StartsWith(path, dir)) {
+    return false;
+  }
+  return path.size() == dir.size() || path[dir.size()] == '/' ||
+         absl::EndsWith(dir, "/");
+}
+
+Result<void> WriteAll(int fd, absl::string_view data, absl::string_view path) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return BuildPosixErr(absl::StrCat("Failed to write ", path));
+    }
+    data.remove_prefix(written);
+  }
+  return {};
+}
+
 }  // namespace util
@@ -3,6 +3,7 @@
 
 #include <string>
 
+#include "absl/strings/string_view.h"
 #include "base/err.h"
 
 namespace util {
@@ -10,6 +11,14 @@ namespace util {
 // Canonicalize a unix path (e.g. remove ..).
 Result<std::string> CanonicalizePath(const std::string& input);
 
+// Returns true if |path| is |dir| or names something inside of it. Both must
+// be canonical.
+bool IsPathWithin(absl::string_view path, absl::string_view dir);
+
+// Writes all of |data| to |fd|, retrying short and interrupted writes. |path|
+// is only used in errors.
+Result<void> WriteAll(int fd, absl::string_view data, absl::string_view path);
+
 }  // namespace util
 
 #endif  // _BASE_UTIL_H_
@@ -1,12 +1,9 @@
 #include "base/zlib-deflate-reader.h"
 
-#include <utility>
-
 #include "absl/memory/memory.h"
 
 namespace {
 
-constexpr int kCompressionLevel = 6;
 constexpr int kMemLevel = 8;
 
 // 16 adds gzip header.
@@ -14,21 +11,23 @@ constexpr int kWindowBits = 16 + MAX_WBITS;
 
 }  // namespace
 
+constexpr int ZlibDeflateReader::kDefaultLevel;
+
 // static
 Result<std::unique_ptr<ZlibDeflateReader>> ZlibDeflateReader::Create(
-    Reader* reader) {
+    Reader* reader, int level) {
   auto ret = absl::WrapUnique(new ZlibDeflateReader(reader));
-  TRY(ret->Init());
-  return std::move(ret);
+  TRY(ret->Init(level));
+  return ret;
 }
 
 ZlibDeflateReader::ZlibDeflateReader(Reader* reader) : reader_(reader) {}
 
 ZlibDeflateReader::~ZlibDeflateReader() { deflateEnd(&stream_); }
 
-Result<void> ZlibDeflateReader::Init() {
-  if (deflateInit2(&stream_, kCompressionLevel, Z_DEFLATED, kWindowBits,
-                   kMemLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+Result<void> ZlibDeflateReader::Init(int level) {
+  if (deflateInit2(&stream_, level, Z_DEFLATED, kWindowBits, kMemLevel,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
     return Err("deflateInit failed");
   }
 
@@ -51,12 +50,18 @@ Result<ssize_t> ZlibDeflateReader::Read(absl::Span<char> buf) {
       stream_.next_in = reinterpret_cast<unsigned char*>(in_);
     }
 
-    size_t before_avail_out = stream_.avail_out;
-    if (deflate(&stream_, flush_) == Z_STREAM_ERROR) {
+    int ret = deflate(&stream_, flush_);
+    if (ret == Z_STREAM_ERROR) {
       return Err("deflate failed");
     }
-    eof_ = reader_eof_ && (before_avail_out - stream_.avail_out == 0);
+    eof_ = ret == Z_STREAM_END;
   }
 
-  return buf.size() - stream_.avail_out;
+  // When the trailer filled the previous |buf| exactly, deflate() only
+  // reports the end now, without output. 0 would mean "try again later".
+  size_t num_written = buf.size() - stream_.avail_out;
+  if (num_written == 0 && eof_) {
+    return -1;
+  }
+  return num_written;
 }
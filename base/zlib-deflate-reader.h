@@ -11,7 +11,12 @@
 // Applies deflate compression to the provided reader.
 class ZlibDeflateReader : public Reader {
  public:
-  static Result<std::unique_ptr<ZlibDeflateReader>> Create(Reader* reader);
+  // zlib's default trade-off between speed and size.
+  static constexpr int kDefaultLevel = 6;
+
+  // |level| ranges from 1 (fastest) to 9 (smallest output).
+  static Result<std::unique_ptr<ZlibDeflateReader>> Create(
+      Reader* reader, int level = kDefaultLevel);
 
   ZlibDeflateReader(const ZlibDeflateReader&) = delete;
   ZlibDeflateReader& operator=(const ZlibDeflateReader&) = delete;
@@ -26,7 +31,7 @@ class ZlibDeflateReader : public Reader {
   };
 
   explicit ZlibDeflateReader(Reader* reader);
-  Result<void> Init();
+  Result<void> Init(int level);
 
   Reader* const reader_;
   z_stream stream_{};
@@ -1,36 +1,152 @@
-#include <cstdlib>
-
-#include "base/logging.h"
-#include "base/stdin-reader.h"
 #include "base/zlib-deflate-reader.h"
 
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+
+#include "absl/types/span.h"
+#include "base/file-reader.h"
+#include "gtest/gtest.h"
+
 namespace {
 
-Result<void> Run() {
-  StdinReader stdin_reader;
+// Hands out |data| in reads of at most |max_read| bytes.
+class StringReader : public Reader {
+ public:
+  explicit StringReader(std::string data, size_t max_read = SIZE_MAX)
+      : data_(std::move(data)), max_read_(max_read) {}
+
+  Result<ssize_t> Read(absl::Span<char> buf) override {
+    if (offset_ == data_.size()) {
+      return -1;
+    }
+    size_t size = std::min({buf.size(), data_.size() - offset_, max_read_});
+    memcpy(buf.data(), data_.data() + offset_, size);
+    offset_ += size;
+    return size;
+  }
+
+ private:
+  const std::string data_;
+  const size_t max_read_;
+  size_t offset_ = 0;
+};
+
+// Text which compresses, with some noise so the output spans several reads.
+std::string Input(size_t size) {
+  std::mt19937 rng(size);
+  std::string ret;
+  while (ret.size() < size) {
+    ret += "thttpd serves static files ";
+    ret += static_cast<char>('a' + rng() % 26);
+  }
+  ret.resize(size);
+  return ret;
+}
 
-  auto zlib_reader = TRY(ZlibDeflateReader::Create(&stdin_reader));
+// Reads |reader| to the end with reads of |read_size| bytes. Every read before
+// the end has to produce output, the source never makes it wait.
+std::string ReadAll(Reader* reader, size_t read_size) {
+  std::string ret;
+  std::string buf(read_size, '\0');
   while (true) {
-    char buf[BUFSIZ];
-    ssize_t num_read = TRY(zlib_reader->Read(buf));
-    if (num_read == -1) {
+    auto num_read = reader->Read(absl::MakeSpan(&buf[0], buf.size()));
+    EXPECT_TRUE(num_read.ok());
+    if (!num_read.ok() || *num_read == -1) {
       break;
     }
-    fwrite(buf, 1, num_read, stdout);
+    EXPECT_GT(*num_read, 0);
+    if (*num_read <= 0) {
+      break;
+    }
+    ret.append(buf.data(), *num_read);
+  }
+  return ret;
+}
+
+std::string Gunzip(const std::string& compressed) {
+  z_stream stream{};
+  EXPECT_EQ(Z_OK, inflateInit2(&stream, 16 + MAX_WBITS));
+  stream.next_in =
+      reinterpret_cast<unsigned char*>(const_cast<char*>(compressed.data()));
+  stream.avail_in = compressed.size();
+  std::string ret;
+  int status = Z_OK;
+  while (status == Z_OK) {
+    char buf[4096];
+    stream.next_out = reinterpret_cast<unsigned char*>(buf);
+    stream.avail_out = sizeof(buf);
+    status = inflate(&stream, Z_NO_FLUSH);
+    ret.append(buf, sizeof(buf) - stream.avail_out);
   }
+  EXPECT_EQ(Z_STREAM_END, status);
+  inflateEnd(&stream);
+  return ret;
+}
 
-  return {};
+std::string Compress(const std::string& input, size_t read_size) {
+  StringReader source(input, /*max_read=*/1000);
+  auto reader = ZlibDeflateReader::Create(&source);
+  EXPECT_TRUE(reader.ok());
+  if (!reader.ok()) {
+    return "";
+  }
+  return ReadAll(reader->get(), read_size);
 }
 
 }  // namespace
 
-// Simple compression program which reads from stdin and writes to stdout.
-int main() {
-  auto result = Run();
-  if (!result.ok()) {
-    LOG(ERR) << result.err();
-    return EXIT_FAILURE;
+TEST(ZlibDeflateReaderTest, RoundTrip) {
+  std::string input = Input(100000);
+  for (size_t read_size : {1, 7, 4096, 65536}) {
+    EXPECT_EQ(input, Gunzip(Compress(input, read_size))) << read_size;
+  }
+}
+
+TEST(ZlibDeflateReaderTest, Empty) {
+  EXPECT_EQ("", Gunzip(Compress("", 4096)));
+}
+
+// The output ends exactly where a read's buffer is full: the next read has to
+// report the end right away.
+TEST(ZlibDeflateReaderTest, ExactFill) {
+  std::string input = Input(100000);
+  std::string compressed = Compress(input, 65536);
+  ASSERT_FALSE(compressed.empty());
+
+  EXPECT_EQ(compressed, Compress(input, compressed.size()));
+  for (size_t read_size = 1; read_size <= 64; ++read_size) {
+    if (compressed.size() % read_size == 0) {
+      EXPECT_EQ(compressed, Compress(input, read_size)) << read_size;
+    }
   }
+}
+
+// How a file is gzipped as it's sent, in reads which leave room for the chunk
+// framing in the send buffer.
+TEST(ZlibDeflateReaderTest, FileSource) {
+  std::string path = "/tmp/zlib-deflate-reader_test-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  ASSERT_NE(-1, fd);
+  std::string input = Input(100000);
+  ASSERT_EQ(static_cast<ssize_t>(input.size()),
+            write(fd, input.data(), input.size()));
+  close(fd);
 
-  return EXIT_SUCCESS;
+  std::string compressed = Compress(input, 65536);
+  for (size_t read_size : {size_t{8172}, compressed.size()}) {
+    auto file_reader = FileReader::Create(path);
+    ASSERT_TRUE(file_reader.ok());
+    auto reader = ZlibDeflateReader::Create(&*file_reader);
+    ASSERT_TRUE(reader.ok());
+    EXPECT_EQ(compressed, ReadAll(reader->get(), read_size)) << read_size;
+  }
+  unlink(path.c_str());
 }
@@ -0,0 +1,166 @@
+#include "main/byte-range.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+
+namespace byte_range {
+
+namespace {
+
+constexpr char kBytesUnit[] = "bytes=";
+
+// Unlike absl::SimpleAtoi, rejects signs and whitespace.
+bool ParseOffset(absl::string_view text, off_t* result) {
+  if (text.empty() ||
+      !std::all_of(text.begin(), text.end(), absl::ascii_isdigit)) {
+    return false;
+  }
+
+  uint64_t value;
+  if (!absl::SimpleAtoi(text, &value) ||
+      value > static_cast<uint64_t>(INT64_MAX)) {
+    return false;
+  }
+  *result = value;
+  return true;
+}
+
+}  // namespace
+
+absl::optional<std::vector<Range>> Parse(absl::string_view field_value,
+                                         off_t size) {
+  if (!absl::StartsWithIgnoreCase(field_value, kBytesUnit)) {
+    return absl::nullopt;
+  }
+  field_value.remove_prefix(strlen(kBytesUnit));
+
+  std::vector<Range> ranges;
+  size_t num_specs = 0;
+  for (absl::string_view spec : absl::StrSplit(field_value, ',')) {
+    spec = absl::StripAsciiWhitespace(spec);
+    // Empty list elements are allowed. rfc7230 - 7
+    if (spec.empty()) {
+      continue;
+    }
+    if (++num_specs > kMaxRanges) {
+      return absl::nullopt;
+    }
+
+    size_t dash = spec.find('-');
+    if (dash == absl::string_view::npos) {
+      return absl::nullopt;
+    }
+    absl::string_view first_text = spec.substr(0, dash);
+    absl::string_view last_text = spec.substr(dash + 1);
+
+    // suffix-byte-range-spec: the final |length| bytes.
+    if (first_text.empty()) {
+      off_t length;
+      if (!ParseOffset(last_text, &length)) {
+        return absl::nullopt;
+      }
+      if (length == 0 || size == 0) {
+        continue;
+      }
+      ranges.push_back({std::max<off_t>(0, size - length), size - 1});
+      continue;
+    }
+
+    Range range;
+    if (!ParseOffset(first_text, &range.first)) {
+      return absl::nullopt;
+    }
+    range.last = size - 1;
+    if (!last_text.empty()) {
+      off_t last;
+      if (!ParseOffset(last_text, &last) || last < range.first) {
+        return absl::nullopt;
+      }
+      range.last = std::min(range.last, last);
+    }
+
+    if (range.first >= size) {
+      continue;
+    }
+    ranges.push_back(range);
+  }
+
+  if (num_specs == 0) {
+    return absl::nullopt;
+  }
+
+  // Otherwise a few bytes requested many times over would multiply the
+  // response.
+  std::sort(ranges.begin(), ranges.end(),
+            [](const Range& a, const Range& b) { return a.first < b.first; });
+  std::vector<Range> coalesced;
+  for (const auto& range : ranges) {
+    if (!coalesced.empty() && range.first <= coalesced.back().last + 1) {
+      coalesced.back().last = std::max(coalesced.back().last, range.last);
+    } else {
+      coalesced.push_back(range);
+    }
+  }
+
+  return coalesced;
+}
+
+absl::optional<std::vector<Range>> ForRequest(
+    const HttpRequest& request, off_t size, absl::string_view etag,
+    absl::string_view last_modified) {
+  if (request.method != HttpRequest::Method::kGet) {
+    return absl::nullopt;
+  }
+
+  absl::string_view range = request.header(HttpRequest::Header::kRange);
+  if (range.empty()) {
+    return absl::nullopt;
+  }
+
+  // If-Range needs a strong match, otherwise the whole representation is sent.
+  absl::string_view if_range = request.header(HttpRequest::Header::kIfRange);
+  if (!if_range.empty() && if_range != etag && if_range != last_modified) {
+    return absl::nullopt;
+  }
+
+  return Parse(range, size);
+}
+
+std::string ContentRange(const Range* range, off_t size) {
+  if (!range) {
+    return absl::StrCat("bytes */", size);
+  }
+
+  return absl::StrCat("bytes ", range->first, "-", range->last, "/", size);
+}
+
+std::string MakeBoundary() {
+  thread_local std::mt19937_64 rng(std::random_device{}());
+  return absl::StrCat("THTTPD_", absl::Hex(rng(), absl::kZeroPad16),
+                      absl::Hex(rng(), absl::kZeroPad16));
+}
+
+std::string MultipartContentType(absl::string_view boundary) {
+  return absl::StrCat("multipart/byteranges; boundary=", boundary);
+}
+
+std::string MultipartPartHeader(absl::string_view boundary,
+                                absl::string_view content_type,
+                                const Range& range, off_t size) {
+  return absl::StrCat("\r\n--", boundary, "\r\nContent-Type: ", content_type,
+                      "\r\nContent-Range: ", ContentRange(&range, size),
+                      "\r\n\r\n");
+}
+
+std::string MultipartCloseDelimiter(absl::string_view boundary) {
+  return absl::StrCat("\r\n--", boundary, "--\r\n");
+}
+
+}  // namespace byte_range
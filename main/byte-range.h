@@ -0,0 +1,67 @@
+#ifndef MAIN_BYTE_RANGE_H_
+#define MAIN_BYTE_RANGE_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "main/http-request.h"
+
+// Byte range requests. See rfc7233.
+namespace byte_range {
+
+// Inclusive range of byte offsets.
+struct Range {
+  off_t first = 0;
+  off_t last = 0;
+
+  off_t length() const { return last - first + 1; }
+};
+
+// More ranges than this in one request are ignored and the whole
+// representation is served, to bound the per-request work.
+constexpr size_t kMaxRanges = 16;
+
+// Parses a Range field value for a representation of |size| bytes.
+// Returns nullopt if the field is malformed or not a "bytes" range, in which
+// case it should be ignored. Returns an empty vector if no range is
+// satisfiable, which should be answered with 416. rfc7233 - 2.1
+// Overlapping and adjacent ranges are coalesced, so the result is sorted and
+// disjoint. rfc7233 - 4.1, 6.1
+absl::optional<std::vector<Range>> Parse(absl::string_view field_value,
+                                         off_t size);
+
+// Returns the ranges |request| asks for, or nullopt if the whole
+// representation should be sent. Honors If-Range against |etag| and
+// |last_modified|. rfc7233 - 3.2
+absl::optional<std::vector<Range>> ForRequest(const HttpRequest& request,
+                                              off_t size,
+                                              absl::string_view etag,
+                                              absl::string_view last_modified);
+
+// Content-Range field value for |range| of a |size| byte representation, or
+// for no satisfiable range if |range| is null. rfc7233 - 4.2
+std::string ContentRange(const Range* range, off_t size);
+
+// Returns a boundary for a new multipart/byteranges body. It's random so that
+// it can't be predicted and planted in the representation. rfc2046 - 5.1.1
+std::string MakeBoundary();
+
+// Value of the Content-Type field for a multipart/byteranges response.
+std::string MultipartContentType(absl::string_view boundary);
+
+// Delimiter and header fields that precede the bytes of |range| in a
+// multipart/byteranges body. rfc7233 - Appendix A
+std::string MultipartPartHeader(absl::string_view boundary,
+                                absl::string_view content_type,
+                                const Range& range, off_t size);
+
+// Ends a multipart/byteranges body.
+std::string MultipartCloseDelimiter(absl::string_view boundary);
+
+}  // namespace byte_range
+
+#endif  // MAIN_BYTE_RANGE_H_
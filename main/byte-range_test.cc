@@ -0,0 +1,132 @@
+#include "main/byte-range.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+using byte_range::Range;
+using Pairs = std::vector<std::pair<off_t, off_t>>;
+
+Pairs ToPairs(const std::vector<Range>& ranges) {
+  Pairs result;
+  for (const auto& range : ranges) {
+    result.emplace_back(range.first, range.last);
+  }
+  return result;
+}
+
+void SetHeader(HttpRequest* request, HttpRequest::Header header,
+               absl::string_view value) {
+  request->header_values_[static_cast<size_t>(header)] = value;
+}
+
+}  // namespace
+
+TEST(ByteRangeTest, ParseSingle) {
+  auto ranges = byte_range::Parse("bytes=0-499", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{0, 499}}), ToPairs(*ranges));
+
+  // Last byte past the end is clamped.
+  ranges = byte_range::Parse("bytes=500-5000", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{500, 999}}), ToPairs(*ranges));
+
+  ranges = byte_range::Parse("bytes=900-", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{900, 999}}), ToPairs(*ranges));
+
+  ranges = byte_range::Parse("bytes=-100", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{900, 999}}), ToPairs(*ranges));
+
+  ranges = byte_range::Parse("bytes=-5000", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{0, 999}}), ToPairs(*ranges));
+}
+
+TEST(ByteRangeTest, ParseMultiple) {
+  auto ranges = byte_range::Parse("bytes=0-0, ,-1,2000-,10-19", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{0, 0}, {10, 19}, {999, 999}}), ToPairs(*ranges));
+}
+
+TEST(ByteRangeTest, ParseCoalesces) {
+  auto ranges = byte_range::Parse("bytes=30-39,0-9,5-14,15-19,-5", 40);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{0, 19}, {30, 39}}), ToPairs(*ranges));
+
+  ranges = byte_range::Parse("bytes=0-,0-,0-,0-", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{0, 999}}), ToPairs(*ranges));
+}
+
+TEST(ByteRangeTest, MakeBoundary) {
+  std::string boundary = byte_range::MakeBoundary();
+  EXPECT_NE(boundary, byte_range::MakeBoundary());
+  // bchars, at most 70 of them. rfc2046 - 5.1.1
+  EXPECT_LE(boundary.size(), 70u);
+  EXPECT_EQ(std::string::npos,
+            boundary.find_first_not_of("0123456789abcdefHPTD_"));
+}
+
+TEST(ByteRangeTest, ParseUnsatisfiable) {
+  auto ranges = byte_range::Parse("bytes=1000-", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_TRUE(ranges->empty());
+
+  ranges = byte_range::Parse("bytes=-0", 1000);
+  ASSERT_TRUE(ranges);
+  EXPECT_TRUE(ranges->empty());
+
+  ranges = byte_range::Parse("bytes=-10", 0);
+  ASSERT_TRUE(ranges);
+  EXPECT_TRUE(ranges->empty());
+}
+
+TEST(ByteRangeTest, ParseInvalid) {
+  EXPECT_FALSE(byte_range::Parse("items=0-1", 1000));
+  EXPECT_FALSE(byte_range::Parse("bytes=", 1000));
+  EXPECT_FALSE(byte_range::Parse("bytes=5", 1000));
+  EXPECT_FALSE(byte_range::Parse("bytes=5-1", 1000));
+  EXPECT_FALSE(byte_range::Parse("bytes=+5-10", 1000));
+  EXPECT_FALSE(byte_range::Parse("bytes=a-b", 1000));
+  EXPECT_FALSE(byte_range::Parse("bytes=0-1,x", 1000));
+
+  std::string many = "bytes=0-0";
+  for (size_t i = 0; i < byte_range::kMaxRanges; ++i) {
+    many += ",0-0";
+  }
+  EXPECT_FALSE(byte_range::Parse(many, 1000));
+}
+
+TEST(ByteRangeTest, ForRequest) {
+  constexpr char kETag[] = "\"1-2-3\"";
+  constexpr char kLastModified[] = "Sun, 06 Nov 1994 08:49:37 GMT";
+
+  HttpRequest request;
+  request.method = HttpRequest::Method::kGet;
+  EXPECT_FALSE(byte_range::ForRequest(request, 100, kETag, kLastModified));
+
+  SetHeader(&request, HttpRequest::Header::kRange, "bytes=0-9");
+  auto ranges = byte_range::ForRequest(request, 100, kETag, kLastModified);
+  ASSERT_TRUE(ranges);
+  EXPECT_EQ((Pairs{{0, 9}}), ToPairs(*ranges));
+
+  SetHeader(&request, HttpRequest::Header::kIfRange, kETag);
+  EXPECT_TRUE(byte_range::ForRequest(request, 100, kETag, kLastModified));
+  SetHeader(&request, HttpRequest::Header::kIfRange, kLastModified);
+  EXPECT_TRUE(byte_range::ForRequest(request, 100, kETag, kLastModified));
+  SetHeader(&request, HttpRequest::Header::kIfRange, "\"other\"");
+  EXPECT_FALSE(byte_range::ForRequest(request, 100, kETag, kLastModified));
+  SetHeader(&request, HttpRequest::Header::kIfRange, "W/\"1-2-3\"");
+  EXPECT_FALSE(byte_range::ForRequest(request, 100, kETag, kLastModified));
+}
+
+TEST(ByteRangeTest, ContentRange) {
+  Range range{10, 19};
+  EXPECT_EQ("bytes 10-19/100", byte_range::ContentRange(&range, 100));
+  EXPECT_EQ("bytes */100", byte_range::ContentRange(nullptr, 100));
+}
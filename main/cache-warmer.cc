@@ -0,0 +1,236 @@
+#include "main/cache-warmer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "absl/types/optional.h"
+#include "base/file-reader.h"
+#include "base/logging.h"
+#include "base/once-callback.h"
+#include "base/scoped-fd.h"
+#include "base/util.h"
+
+namespace {
+
+// Bounds the size of the hot set file.
+constexpr size_t kMaxHotFiles = 10000;
+
+Result<std::vector<hot_set::HotFile>> ReadHotSet(const std::string& path) {
+  auto reader = TRY(FileReader::Create(path));
+  std::string data;
+  char buf[4096];
+  while (true) {
+    ssize_t num_read = TRY(reader.Read(buf));
+    if (num_read == -1) {
+      break;
+    }
+    data.append(buf, num_read);
+  }
+  return hot_set::Parse(data);
+}
+
+}  // namespace
+
+CacheWarmer::CacheWarmer(const Config& config, FileCache* file_cache,
+                         CompressionCache* compression_cache,
+                         ThreadPool* thread_pool)
+    : path_to_serve_(config.path_to_serve),
+      hot_set_file_(config.hot_set_file),
+      hot_set_interval_(absl::Milliseconds(config.hot_set_interval_ms)),
+      warm_up_timeout_(absl::Milliseconds(config.warm_up_timeout_ms)),
+      warm_up_max_bytes_(config.warm_up_max_bytes),
+      ready_file_(config.ready_file),
+      file_cache_(file_cache),
+      compression_cache_(compression_cache),
+      thread_pool_(thread_pool) {}
+
+CacheWarmer::~CacheWarmer() {
+  if (!thread_.joinable()) {
+    return;
+  }
+
+  // |WarmNext| doesn't start any more files once stopped.
+  stop_.Notify();
+  thread_.join();
+  warmed_up_.WaitForNotification();
+}
+
+void CacheWarmer::Start() {
+  started_at_ = absl::Now();
+
+  // Left by the previous run, which was ready.
+  if (!ready_file_.empty()) {
+    unlink(ready_file_.c_str());
+  }
+
+  if (hot_set_file_.empty()) {
+    warmed_up_.Notify();
+    SetReady();
+    return;
+  }
+
+  auto files = ReadHotSet(hot_set_file_);
+  if (!files.ok()) {
+    VLOG(1) << "Not warming up: " << files.err();
+  }
+
+  size_t num_loops;
+  {
+    absl::MutexLock lock(&mu_);
+    if (files.ok()) {
+      to_warm_ = std::move(*files);
+    }
+    num_loops = std::min(thread_pool_->size(), to_warm_.size());
+    num_warming_ = num_loops;
+  }
+  if (num_loops == 0) {
+    warmed_up_.Notify();
+  }
+  for (size_t i = 0; i < num_loops; ++i) {
+    thread_pool_->PostTask(BindOnce(&CacheWarmer::WarmNext, this));
+  }
+
+  thread_ = std::thread(&CacheWarmer::Run, this);
+}
+
+void CacheWarmer::WarmNext() {
+  while (true) {
+    hot_set::HotFile file;
+    {
+      absl::MutexLock lock(&mu_);
+      if (next_to_warm_ == to_warm_.size() || stop_.HasBeenNotified() ||
+          absl::Now() - started_at_ >= warm_up_timeout_) {
+        if (--num_warming_ == 0) {
+          warmed_up_.Notify();
+        }
+        return;
+      }
+      file = to_warm_[next_to_warm_++];
+    }
+
+    auto entry = file_cache_->Lookup(file.path);
+    if (!entry.ok()) {
+      VLOG(1) << "Not warming " << file.path << ": " << entry.err();
+      continue;
+    }
+
+    {
+      // Smaller files further down may still fit.
+      absl::MutexLock lock(&mu_);
+      if (bytes_warmed_ + (*entry)->size > warm_up_max_bytes_) {
+        continue;
+      }
+      bytes_warmed_ += (*entry)->size;
+      ++num_warmed_;
+    }
+
+    // Compressing reads the file anyway, but it may be loaded from the
+    // DiskCache instead, and identity responses send it too.
+    posix_fadvise(*(*entry)->fd, 0, 0, POSIX_FADV_WILLNEED);
+    if (!compression_cache_->ShouldCache(**entry)) {
+      continue;
+    }
+
+    VLOG(3) << "Warming " << file.path;
+    compression_cache_->Warm(std::move(*entry), file.encoding, file.frequency,
+                             [this] {
+                               thread_pool_->PostTask(
+                                   BindOnce(&CacheWarmer::WarmNext, this));
+                             });
+    return;
+  }
+}
+
+void CacheWarmer::Run() {
+  if (!warmed_up_.WaitForNotificationWithDeadline(started_at_ +
+                                                  warm_up_timeout_)) {
+    LOG(WARN) << "Warm-up ran out of time";
+  }
+  SetReady();
+
+  while (!stop_.WaitForNotificationWithTimeout(hot_set_interval_)) {
+    Record();
+  }
+}
+
+void CacheWarmer::SetReady() {
+  {
+    absl::MutexLock lock(&mu_);
+    LOG(INFO) << "Warmed up " << num_warmed_ << " files (" << bytes_warmed_
+              << " bytes) in " << absl::Now() - started_at_;
+  }
+
+  if (ready_file_.empty()) {
+    return;
+  }
+  ScopedFd fd(open(ready_file_.c_str(), O_WRONLY | O_CREAT | O_TRUNC |
+                                            O_CLOEXEC, 0644));
+  if (!fd) {
+    LOG(WARN) << "Failed to create " << ready_file_ << ": " << strerror(errno);
+  }
+}
+
+void CacheWarmer::Record() {
+  absl::Mutex mu;
+  absl::optional<std::vector<hot_set::HotFile>> files;
+  compression_cache_->GetHotFiles(
+      [&mu, &files](std::vector<hot_set::HotFile> hot_files) {
+        absl::MutexLock lock(&mu);
+        files = std::move(hot_files);
+      });
+
+  std::vector<hot_set::HotFile> targets;
+  {
+    absl::MutexLock lock(&mu);
+    auto got_files = [&] {
+      mu.AssertHeld();
+      return files.has_value();
+    };
+    mu.Await(absl::Condition(&got_files));
+
+    // Recorded relative to the served directory, which may move between
+    // runs.
+    for (hot_set::HotFile& file : *files) {
+      if (targets.size() == kMaxHotFiles) {
+        break;
+      }
+      if (file.path == path_to_serve_ ||
+          !util::IsPathWithin(file.path, path_to_serve_)) {
+        continue;
+      }
+      file.path.erase(0, path_to_serve_.size());
+      targets.push_back(std::move(file));
+    }
+  }
+
+  auto result = WriteHotSet(hot_set::Format(targets));
+  if (!result.ok()) {
+    LOG(WARN) << "Failed to record the hot set: " << result.err();
+    return;
+  }
+  VLOG(1) << "Recorded " << targets.size() << " hot files";
+}
+
+Result<void> CacheWarmer::WriteHotSet(const std::string& data) {
+  // Written to a temporary file first, so the next run never reads a partial
+  // one.
+  std::string temp_path = absl::StrCat(hot_set_file_, ".tmp");
+  ScopedFd fd(open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC |
+                                          O_CLOEXEC, 0644));
+  if (!fd) {
+    return BuildPosixErr(absl::StrCat("Failed to create ", temp_path));
+  }
+
+  TRY(util::WriteAll(*fd, data, temp_path));
+
+  if (rename(temp_path.c_str(), hot_set_file_.c_str()) < 0) {
+    return BuildPosixErr(absl::StrCat("Failed to rename to ", hot_set_file_));
+  }
+  return {};
+}
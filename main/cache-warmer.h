@@ -0,0 +1,75 @@
+#ifndef MAIN_CACHE_WARMER_H_
+#define MAIN_CACHE_WARMER_H_
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "base/err.h"
+#include "main/compression-cache.h"
+#include "main/config.h"
+#include "main/file-cache.h"
+#include "main/hot-set.h"
+#include "main/thread-pool.h"
+
+// Warms up the caches after a restart, so a new instance doesn't start out
+// slow.
+//
+// The files in the CompressionCache are recorded in a hot set file
+// periodically, most requested first. At startup, the ones recorded by the
+// previous run are read ahead into the page cache and compressed again, in
+// parallel on the ThreadPool, while requests are already served. No more
+// files are started once the time or byte budget is spent. The ready file is
+// created once warm-up is done, or when its time is up.
+class CacheWarmer {
+ public:
+  CacheWarmer(const Config& config, FileCache* file_cache,
+              CompressionCache* compression_cache, ThreadPool* thread_pool);
+  CacheWarmer(const CacheWarmer&) = delete;
+  CacheWarmer& operator=(const CacheWarmer&) = delete;
+  // Stops recording, and waits for the files being warmed.
+  ~CacheWarmer();
+
+  // Starts warming up, then recording the hot set. Call once.
+  void Start();
+
+ private:
+  // Runs on |thread_pool_|. Warms files until one is being compressed, or
+  // none are left to start.
+  void WarmNext();
+  // Runs on |thread_|.
+  void Run();
+  void SetReady();
+  // Writes the hot set of the files cached now.
+  void Record();
+  Result<void> WriteHotSet(const std::string& data);
+
+  const std::string path_to_serve_;
+  const std::string hot_set_file_;
+  const absl::Duration hot_set_interval_;
+  const absl::Duration warm_up_timeout_;
+  const size_t warm_up_max_bytes_;
+  const std::string ready_file_;
+
+  FileCache* const file_cache_;
+  CompressionCache* const compression_cache_;
+  ThreadPool* const thread_pool_;
+
+  absl::Time started_at_;
+  absl::Notification warmed_up_;
+  absl::Notification stop_;
+  std::thread thread_;
+
+  absl::Mutex mu_;
+  std::vector<hot_set::HotFile> to_warm_ GUARDED_BY(mu_);
+  size_t next_to_warm_ GUARDED_BY(mu_) = 0;
+  // Number of |WarmNext| loops which didn't end yet.
+  size_t num_warming_ GUARDED_BY(mu_) = 0;
+  size_t num_warmed_ GUARDED_BY(mu_) = 0;
+  size_t bytes_warmed_ GUARDED_BY(mu_) = 0;
+};
+
+#endif  // MAIN_CACHE_WARMER_H_
@@ -1,128 +1,742 @@
 #include "main/compression-cache.h"
 
-#include <forward_list>
+#include <fcntl.h>
+#include <sys/mman.h>
 
+#include <algorithm>
+#include <iterator>
+#include <list>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/hash/hash.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
 #include "base/err.h"
 #include "base/file-reader.h"
 #include "base/logging.h"
+#include "base/mpsc-queue.h"
+#include "base/once-callback.h"
 #include "base/scoped-destructor.h"
+#include "base/task-runner.h"
+#include "base/util.h"
 #include "base/zlib-deflate-reader.h"
+#include "main/frequency-sketch.h"
+#include "main/parallel-gzip.h"
+
+namespace {
+
+// Share of the cache the protected segment may take.
+constexpr size_t kProtectedPercent = 80;
+
+// Files must have been requested this many times to be cached.
+constexpr int kMinAdmitFrequency = 2;
+
+// The sketch tracks at least this many files.
+constexpr size_t kMinSketchKeys = 1024;
+
+// Seals making a complete file immutable. No writable mappings of it exist,
+// so F_SEAL_WRITE can't fail.
+constexpr int kCompleteSeals =
+    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+
+// Lowers |num_shards| so that each holds at least one of |max_files|, unless
+// no files are cached at all.
+size_t NumShardsFor(size_t num_shards, size_t max_files) {
+  return max_files == 0 ? num_shards : std::min(num_shards, max_files);
+}
+
+// Like |CachedFile::IsCurrent|, for files which aren't encoded yet.
+bool IsSameVersion(const FileCache::Entry& a, const FileCache::Entry& b) {
+  return a.mtime == b.mtime && a.size == b.size && a.inode == b.inode;
+}
+
+}  // namespace
 
 // static
 Result<std::shared_ptr<CompressionCache::CachedFile>>
-CompressionCache::CachedFile::Create(absl::string_view path) {
-  ChunkList chunks;
-
-  auto file_reader = TRY(FileReader::Create(path));
-  auto zlib_reader = TRY(ZlibDeflateReader::Create(&file_reader));
-
-  auto insert_at = chunks.before_begin();
-  size_t chunk_length = 0;
-  bool eof = false;
-  size_t total_size = 0;
-
-  while (!eof) {
-    insert_at = chunks.emplace_after(insert_at);
-    chunk_length = 0;
-    while (chunk_length < insert_at->size()) {
-      ssize_t num_read =
-          TRY(zlib_reader->Read({insert_at->data() + chunk_length,
-                                 insert_at->size() - chunk_length}));
-      if (num_read == -1) {
-        eof = true;
-        break;
+CompressionCache::CachedFile::Create(const FileCache::Entry& source,
+                                     int level) {
+  ScopedFd fd(memfd_create("thttpd-compressed", MFD_CLOEXEC |
+                                                    MFD_ALLOW_SEALING));
+  if (!fd) {
+    return BuildPosixErr("memfd_create failed");
+  }
+  return std::shared_ptr<CachedFile>(
+      new CachedFile(source, level, std::move(fd)));
+}
+
+CompressionCache::CachedFile::CachedFile(const FileCache::Entry& source,
+                                         int level, ScopedFd fd)
+    : fd_(std::move(fd)),
+      level_(level),
+      source_mtime_(source.mtime),
+      source_size_(source.size),
+      source_inode_(source.inode) {}
+
+Result<void> CompressionCache::CachedFile::Append(absl::string_view data) {
+  size_t size = size_.load(std::memory_order_relaxed);
+  while (!data.empty()) {
+    ssize_t written = pwrite(*fd_, data.data(), data.size(), size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
       }
-      total_size += num_read;
+      return BuildPosixErr("Failed to write encoded file");
+    }
+    size += written;
+    data.remove_prefix(written);
+  }
+
+  // Readers only read bytes which were published here.
+  size_.store(size, std::memory_order_release);
+  NotifyWaiters();
+  return {};
+}
+
+Result<void> CompressionCache::CachedFile::Finish() {
+  if (fcntl(*fd_, F_ADD_SEALS, kCompleteSeals) < 0) {
+    return BuildPosixErr("Failed to seal encoded file");
+  }
+
+  state_.store(State::kComplete, std::memory_order_release);
+  NotifyWaiters();
+  return {};
+}
+
+void CompressionCache::CachedFile::Fail(const Err& err) {
+  error_ = err.msg();
+  state_.store(State::kFailed, std::memory_order_release);
+  NotifyWaiters();
+}
+
+size_t CompressionCache::CachedFile::memory_size() const {
+  ABSL_ASSERT(state() == State::kComplete);
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return sizeof(CachedFile) + (size() + page_size - 1) / page_size * page_size;
+}
+
+void CompressionCache::CachedFile::NotifyWhenReadable(
+    size_t offset, std::function<void()> callback) {
+  {
+    absl::MutexLock lock(&mu_);
+    if (state() == State::kEncoding && size() == offset) {
+      waiters_.push_back(std::move(callback));
+      return;
     }
   }
 
-  return std::make_shared<CachedFile>(std::move(chunks), chunk_length,
-                                      total_size);
+  callback();
 }
 
-CompressionCache::CachedFile::CachedFile(ChunkList chunks,
-                                         size_t last_chunk_length, size_t size)
-    : chunks_(std::move(chunks)),
-      last_chunk_length_(last_chunk_length),
-      size_(size) {}
+void CompressionCache::CachedFile::NotifyWhenEncoded(
+    std::function<void()> callback) {
+  // Waiters run after every append, so wait again until encoding ended.
+  NotifyWhenReadable(size(), [this, callback = std::move(callback)] {
+    if (state() == State::kEncoding) {
+      NotifyWhenEncoded(callback);
+      return;
+    }
+    callback();
+  });
+}
+
+void CompressionCache::CachedFile::NotifyWaiters() {
+  std::vector<std::function<void()>> waiters;
+  {
+    absl::MutexLock lock(&mu_);
+    waiters.swap(waiters_);
+  }
+
+  for (const auto& waiter : waiters) {
+    waiter();
+  }
+}
 
 CompressionCache::File::File(std::shared_ptr<CachedFile> file)
-    : file_(std::move(file)), cur_chunk_(file_->chunks().cbegin()) {}
+    : file_(std::move(file)) {}
+
+class CompressionCache::Shard {
+ public:
+  // Holds up to |max_size_bytes| of files.
+  Shard(size_t max_size_bytes, size_t max_files,
+        const CompressionPolicy* policy, ThreadPool* thread_pool,
+        DiskCache* disk_cache);
+  Shard(const Shard&) = delete;
+  Shard& operator=(const Shard&) = delete;
+
+  void RequestFile(std::shared_ptr<const FileCache::Entry> file,
+                   content_encoding::Encoding encoding, FileCallback callback);
+  void Invalidate(absl::string_view path);
+  void GetHotFiles(
+      std::function<void(std::vector<hot_set::HotFile>)> callback);
+  void Warm(std::shared_ptr<const FileCache::Entry> file,
+            content_encoding::Encoding encoding, int frequency,
+            std::function<void()> callback);
+
+ private:
+  using Key = std::pair<std::string, content_encoding::Encoding>;
+
+  // Hits of a cached file on the fast path which the cache thread didn't
+  // account for yet.
+  struct PendingHits {
+    std::atomic<int> count{0};
+  };
+  struct PublishedFile {
+    std::shared_ptr<CachedFile> file;
+    std::shared_ptr<PendingHits> hits;
+  };
+  using PathToCachedFile = absl::flat_hash_map<Key, PublishedFile>;
+
+  // Queued when the pending hits of a file go up from 0.
+  struct FastPathHit {
+    Key key;
+    std::shared_ptr<const FileCache::Entry> source;
+    std::shared_ptr<PendingHits> hits;
+  };
+
+  struct PendingRead {
+    // The version of the file being encoded.
+    std::shared_ptr<const FileCache::Entry> source;
+    // Set once encoding started. Later requests read it as it grows.
+    std::shared_ptr<CachedFile> file;
+    std::vector<FileCallback> callbacks;
+    // Set if the file changed while it was being encoded.
+    bool invalidated = false;
+  };
+  using PathToPendingRead = absl::flat_hash_map<Key, PendingRead>;
+
+  struct Node {
+    Key key;
+    std::shared_ptr<CachedFile> file;
+    // Shared with the published snapshots. Kept when |file| is recompressed.
+    std::shared_ptr<PendingHits> hits = std::make_shared<PendingHits>();
+    bool is_protected = false;
+    bool recompressing = false;
+  };
+  // Most recently used first.
+  using Lru = std::list<Node>;
+
+  // Returns the calling thread's TaskRunner, which reads the misses it causes,
+  // or |task_runner_| if it has none.
+  std::shared_ptr<TaskRunner> CallerTaskRunner() const;
+  void RequestFileSlowPath(std::shared_ptr<const FileCache::Entry> file,
+                           Key key, FileCallback callback,
+                           std::shared_ptr<TaskRunner> caller);
+  // Applies the hits on the fast path to the LRU and the sketch.
+  void OnFastPathHits();
+  // Republishes the snapshot read by the fast path once the current batch of
+  // changes to the cache is done.
+  void SchedulePublish();
+  void Publish();
+  // Encodes a file on the thread which requested it, a chunk per task, so
+  // the responses streaming it are sent in between.
+  struct SerialEncoder;
+
+  // Run on |task_runner_| once a file was encoded.
+  using OnEncoded = void (Shard::*)(
+      Key key, Result<std::shared_ptr<CachedFile>> file);
+
+  // Prepares reading |source| and returns a callback which encodes it into
+  // |file|, calling |on_done| at the end.
+  Result<OnceCallback> PrepareEncoding(
+      std::shared_ptr<const FileCache::Entry> source, Key key,
+      std::shared_ptr<CachedFile> file, OnEncoded on_done);
+  void EncodeSome(std::shared_ptr<SerialEncoder> encoder);
+  // Returns true once the file of |encoder| is complete.
+  static Result<bool> EncodeChunk(SerialEncoder* encoder);
+  void OnParallelGzipPiece(Key key, std::shared_ptr<CachedFile> file,
+                           OnEncoded on_done, Result<absl::string_view> piece);
+  // Appends |piece| to |file|, or finishes it if |piece| is empty. Returns true
+  // once |file| is complete.
+  static Result<bool> AppendPiece(CachedFile* file,
+                                  Result<absl::string_view> piece);
+  void PostOnEncoded(OnEncoded on_done, Key key,
+                     Result<std::shared_ptr<CachedFile>> file);
+
+  // Runs on |thread_pool_|. Loads the encoding of |file| stored in
+  // |disk_cache_|, or has |caller| read it if there's none.
+  void LoadFile(std::shared_ptr<const FileCache::Entry> file, Key key,
+                int level, std::shared_ptr<TaskRunner> caller);
+  void ReadFile(std::shared_ptr<const FileCache::Entry> file, Key key,
+                int level, std::shared_ptr<TaskRunner> my_thread);
+  // Encodes |file| for |callback| alone, without caching it. For requests
+  // which can't follow the pending read of another version of the file.
+  void EncodeUncached(std::shared_ptr<const FileCache::Entry> file, Key key,
+                      FileCallback callback);
+  void OnUncachedEncoded(Key key, Result<std::shared_ptr<CachedFile>> file);
+  // Returns null if |disk_cache_| has no encoding of |source|.
+  Result<std::shared_ptr<CachedFile>> LoadFromDisk(
+      const FileCache::Entry& source, content_encoding::Encoding encoding);
+  // Writes |file| to |disk_cache_| on |thread_pool_|, unless it's there.
+  void StoreOnDisk(const Key& key, std::shared_ptr<CachedFile> file);
+  void OnStoredOnDisk(std::shared_ptr<CachedFile> file);
+  void OnReadStarted(Key key, std::shared_ptr<CachedFile> file);
+  void OnReadFile(Key key, Result<std::shared_ptr<CachedFile>> file);
+  void InvalidateOnTaskRunner(std::string path);
+  void GetHotFilesOnTaskRunner(
+      std::function<void(std::vector<hot_set::HotFile>)> callback);
+  void WarmOnTaskRunner(std::shared_ptr<const FileCache::Entry> file, Key key,
+                        int frequency, std::function<void()> callback,
+                        std::shared_ptr<TaskRunner> caller);
+
+  // Recompresses a hit file at the best level if it's popular enough.
+  void MaybeRecompress(Lru::iterator node,
+                       std::shared_ptr<const FileCache::Entry> source,
+                       int frequency);
+  void Recompress(std::shared_ptr<const FileCache::Entry> source, Key key,
+                  int level);
+  void OnRecompressed(Key key, Result<std::shared_ptr<CachedFile>> file);
 
-CompressionCache::CompressionCache(size_t max_size_bytes)
+  // Moves a hit file to the front of the protected segment.
+  void Touch(Lru::iterator it);
+  // Caches |file| if the admission policy lets it in.
+  void MaybeInsert(Key key, std::shared_ptr<CachedFile> file);
+  void Erase(Lru::iterator it);
+
+  const size_t max_size_bytes_;
+  // Each cached file holds a descriptor open.
+  const size_t max_files_;
+  const size_t max_protected_size_bytes_;
+  const CompressionPolicy* const policy_;
+  ThreadPool* const thread_pool_;
+  DiskCache* const disk_cache_;
+
+  // Fast path unlocked version of |key_to_node_| which can be accessed on any
+  // thread. Might be out of date. If there is a miss here, will fallback to
+  // slow path.
+  ABSL_CACHELINE_ALIGNED std::shared_ptr<const PathToCachedFile>
+      unlocked_path_to_cached_file_;
+
+  ABSL_CACHELINE_ALIGNED MpscQueue<FastPathHit> fast_path_hits_;
+  // Set while |OnFastPathHits| is posted and didn't start draining yet.
+  std::atomic<bool> fast_path_hits_posted_{false};
+
+  const ABSL_CACHELINE_ALIGNED std::shared_ptr<TaskRunner> task_runner_;
+
+  // Owned by |task_runner_|.
+  absl::flat_hash_map<Key, Lru::iterator> key_to_node_;
+  Lru probation_;
+  Lru protected_;
+  size_t size_bytes_ = 0;
+  size_t protected_size_bytes_ = 0;
+  FrequencySketch sketch_;
+  PathToPendingRead path_to_pending_read_;
+  bool publish_posted_ = false;
+};
+
+struct CompressionCache::Shard::SerialEncoder {
+  Key key;
+  std::shared_ptr<CachedFile> file;
+  OnEncoded on_done;
+  FileReader file_reader;
+  std::unique_ptr<ZlibDeflateReader> zlib_reader;
+};
+
+CompressionCache::Shard::Shard(size_t max_size_bytes, size_t max_files,
+                               const CompressionPolicy* policy,
+                               ThreadPool* thread_pool, DiskCache* disk_cache)
     : max_size_bytes_(max_size_bytes),
+      max_files_(max_files),
+      max_protected_size_bytes_(max_size_bytes / 100 * kProtectedPercent),
+      policy_(policy),
+      thread_pool_(thread_pool),
+      disk_cache_(disk_cache),
       unlocked_path_to_cached_file_(std::make_shared<PathToCachedFile>()),
-      task_runner_(TaskRunner::Create()) {}
+      task_runner_(TaskRunner::Create()),
+      sketch_(std::max<size_t>(max_size_bytes / kChunkSize,
+                               kMinSketchKeys)) {}
 
-void CompressionCache::RequestFile(absl::string_view path,
-                                   FileCallback callback) {
-  std::string str_path(path);
+void CompressionCache::Shard::RequestFile(
+    std::shared_ptr<const FileCache::Entry> file,
+    content_encoding::Encoding encoding, FileCallback callback) {
+  Key key(file->path, encoding);
 
   // Fast path: Check if the cache file is in the unlocked cache.
   {
     auto unlocked_path_to_cached_file =
         atomic_load(&unlocked_path_to_cached_file_);
-    auto it = unlocked_path_to_cached_file->find(str_path);
-    if (it != unlocked_path_to_cached_file->end()) {
-      callback(File(it->second));
+    auto it = unlocked_path_to_cached_file->find(key);
+    if (it != unlocked_path_to_cached_file->end() &&
+        it->second.file->IsCurrent(*file)) {
+      const PublishedFile& published = it->second;
+      callback(File(published.file));
+
+      // Only the first hit since the last batch queues the file.
+      if (published.hits->count.fetch_add(1, std::memory_order_relaxed) ==
+          0) {
+        fast_path_hits_.Push({std::move(key), std::move(file),
+                              published.hits});
+        if (!fast_path_hits_posted_.exchange(true,
+                                             std::memory_order_acq_rel)) {
+          task_runner_->PostTask(BindOnce(&Shard::OnFastPathHits, this));
+        }
+      }
       return;
     }
   }
 
-  task_runner_->PostTask(BindOnce(&CompressionCache::RequestFileSlowPath, this,
-                                  std::move(str_path), std::move(callback),
-                                  TaskRunner::CurrentTaskRunner()));
+  task_runner_->PostTask(BindOnce(&Shard::RequestFileSlowPath, this,
+                                  std::move(file), std::move(key),
+                                  std::move(callback), CallerTaskRunner()));
+}
+
+std::shared_ptr<TaskRunner> CompressionCache::Shard::CallerTaskRunner() const {
+  auto caller = TaskRunner::CurrentTaskRunner();
+  return caller ? caller : task_runner_;
 }
 
-void CompressionCache::RequestFileSlowPath(std::string path,
-                                           FileCallback callback,
-                                           std::shared_ptr<TaskRunner> caller) {
+void CompressionCache::Shard::RequestFileSlowPath(
+    std::shared_ptr<const FileCache::Entry> file, Key key,
+    FileCallback callback, std::shared_ptr<TaskRunner> caller) {
   ABSL_ASSERT(task_runner_->IsCurrentThread());
 
-  // Check the real |path_to_cached_file_|.
+  uint64_t hash = absl::Hash<Key>()(key);
+  sketch_.Increment(hash);
+  int frequency = sketch_.Frequency(hash);
+
+  // Check the real cache.
   {
-    auto it = path_to_cached_file_.find(path);
-    if (it != path_to_cached_file_.end()) {
-      // TODO(bcf): Need some heuristic for when to update
-      // unlocked_path_to_cache_file_.
+    auto it = key_to_node_.find(key);
+    if (it != key_to_node_.end()) {
+      Lru::iterator node = it->second;
+      if (node->file->IsCurrent(*file)) {
+        Touch(node);
+        callback(File(node->file));
+        MaybeRecompress(node, std::move(file), frequency);
+        return;
+      }
+      Erase(node);
+    }
+  }
+
+  // Cached file doesn't exist, need to load it. Let the calling thread read the
+  // file for load balancing and then send it back to us.
+
+  auto& pending_read = path_to_pending_read_[key];
+  if (pending_read.source) {
+    // The file changed since the pending read started, which encodes the old
+    // version.
+    if (pending_read.invalidated ||
+        !IsSameVersion(*pending_read.source, *file)) {
+      caller->PostTask(BindOnce(&Shard::EncodeUncached, this,
+                                std::move(file), std::move(key),
+                                std::move(callback)));
+      return;
+    }
 
-      callback(File(it->second));
+    // Follow the encoder if it already started.
+    if (pending_read.file) {
+      callback(File(pending_read.file));
       return;
     }
+
+    pending_read.callbacks.push_back(std::move(callback));
+    return;
   }
 
-  auto pending_read_it = path_to_pending_read_.emplace().first;
+  pending_read.source = file;
+  pending_read.callbacks.push_back(std::move(callback));
 
-  // Cached file doesn't exist, need to load it. Let the calling thread read the
-  // file for load balancing and then send it back to us.
+  // Files which won't be cached are compressed fast.
+  int level = policy_->Level(frequency >= kMinAdmitFrequency);
+  if (disk_cache_) {
+    thread_pool_->PostTask(BindOnce(&Shard::LoadFile, this, std::move(file),
+                                    std::move(key), level,
+                                    std::move(caller)));
+    return;
+  }
+  caller->PostTask(BindOnce(&Shard::ReadFile, this, std::move(file),
+                            std::move(key), level, task_runner_));
+}
+
+void CompressionCache::Shard::OnFastPathHits() {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+
+  // Hits queued from now on post another task.
+  fast_path_hits_posted_.store(false, std::memory_order_release);
+  while (!fast_path_hits_.Empty()) {
+    FastPathHit hit = fast_path_hits_.Pop();
+    int count = hit.hits->count.exchange(0, std::memory_order_relaxed);
+    uint64_t hash = absl::Hash<Key>()(hit.key);
+    // Counters saturate anyway.
+    for (int i = 0; i < std::min(count, FrequencySketch::kMaxFrequency); ++i) {
+      sketch_.Increment(hash);
+    }
 
-  auto& pending_callbacks = pending_read_it->second.callbacks;
-  pending_callbacks.push_back(std::move(callback));
+    // Skip files which were dropped since.
+    auto it = key_to_node_.find(hit.key);
+    if (it == key_to_node_.end() || it->second->hits != hit.hits) {
+      continue;
+    }
+    Lru::iterator node = it->second;
+    Touch(node);
+    MaybeRecompress(node, std::move(hit.source), sketch_.Frequency(hash));
+  }
+}
 
-  // Exit if this isn't the first pending request for this file.
-  if (pending_callbacks.size() > 1) {
+void CompressionCache::Shard::SchedulePublish() {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  if (publish_posted_) {
     return;
   }
 
-  caller->PostTask(BindOnce(&CompressionCache::ReadFile, this, std::move(path),
-                            pending_read_it, task_runner_));
+  // Tasks already queued are part of the batch.
+  publish_posted_ = true;
+  task_runner_->PostTask(BindOnce(&Shard::Publish, this));
 }
 
-void CompressionCache::ReadFile(std::string path,
-                                PathToPendingRead::iterator pending_read_it,
-                                std::shared_ptr<TaskRunner> my_thread) {
-  auto file = CachedFile::Create(path);
+void CompressionCache::Shard::Publish() {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  publish_posted_ = false;
+
+  auto snapshot = std::make_shared<PathToCachedFile>();
+  snapshot->reserve(key_to_node_.size());
+  for (const auto& key_and_node : key_to_node_) {
+    const Node& node = *key_and_node.second;
+    snapshot->emplace(key_and_node.first, PublishedFile{node.file, node.hits});
+  }
+  atomic_store(&unlocked_path_to_cached_file_,
+               std::shared_ptr<const PathToCachedFile>(std::move(snapshot)));
+}
+
+Result<OnceCallback> CompressionCache::Shard::PrepareEncoding(
+    std::shared_ptr<const FileCache::Entry> source, Key key,
+    std::shared_ptr<CachedFile> file, OnEncoded on_done) {
+  if (parallel_gzip::ShouldCompressInParallel(source->size, *thread_pool_)) {
+    return BindOnce([this, source, key, file, on_done] {
+      parallel_gzip::Compress(
+          source, file->level(), thread_pool_,
+          [this, key, file, on_done](Result<absl::string_view> piece) {
+            OnParallelGzipPiece(key, file, on_done, std::move(piece));
+          });
+    });
+  }
 
-  my_thread->PostTask(BindOnce(&CompressionCache::OnReadFile, this,
-                               std::move(path), pending_read_it,
-                               std::move(file)));
+  // Read the version |file| is stamped with, even if |source->path| was
+  // replaced since.
+  auto file_reader =
+      TRY(FileReader::CreateFromFd(*source->fd, source->size, source->path));
+  auto encoder = std::make_shared<SerialEncoder>(
+      SerialEncoder{std::move(key), std::move(file), on_done,
+                    std::move(file_reader), nullptr});
+  encoder->zlib_reader = TRY(ZlibDeflateReader::Create(
+      &encoder->file_reader, encoder->file->level()));
+  return BindOnce(&Shard::EncodeSome, this, std::move(encoder));
 }
 
-void CompressionCache::OnReadFile(std::string path,
-                                  PathToPendingRead::iterator pending_read_it,
-                                  Result<std::shared_ptr<CachedFile>> file) {
+void CompressionCache::Shard::EncodeSome(
+    std::shared_ptr<SerialEncoder> encoder) {
+  auto complete = EncodeChunk(encoder.get());
+  if (!complete.ok()) {
+    encoder->file->Fail(complete.err());
+    PostOnEncoded(encoder->on_done, std::move(encoder->key),
+                  std::move(complete.err()));
+    return;
+  }
+  if (*complete) {
+    PostOnEncoded(encoder->on_done, std::move(encoder->key),
+                  std::move(encoder->file));
+    return;
+  }
+
+  // Runs after what's queued now, e.g. the reactor's next poll.
+  TaskRunner::CurrentTaskRunner()->PostTask(
+      BindOnce(&Shard::EncodeSome, this, std::move(encoder)));
+}
+
+// static
+Result<bool> CompressionCache::Shard::EncodeChunk(SerialEncoder* encoder) {
+  char buf[kChunkSize];
+  ssize_t num_read = TRY(encoder->zlib_reader->Read(buf));
+  if (num_read == -1) {
+    TRY(encoder->file->Finish());
+    return true;
+  }
+
+  TRY(encoder->file->Append({buf, static_cast<size_t>(num_read)}));
+  return false;
+}
+
+void CompressionCache::Shard::OnParallelGzipPiece(
+    Key key, std::shared_ptr<CachedFile> file, OnEncoded on_done,
+    Result<absl::string_view> piece) {
+  // Compression goes on after a piece failed to be written.
+  if (file->state() == CachedFile::State::kFailed) {
+    return;
+  }
+
+  auto complete = AppendPiece(file.get(), std::move(piece));
+  if (!complete.ok()) {
+    file->Fail(complete.err());
+    PostOnEncoded(on_done, std::move(key), std::move(complete.err()));
+    return;
+  }
+  if (*complete) {
+    PostOnEncoded(on_done, std::move(key), std::move(file));
+  }
+}
+
+// static
+Result<bool> CompressionCache::Shard::AppendPiece(
+    CachedFile* file, Result<absl::string_view> piece) {
+  absl::string_view data = TRY(std::move(piece));
+  if (data.empty()) {
+    TRY(file->Finish());
+    return true;
+  }
+
+  TRY(file->Append(data));
+  return false;
+}
+
+void CompressionCache::Shard::PostOnEncoded(
+    OnEncoded on_done, Key key, Result<std::shared_ptr<CachedFile>> file) {
+  task_runner_->PostTask(
+      BindOnce(std::move(on_done), this, std::move(key), std::move(file)));
+}
+
+void CompressionCache::Shard::LoadFile(
+    std::shared_ptr<const FileCache::Entry> file, Key key, int level,
+    std::shared_ptr<TaskRunner> caller) {
+  // Loading a stored encoding is much cheaper than encoding again.
+  auto loaded = LoadFromDisk(*file, key.second);
+  if (!loaded.ok()) {
+    VLOG(1) << "Loading " << key.first << " from disk failed: "
+            << loaded.err();
+  } else if (*loaded) {
+    task_runner_->PostTask(BindOnce(&Shard::OnReadFile, this, std::move(key),
+                                    std::move(*loaded)));
+    return;
+  }
+
+  caller->PostTask(BindOnce(&Shard::ReadFile, this, std::move(file),
+                            std::move(key), level, task_runner_));
+}
+
+void CompressionCache::Shard::ReadFile(
+    std::shared_ptr<const FileCache::Entry> file, Key key, int level,
+    std::shared_ptr<TaskRunner> my_thread) {
+  if (key.second != content_encoding::Encoding::kGzip) {
+    my_thread->PostTask(BindOnce(
+        &Shard::OnReadFile, this, std::move(key),
+        Err(absl::StrCat("Unsupported encoding: ",
+                         static_cast<int>(key.second)))));
+    return;
+  }
+
+  // Errors opening the file are reported before any requests follow it, so
+  // they can still fall back to the identity encoding.
+  auto cached_file = CachedFile::Create(*file, level);
+  if (!cached_file.ok()) {
+    my_thread->PostTask(BindOnce(&Shard::OnReadFile, this, std::move(key),
+                                 std::move(cached_file.err())));
+    return;
+  }
+  auto encode = PrepareEncoding(std::move(file), key, *cached_file,
+                                &Shard::OnReadFile);
+  if (!encode.ok()) {
+    my_thread->PostTask(BindOnce(&Shard::OnReadFile, this, std::move(key),
+                                 std::move(encode.err())));
+    return;
+  }
+
+  my_thread->PostTask(BindOnce(&Shard::OnReadStarted, this, std::move(key),
+                               std::move(*cached_file)));
+  (*encode)();
+}
+
+void CompressionCache::Shard::EncodeUncached(
+    std::shared_ptr<const FileCache::Entry> file, Key key,
+    FileCallback callback) {
+  auto cached_file =
+      CachedFile::Create(*file, policy_->Level(/*will_cache=*/false));
+  if (!cached_file.ok()) {
+    callback(std::move(cached_file.err()));
+    return;
+  }
+  auto encode = PrepareEncoding(std::move(file), std::move(key), *cached_file,
+                                &Shard::OnUncachedEncoded);
+  if (!encode.ok()) {
+    callback(std::move(encode.err()));
+    return;
+  }
+
+  callback(File(std::move(*cached_file)));
+  (*encode)();
+}
+
+void CompressionCache::Shard::OnUncachedEncoded(
+    Key key, Result<std::shared_ptr<CachedFile>> file) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  if (!file.ok()) {
+    VLOG(1) << "Encoding " << key.first << " failed: " << file.err();
+  }
+}
+
+Result<std::shared_ptr<CompressionCache::CachedFile>>
+CompressionCache::Shard::LoadFromDisk(const FileCache::Entry& source,
+                                      content_encoding::Encoding encoding) {
+  auto stored = TRY(disk_cache_->Load(DiskCache::KeyFor(source, encoding)));
+  if (!stored) {
+    return std::shared_ptr<CachedFile>();
+  }
+
+  auto file = TRY(CachedFile::Create(source, stored->level()));
+  TRY(file->Append(stored->data()));
+  TRY(file->Finish());
+  file->set_on_disk();
+  return file;
+}
+
+void CompressionCache::Shard::StoreOnDisk(const Key& key,
+                                          std::shared_ptr<CachedFile> file) {
   ABSL_ASSERT(task_runner_->IsCurrentThread());
+  if (!disk_cache_ || file->on_disk()) {
+    return;
+  }
 
+  DiskCache::Key disk_key{key.first, key.second, file->source_size(),
+                          file->source_mtime(), file->source_inode()};
+  thread_pool_->PostTask(BindOnce([this, disk_key = std::move(disk_key),
+                                   file = std::move(file)]() mutable {
+    auto result =
+        disk_cache_->Store(disk_key, file->level(), file->fd(), file->size());
+    if (!result.ok()) {
+      VLOG(1) << "Storing " << disk_key.path << " on disk failed: "
+              << result.err();
+      return;
+    }
+    task_runner_->PostTask(
+        BindOnce(&Shard::OnStoredOnDisk, this, std::move(file)));
+  }));
+}
+
+void CompressionCache::Shard::OnStoredOnDisk(
+    std::shared_ptr<CachedFile> file) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  file->set_on_disk();
+}
+
+void CompressionCache::Shard::OnReadStarted(
+    Key key, std::shared_ptr<CachedFile> file) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+
+  auto it = path_to_pending_read_.find(key);
+  ABSL_ASSERT(it != path_to_pending_read_.end());
+  PendingRead& pending_read = it->second;
+  pending_read.file = std::move(file);
+  for (const auto& callback : pending_read.callbacks) {
+    callback(File(pending_read.file));
+  }
+  pending_read.callbacks.clear();
+}
+
+void CompressionCache::Shard::OnReadFile(
+    Key key, Result<std::shared_ptr<CachedFile>> file) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+
+  auto pending_read_it = path_to_pending_read_.find(key);
+  ABSL_ASSERT(pending_read_it != path_to_pending_read_.end());
   auto pending_read = std::move(pending_read_it->second);
   path_to_pending_read_.erase(pending_read_it);
 
@@ -134,8 +748,317 @@ void CompressionCache::OnReadFile(std::string path,
     return;
   }
 
-  path_to_cached_file_.emplace(std::move(path), *file);
   for (const auto& callback : pending_read.callbacks) {
     callback(File(*file));
   }
+  if (!pending_read.invalidated) {
+    MaybeInsert(std::move(key), std::move(*file));
+  }
+}
+
+void CompressionCache::Shard::Invalidate(absl::string_view path) {
+  task_runner_->PostTask(
+      BindOnce(&Shard::InvalidateOnTaskRunner, this, std::string(path)));
+}
+
+void CompressionCache::Shard::InvalidateOnTaskRunner(std::string path) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  for (Lru* segment : {&probation_, &protected_}) {
+    for (auto it = segment->begin(); it != segment->end();) {
+      auto next = std::next(it);
+      if (util::IsPathWithin(it->key.first, path)) {
+        VLOG(3) << "Invalidating " << it->key.first;
+        Erase(it);
+      }
+      it = next;
+    }
+  }
+
+  for (auto& key_and_pending_read : path_to_pending_read_) {
+    if (util::IsPathWithin(key_and_pending_read.first.first, path)) {
+      key_and_pending_read.second.invalidated = true;
+    }
+  }
+}
+
+void CompressionCache::Shard::GetHotFiles(
+    std::function<void(std::vector<hot_set::HotFile>)> callback) {
+  task_runner_->PostTask(BindOnce(&Shard::GetHotFilesOnTaskRunner, this,
+                                  std::move(callback)));
+}
+
+void CompressionCache::Shard::GetHotFilesOnTaskRunner(
+    std::function<void(std::vector<hot_set::HotFile>)> callback) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  std::vector<hot_set::HotFile> files;
+  files.reserve(key_to_node_.size());
+  for (Lru* segment : {&protected_, &probation_}) {
+    for (const Node& node : *segment) {
+      files.push_back({node.key.first, node.key.second,
+                       sketch_.Frequency(absl::Hash<Key>()(node.key))});
+    }
+  }
+  callback(std::move(files));
+}
+
+void CompressionCache::Shard::Warm(
+    std::shared_ptr<const FileCache::Entry> file,
+    content_encoding::Encoding encoding, int frequency,
+    std::function<void()> callback) {
+  Key key(file->path, encoding);
+  task_runner_->PostTask(BindOnce(&Shard::WarmOnTaskRunner, this,
+                                  std::move(file), std::move(key), frequency,
+                                  std::move(callback), CallerTaskRunner()));
+}
+
+void CompressionCache::Shard::WarmOnTaskRunner(
+    std::shared_ptr<const FileCache::Entry> file, Key key, int frequency,
+    std::function<void()> callback, std::shared_ptr<TaskRunner> caller) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+
+  // Files were admitted before, so let them in again. The slow path counts
+  // one more request.
+  frequency = std::max(frequency, kMinAdmitFrequency);
+  uint64_t hash = absl::Hash<Key>()(key);
+  for (int i = 1; i < frequency && i < FrequencySketch::kMaxFrequency; ++i) {
+    sketch_.Increment(hash);
+  }
+
+  RequestFileSlowPath(
+      std::move(file), std::move(key),
+      [callback = std::move(callback)](Result<File> file) {
+        if (!file.ok()) {
+          callback();
+          return;
+        }
+        file->file_->NotifyWhenEncoded(callback);
+      },
+      std::move(caller));
+}
+
+void CompressionCache::Shard::MaybeRecompress(
+    Lru::iterator node, std::shared_ptr<const FileCache::Entry> source,
+    int frequency) {
+  if (node->recompressing ||
+      !policy_->ShouldRecompress(node->file->level(), frequency)) {
+    return;
+  }
+
+  node->recompressing = true;
+  thread_pool_->PostTask(BindOnce(&Shard::Recompress, this,
+                                  std::move(source), node->key,
+                                  policy_->best_level()));
+}
+
+void CompressionCache::Shard::Recompress(
+    std::shared_ptr<const FileCache::Entry> source, Key key, int level) {
+  auto file = CachedFile::Create(*source, level);
+  if (!file.ok()) {
+    PostOnEncoded(&Shard::OnRecompressed, std::move(key),
+                  std::move(file.err()));
+    return;
+  }
+  auto encode = PrepareEncoding(std::move(source), key, std::move(*file),
+                                &Shard::OnRecompressed);
+  if (!encode.ok()) {
+    PostOnEncoded(&Shard::OnRecompressed, std::move(key),
+                  std::move(encode.err()));
+    return;
+  }
+
+  (*encode)();
+}
+
+void CompressionCache::Shard::OnRecompressed(
+    Key key, Result<std::shared_ptr<CachedFile>> file) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+
+  // Dropped while it was recompressed.
+  auto it = key_to_node_.find(key);
+  if (it == key_to_node_.end()) {
+    return;
+  }
+  Lru::iterator node = it->second;
+  node->recompressing = false;
+  if (!file.ok()) {
+    VLOG(1) << "Recompressing " << key.first << " failed: " << file.err();
+    return;
+  }
+
+  // Only swap in a smaller encoding of the same version of the file.
+  if (!(*file)->HasSameSource(*node->file) ||
+      (*file)->size() >= node->file->size()) {
+    return;
+  }
+  VLOG(3) << "Recompressed " << key.first << " at level " << (*file)->level()
+          << ": " << node->file->size() << " -> " << (*file)->size();
+
+  size_t old_size = node->file->memory_size();
+  size_t new_size = (*file)->memory_size();
+  size_bytes_ = size_bytes_ - old_size + new_size;
+  if (node->is_protected) {
+    protected_size_bytes_ = protected_size_bytes_ - old_size + new_size;
+  }
+  node->file = std::move(*file);
+  StoreOnDisk(node->key, node->file);
+  SchedulePublish();
+}
+
+void CompressionCache::Shard::Touch(Lru::iterator it) {
+  if (it->is_protected) {
+    protected_.splice(protected_.begin(), protected_, it);
+    return;
+  }
+
+  it->is_protected = true;
+  protected_.splice(protected_.begin(), probation_, it);
+  protected_size_bytes_ += it->file->memory_size();
+
+  // Demote the least recently used protected files to make room.
+  while (protected_size_bytes_ > max_protected_size_bytes_) {
+    auto demoted = std::prev(protected_.end());
+    demoted->is_protected = false;
+    protected_size_bytes_ -= demoted->file->memory_size();
+    probation_.splice(probation_.begin(), protected_, demoted);
+  }
+}
+
+void CompressionCache::Shard::MaybeInsert(Key key,
+                                          std::shared_ptr<CachedFile> file) {
+  size_t size = file->memory_size();
+  if (size > max_size_bytes_ || max_files_ == 0) {
+    return;
+  }
+
+  // One-hit wonders aren't worth the memory.
+  int frequency = sketch_.Frequency(absl::Hash<Key>()(key));
+  if (frequency < kMinAdmitFrequency) {
+    return;
+  }
+
+  // Find the victims, probationary files first. Only evict them if all of
+  // them were requested less often than |file|.
+  std::vector<Lru::iterator> victims;
+  size_t freed = 0;
+  size_t num_files = probation_.size() + protected_.size();
+  auto is_full = [&] {
+    return size_bytes_ - freed + size > max_size_bytes_ ||
+           num_files - victims.size() >= max_files_;
+  };
+  for (Lru* segment : {&probation_, &protected_}) {
+    for (auto it = segment->rbegin(); it != segment->rend() && is_full();
+         ++it) {
+      if (sketch_.Frequency(absl::Hash<Key>()(it->key)) >= frequency) {
+        VLOG(3) << "Not admitting " << key.first;
+        return;
+      }
+      victims.push_back(std::prev(it.base()));
+      freed += it->file->memory_size();
+    }
+  }
+  for (Lru::iterator victim : victims) {
+    VLOG(3) << "Evicting " << victim->key.first;
+    Erase(victim);
+  }
+
+  StoreOnDisk(key, file);
+  probation_.push_front({key, std::move(file)});
+  key_to_node_.emplace(std::move(key), probation_.begin());
+  size_bytes_ += size;
+  SchedulePublish();
+}
+
+void CompressionCache::Shard::Erase(Lru::iterator it) {
+  size_t size = it->file->memory_size();
+  size_bytes_ -= size;
+  if (it->is_protected) {
+    protected_size_bytes_ -= size;
+  }
+  key_to_node_.erase(it->key);
+  (it->is_protected ? protected_ : probation_).erase(it);
+  SchedulePublish();
+}
+
+CompressionCache::CompressionCache(size_t max_size_bytes, size_t max_files,
+                                   size_t max_file_size, size_t num_shards,
+                                   const CompressionPolicy* policy,
+                                   ThreadPool* thread_pool,
+                                   DiskCache* disk_cache)
+    : max_file_size_(std::min(
+          max_file_size,
+          max_size_bytes / NumShardsFor(num_shards, max_files))) {
+  ABSL_ASSERT(num_shards > 0);
+  num_shards = NumShardsFor(num_shards, max_files);
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards_.push_back(absl::make_unique<Shard>(
+        max_size_bytes / num_shards, max_files / num_shards, policy,
+        thread_pool, disk_cache));
+  }
+}
+
+CompressionCache::~CompressionCache() = default;
+
+void CompressionCache::RequestFile(
+    std::shared_ptr<const FileCache::Entry> file,
+    content_encoding::Encoding encoding, FileCallback callback) {
+  // All encodings of a file are in the same shard.
+  ShardFor(file->path)->RequestFile(std::move(file), encoding,
+                                    std::move(callback));
+}
+
+void CompressionCache::Invalidate(absl::string_view path) {
+  // Files inside of |path| may be in any shard.
+  for (const auto& shard : shards_) {
+    shard->Invalidate(path);
+  }
+}
+
+void CompressionCache::GetHotFiles(
+    std::function<void(std::vector<hot_set::HotFile>)> callback) {
+  struct Collected {
+    absl::Mutex mu;
+    std::vector<hot_set::HotFile> files GUARDED_BY(mu);
+    size_t num_pending GUARDED_BY(mu);
+  };
+  auto collected = std::make_shared<Collected>();
+  {
+    absl::MutexLock lock(&collected->mu);
+    collected->num_pending = shards_.size();
+  }
+
+  for (const auto& shard : shards_) {
+    shard->GetHotFiles([collected, callback](
+                           std::vector<hot_set::HotFile> files) {
+      std::vector<hot_set::HotFile> all_files;
+      {
+        absl::MutexLock lock(&collected->mu);
+        std::move(files.begin(), files.end(),
+                  std::back_inserter(collected->files));
+        if (--collected->num_pending > 0) {
+          return;
+        }
+        all_files.swap(collected->files);
+      }
+
+      // Shards list their files most recently used first, which breaks ties.
+      std::stable_sort(all_files.begin(), all_files.end(),
+                       [](const hot_set::HotFile& a,
+                          const hot_set::HotFile& b) {
+                         return a.frequency > b.frequency;
+                       });
+      callback(std::move(all_files));
+    });
+  }
+}
+
+void CompressionCache::Warm(std::shared_ptr<const FileCache::Entry> file,
+                            content_encoding::Encoding encoding,
+                            int frequency, std::function<void()> callback) {
+  ShardFor(file->path)->Warm(std::move(file), encoding, frequency,
+                             std::move(callback));
+}
+
+CompressionCache::Shard* CompressionCache::ShardFor(
+    absl::string_view path) const {
+  return shards_[absl::Hash<absl::string_view>()(path) % shards_.size()].get();
 }
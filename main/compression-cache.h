@@ -1,41 +1,146 @@
 #ifndef MAIN_COMPRESSION_CACHE_H_
 #define MAIN_COMPRESSION_CACHE_H_
 
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
-#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "base/reader.h"
-#include "base/task-runner.h"
+#include "base/scoped-fd.h"
+#include "main/compression-policy.h"
+#include "main/content-encoding.h"
+#include "main/disk-cache.h"
+#include "main/file-cache.h"
+#include "main/hot-set.h"
+#include "main/thread-pool.h"
 
+// Caches encoded representations of files, keyed by path and encoding.
+//
+// The memory held by cached files is bounded. Eviction is segmented LRU: files
+// start out in a probation segment and move to a protected one when hit
+// again, so a scan of many files only displaces other probationary files.
+// Admission is TinyLFU: a file is only cached once it was requested before,
+// and only evicts files which were requested less often. Files which aren't
+// admitted are still encoded for the requests waiting on them.
+//
+// Requests don't wait for a file to be entirely encoded: they read it as it is
+// encoded, and wait only when they catch up with the encoder.
+//
+// The cache is split by path into shards, each with an even part of the
+// memory, an LRU and a sketch of its own, and a thread which handles its
+// misses. So misses for different files are handled in parallel. Hits are
+// served on the requesting thread from a snapshot of their shard, which its
+// thread republishes after its contents change. That thread accounts for the
+// hits in batches.
+//
+// Encoded data is kept in a memfd per file, sealed once complete, so it can be
+// sent with sendfile() straight from the cache's pages.
+//
+// With a DiskCache, cached files are also written to disk, and misses are
+// loaded from there before anything is encoded. So files evicted from memory,
+// or cached before a restart, aren't encoded again.
+//
+// Compression levels are picked by a CompressionPolicy. Popular files are
+// recompressed at its best level in the background, and swapped in once done.
 class CompressionCache {
  private:
   enum {
+    // Bytes encoded per task by the serial encoder.
     kChunkSize = 16384,
   };
 
-  using Chunk = std::array<char, kChunkSize>;
-  using ChunkList = std::forward_list<Chunk>;
-
+  // Encoded data of a file. It's appended to by a single encoder while readers
+  // may already follow it.
   class CachedFile {
    public:
-    static Result<std::shared_ptr<CachedFile>> Create(absl::string_view path);
-    CachedFile(ChunkList chunks, size_t last_chunk_length, size_t size);
+    enum class State {
+      kEncoding,
+      kComplete,
+      kFailed,
+    };
+
+    // Encoded from |source| at zlib |level|.
+    static Result<std::shared_ptr<CachedFile>> Create(
+        const FileCache::Entry& source, int level);
+    CachedFile(const CachedFile&) = delete;
+    CachedFile& operator=(const CachedFile&) = delete;
+
+    // Called by the encoder. It must call |Fail| if |Append| or |Finish|
+    // return an error.
+    Result<void> Append(absl::string_view data);
+    // Seals |fd|, it can't be changed anymore.
+    Result<void> Finish();
+    void Fail(const Err& err);
 
-    const ChunkList& chunks() const { return chunks_; }
-    size_t last_chunk_length() const { return last_chunk_length_; }
-    size_t size() const { return size_; }
+    // Check |state| before |size|: once encoding ended, |size| is final.
+    State state() const { return state_.load(std::memory_order_acquire); }
+    // Bytes appended so far.
+    size_t size() const { return size_.load(std::memory_order_acquire); }
+    // Holds the |size| bytes appended so far.
+    int fd() const { return *fd_; }
+    // Only valid once failed.
+    const std::string& error() const { return error_; }
+    // Bytes of memory held, counting whole pages. Only valid once complete.
+    size_t memory_size() const;
+    int level() const { return level_; }
+    size_t source_size() const { return source_size_; }
+    time_t source_mtime() const { return source_mtime_; }
+    ino_t source_inode() const { return source_inode_; }
+
+    // Set once the file is stored in the DiskCache, or was loaded from it.
+    // Only used by the shard owning the file.
+    bool on_disk() const { return on_disk_; }
+    void set_on_disk() { on_disk_ = true; }
+
+    // Runs |callback| once more than |offset| bytes were appended or encoding
+    // ended. It may run on the encoder's thread.
+    void NotifyWhenReadable(size_t offset, std::function<void()> callback);
+    // Runs |callback| once encoding ended. It may run on the encoder's thread.
+    void NotifyWhenEncoded(std::function<void()> callback);
+
+    // Returns true if this was encoded from the current version of |source|.
+    bool IsCurrent(const FileCache::Entry& source) const {
+      return source.mtime == source_mtime_ && source.size == source_size_ &&
+             source.inode == source_inode_;
+    }
+    bool HasSameSource(const CachedFile& other) const {
+      return other.source_mtime_ == source_mtime_ &&
+             other.source_size_ == source_size_ &&
+             other.source_inode_ == source_inode_;
+    }
 
    private:
-    const ChunkList chunks_;
-    const size_t last_chunk_length_;
-    const size_t size_;
+    CachedFile(const FileCache::Entry& source, int level, ScopedFd fd);
+
+    void NotifyWaiters();
+
+    const ScopedFd fd_;
+    std::atomic<size_t> size_{0};
+    std::atomic<State> state_{State::kEncoding};
+    std::string error_;
+
+    absl::Mutex mu_;
+    std::vector<std::function<void()>> waiters_ GUARDED_BY(mu_);
+
+    bool on_disk_ = false;
+
+    const int level_;
+    const time_t source_mtime_;
+    const size_t source_size_;
+    const ino_t source_inode_;
   };
 
+  // Owns the files whose paths hash to it, on a thread of its own.
+  class Shard;
+
  public:
   class File : public Reader {
    public:
@@ -43,91 +148,111 @@ class CompressionCache {
     File& operator=(File&&) = default;
 
     // Reader implementation:
+    // Returns 0 if everything encoded so far was read. |NotifyWhenReadable|
+    // then tells when to read again.
     Result<ssize_t> Read(absl::Span<char> buf) override;
 
+    // Returns true once the file is entirely encoded, making |size| final.
+    bool complete() const {
+      return file_->state() == CachedFile::State::kComplete;
+    }
     size_t size() const { return file_->size(); }
+    // Holds the encoded data from offset 0. Once |complete|, it's sealed and
+    // may be sent with sendfile().
+    int fd() const { return file_->fd(); }
+
+    // Runs |callback| once |Read| can make progress. It may run on any thread.
+    void NotifyWhenReadable(std::function<void()> callback) {
+      file_->NotifyWhenReadable(read_offset_, std::move(callback));
+    }
 
    private:
     friend class CompressionCache;
+    friend class CompressionCache::Shard;
     explicit File(std::shared_ptr<CachedFile> file);
 
     std::shared_ptr<CachedFile> file_;
-    ChunkList::const_iterator cur_chunk_;
-    size_t cur_chunk_offset_ = 0;
+    size_t read_offset_ = 0;
   };
 
-  explicit CompressionCache(size_t max_size_bytes);
+  // |max_size_bytes| and |max_files| are split evenly between |num_shards|,
+  // fewer if that left shards without a file. Only files which fit into the
+  // memory of a shard and are at most |max_file_size| bytes are cached.
+  // Every cached file holds a descriptor open. Large files are gzipped in
+  // parallel on |thread_pool|, which also runs recompressions and disk cache
+  // accesses. It shouldn't run anything latency sensitive, like reactors.
+  // |disk_cache| may be null.
+  CompressionCache(size_t max_size_bytes, size_t max_files,
+                   size_t max_file_size, size_t num_shards,
+                   const CompressionPolicy* policy, ThreadPool* thread_pool,
+                   DiskCache* disk_cache);
   CompressionCache(const CompressionCache&) = delete;
   CompressionCache& operator=(const CompressionCache&) = delete;
+  ~CompressionCache();
+
+  // Returns false if |file| is too large to be worth caching, or to fit into
+  // a shard. It should be encoded as it is sent instead.
+  bool ShouldCache(const FileCache::Entry& file) const {
+    return file.size <= max_file_size_;
+  }
 
   using FileCallback = std::function<void(Result<File>)>;
-  void RequestFile(absl::string_view path, FileCallback callback);
+
+  // Gets |file| encoded with |encoding|, which must not be |kIdentity|.
+  // |callback| may run on any thread. Misses are encoded on the calling
+  // thread's TaskRunner, or on the cache's own thread if there is none.
+  void RequestFile(std::shared_ptr<const FileCache::Entry> file,
+                   content_encoding::Encoding encoding, FileCallback callback);
+
+  // Drops the cached files encoded from |path| or from anything inside of it.
+  // Encodings in progress for them won't be cached. Thread safe.
+  void Invalidate(absl::string_view path);
+
+  // Runs |callback| with the cached files, most requested first. It may run on
+  // any thread.
+  void GetHotFiles(
+      std::function<void(std::vector<hot_set::HotFile>)> callback);
+
+  // Encodes |file| with |encoding| before it's requested, as if it was
+  // requested |frequency| times, so it's cached. Like for a miss, encoding
+  // starts on the calling thread's TaskRunner if it has one. |callback| runs
+  // once it ended, on any thread.
+  void Warm(std::shared_ptr<const FileCache::Entry> file,
+            content_encoding::Encoding encoding, int frequency,
+            std::function<void()> callback);
 
  private:
-  using PathToCachedFile =
-      absl::flat_hash_map<std::string, std::shared_ptr<CachedFile>>;
+  Shard* ShardFor(absl::string_view path) const;
 
-  struct PendingRead {
-    std::vector<FileCallback> callbacks;
-  };
-  using PathToPendingRead = absl::flat_hash_map<std::string, PendingRead>;
-
-  void RequestFileSlowPath(std::string path, FileCallback callback,
-                           std::shared_ptr<TaskRunner> caller);
-  void ReadFile(std::string path, PathToPendingRead::iterator pending_read_it,
-                std::shared_ptr<TaskRunner> my_thread);
-  void OnReadFile(std::string path, PathToPendingRead::iterator pending_read_it,
-                  Result<std::shared_ptr<CachedFile>> file);
-
-  // TODO(bcf): Enforce file size.
-  const size_t max_size_bytes_;
-
-  // Fast path unlocked version of |path_to_cached_file_| which can be accessed
-  // on any thread. Might be out of date. If there is a miss here, will fallback
-  // to slow path.
-  ABSL_CACHELINE_ALIGNED std::shared_ptr<const PathToCachedFile>
-      unlocked_path_to_cached_file_;
-
-  const ABSL_CACHELINE_ALIGNED std::shared_ptr<TaskRunner> task_runner_;
-
-  // Owned by |task_runner_|.
-  // TODO(bcf): Invalidation based on inotify.
-  PathToCachedFile path_to_cached_file_;
-  PathToPendingRead path_to_pending_read_;
+  const size_t max_file_size_;
+  std::vector<std::unique_ptr<Shard>> shards_;
 };
 
 // Implementation:
 
 inline Result<ssize_t> CompressionCache::File::Read(absl::Span<char> buf) {
-  if (cur_chunk_ == file_->chunks().end()) {
-    return -1;
-  }
-  size_t num_read = 0;
-  while (num_read < buf.size()) {
-    if (cur_chunk_ == file_->chunks().end()) {
-      break;
+  CachedFile::State state = file_->state();
+  size_t size = file_->size();
+  if (read_offset_ == size) {
+    switch (state) {
+      case CachedFile::State::kEncoding:
+        return 0;
+      case CachedFile::State::kComplete:
+        return -1;
+      case CachedFile::State::kFailed:
+        return Err(file_->error());
     }
-    auto next_chunk = ++cur_chunk_;
-    bool is_last_chunk = next_chunk == file_->chunks().end();
-
-    char* write_to = buf.data() + num_read;
-    size_t can_write = buf.size() - num_read;
-
-    const char* read_from = cur_chunk_->data() + cur_chunk_offset_;
-    size_t chunk_length =
-        is_last_chunk ? file_->last_chunk_length() : cur_chunk_->size();
-    size_t can_read = chunk_length - cur_chunk_offset_;
-
-    size_t num_to_copy = std::min(can_write, can_read);
-    memcpy(write_to, read_from, num_to_copy);
+  }
 
-    num_read += num_to_copy;
-    cur_chunk_offset_ += num_to_copy;
-    if (cur_chunk_offset_ == chunk_length) {
-      cur_chunk_ = next_chunk;
-    }
+  size_t num_to_read = std::min(buf.size(), size - read_offset_);
+  ssize_t num_read = pread(file_->fd(), buf.data(), num_to_read, read_offset_);
+  if (num_read < 0) {
+    return BuildPosixErr("Failed to read encoded file");
   }
+  // Only bytes which were appended are read, so there is no end of file.
+  ABSL_ASSERT(num_read > 0);
 
+  read_offset_ += num_read;
   return num_read;
 }
 
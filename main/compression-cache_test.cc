@@ -0,0 +1,690 @@
+#include "main/compression-cache.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/hash/hash.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "base/task-runner.h"
+#include "base/util.h"
+#include "gtest/gtest.h"
+#include "main/compression-policy.h"
+#include "main/config.h"
+#include "main/file-cache.h"
+#include "main/hot-set.h"
+#include "main/thread-pool.h"
+
+namespace {
+
+using Encoding = content_encoding::Encoding;
+
+// Incompressible, so that encoding takes many chunks.
+std::string MakeContents(size_t size, unsigned seed) {
+  std::string contents(size, '\0');
+  for (char& c : contents) {
+    seed = seed * 1103515245 + 12345;
+    c = static_cast<char>(seed >> 16);
+  }
+  return contents;
+}
+
+// Reads |file| until its encoding ended.
+std::string ReadAll(CompressionCache::File* file) {
+  std::string out;
+  while (true) {
+    char buf[BUFSIZ];
+    auto num_read = file->Read(absl::MakeSpan(buf, sizeof(buf)));
+    if (!num_read.ok()) {
+      ADD_FAILURE() << num_read.err();
+      return out;
+    }
+    if (*num_read == -1) {
+      return out;
+    }
+    if (*num_read == 0) {
+      absl::Notification readable;
+      file->NotifyWhenReadable([&readable] { readable.Notify(); });
+      if (!readable.WaitForNotificationWithTimeout(absl::Seconds(10))) {
+        ADD_FAILURE() << "Encoding stalled";
+        return out;
+      }
+      continue;
+    }
+    out.append(buf, *num_read);
+  }
+}
+
+std::string Gunzip(const std::string& gzip) {
+  z_stream stream{};
+  EXPECT_EQ(Z_OK, inflateInit2(&stream, 16 + MAX_WBITS));
+  stream.next_in =
+      reinterpret_cast<unsigned char*>(const_cast<char*>(gzip.data()));
+  stream.avail_in = gzip.size();
+
+  std::string out;
+  int ret = Z_OK;
+  while (ret == Z_OK) {
+    char buf[BUFSIZ];
+    stream.next_out = reinterpret_cast<unsigned char*>(buf);
+    stream.avail_out = sizeof(buf);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    out.append(buf, sizeof(buf) - stream.avail_out);
+  }
+  EXPECT_EQ(Z_STREAM_END, ret);
+  inflateEnd(&stream);
+  return out;
+}
+
+class CompressionCacheTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    std::string tmpl = testing::TempDir() + "/compression-cache_testXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(&tmpl[0]));
+    auto dir_or = util::CanonicalizePath(tmpl);
+    ASSERT_TRUE(dir_or.ok());
+    dir_ = std::move(*dir_or);
+    file_cache_ = absl::make_unique<FileCache>(dir_, /*max_entries=*/0,
+                                               absl::ZeroDuration());
+    CreateCache(/*max_size_bytes=*/100 * 1000 * 1000, /*max_files=*/1000,
+                /*num_shards=*/1);
+  }
+
+  void TearDown() override {
+    requester_->Stop();
+    ASSERT_EQ(0, system(("rm -rf " + dir_).c_str()));
+  }
+
+  void CreateCache(size_t max_size_bytes, size_t max_files,
+                   size_t num_shards) {
+    cache_ = absl::make_unique<CompressionCache>(
+        max_size_bytes, max_files, /*max_file_size=*/10 * 1000 * 1000,
+        num_shards, &policy_, &thread_pool_, /*disk_cache=*/nullptr);
+  }
+
+  std::shared_ptr<const FileCache::Entry> WriteFile(
+      const std::string& name, const std::string& contents) {
+    FILE* fp = fopen((dir_ + name).c_str(), "w");
+    EXPECT_NE(nullptr, fp);
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+
+    auto entry = file_cache_->Lookup(name);
+    EXPECT_TRUE(entry.ok());
+    return *entry;
+  }
+
+  // Requests |file| on |task_runner|, like a RequestHandler.
+  void Request(TaskRunner* task_runner,
+               std::shared_ptr<const FileCache::Entry> file,
+               CompressionCache::FileCallback callback) {
+    task_runner->PostTask(BindOnce([this, file, callback] {
+      cache_->RequestFile(file, Encoding::kGzip, callback);
+    }));
+  }
+
+  // Requests |file| on |requester_| and waits for it. Sets |*from_snapshot|
+  // if it was handed out before |RequestFile| returned, without a hop to its
+  // shard.
+  Result<CompressionCache::File> Request(
+      std::shared_ptr<const FileCache::Entry> file,
+      bool* from_snapshot = nullptr) {
+    struct Requested {
+      std::atomic<bool> returned{false};
+      std::thread::id requester;
+      bool from_snapshot = false;
+      absl::optional<Result<CompressionCache::File>> file;
+      absl::Notification done;
+    };
+    auto requested = std::make_shared<Requested>();
+    requester_->PostTask(BindOnce([this, file, requested] {
+      requested->requester = std::this_thread::get_id();
+      cache_->RequestFile(
+          file, Encoding::kGzip,
+          [requested](Result<CompressionCache::File> file) {
+            requested->from_snapshot =
+                std::this_thread::get_id() == requested->requester &&
+                !requested->returned;
+            requested->file.emplace(std::move(file));
+            requested->done.Notify();
+          });
+      requested->returned = true;
+    }));
+    if (!requested->done.WaitForNotificationWithTimeout(absl::Seconds(10))) {
+      return Err("Timed out");
+    }
+    if (from_snapshot) {
+      *from_snapshot = requested->from_snapshot;
+    }
+    return std::move(*requested->file);
+  }
+
+  // Requests |file| on |encoder|, which encodes it, and holds |encoder| up
+  // once encoding started, until |release| is notified. Returns the partly
+  // encoded file.
+  Result<CompressionCache::File> RequestPaused(
+      TaskRunner* encoder, std::shared_ptr<const FileCache::Entry> file,
+      absl::Notification* release) {
+    struct Requested {
+      absl::optional<Result<CompressionCache::File>> file;
+      absl::Notification paused;
+    };
+    auto requested = std::make_shared<Requested>();
+    Request(encoder, std::move(file),
+            [encoder, release, requested](Result<CompressionCache::File> file) {
+              requested->file.emplace(std::move(file));
+              encoder->PostTask(BindOnce([release, requested] {
+                requested->paused.Notify();
+                release->WaitForNotification();
+              }));
+            });
+    if (!requested->paused.WaitForNotificationWithTimeout(absl::Seconds(10))) {
+      return Err("Timed out");
+    }
+    return std::move(*requested->file);
+  }
+
+  // Requests |file| and returns its contents, once entirely encoded.
+  std::string Encode(std::shared_ptr<const FileCache::Entry> file) {
+    auto encoded = Request(std::move(file));
+    if (!encoded.ok()) {
+      ADD_FAILURE() << encoded.err();
+      return "";
+    }
+    return Gunzip(ReadAll(&*encoded));
+  }
+
+  // Waits until the shards handled what the requests so far led to, and
+  // published their snapshots. Returns the cached files.
+  std::vector<hot_set::HotFile> HotFiles() {
+    // Encoders post their results to the shards from |requester_|.
+    absl::Notification flushed;
+    requester_->PostTask(BindOnce([&flushed] { flushed.Notify(); }));
+    flushed.WaitForNotification();
+
+    // Handling results may post a publish, which the second round waits for.
+    std::vector<hot_set::HotFile> files;
+    for (int i = 0; i < 2; ++i) {
+      absl::Notification listed;
+      cache_->GetHotFiles([&](std::vector<hot_set::HotFile> hot_files) {
+        files = std::move(hot_files);
+        listed.Notify();
+      });
+      listed.WaitForNotification();
+    }
+    return files;
+  }
+
+  // Returns a size for the cache, in which |num_files| small files fit. Its
+  // protected segment holds 80% of it.
+  static size_t SizeForFiles(size_t num_files) {
+    return num_files * sysconf(_SC_PAGESIZE) + 1000;
+  }
+
+  // Returns |num_files| names of files in |subdir|, each of which goes to
+  // another one of |num_shards|.
+  std::vector<std::string> NamesInDistinctShards(const std::string& subdir,
+                                                 size_t num_files,
+                                                 size_t num_shards) {
+    std::vector<std::string> names;
+    std::vector<bool> used(num_shards);
+    for (int i = 0; names.size() < num_files; ++i) {
+      std::string name = absl::StrCat(subdir, "/", i, ".txt");
+      // Like |CompressionCache::ShardFor|.
+      size_t shard =
+          absl::Hash<absl::string_view>()(dir_ + name) % num_shards;
+      if (!used[shard]) {
+        used[shard] = true;
+        names.push_back(std::move(name));
+      }
+    }
+    return names;
+  }
+
+  // Returns the cached paths, relative to |dir_|.
+  std::vector<std::string> CachedPaths() {
+    std::vector<std::string> paths;
+    for (const hot_set::HotFile& file : HotFiles()) {
+      paths.push_back(file.path.substr(dir_.size()));
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+  }
+
+  std::string dir_;
+  std::unique_ptr<FileCache> file_cache_;
+  Config config_;
+  CompressionPolicy policy_{config_, [] { return 0.0; }};
+  // A single thread, so files are encoded serially on the requesting thread.
+  ThreadPool thread_pool_{1};
+  std::unique_ptr<CompressionCache> cache_;
+  std::shared_ptr<TaskRunner> requester_ = TaskRunner::Create();
+};
+
+}  // namespace
+
+TEST_F(CompressionCacheTest, FileChangedWhileEncoding) {
+  auto old_file = WriteFile("/foo.txt", MakeContents(1000 * 1000, 1));
+
+  // The first request's encoding runs on |encoder|, which is held up once it
+  // started.
+  auto encoder = TaskRunner::Create();
+  absl::Notification release;
+  absl::Notification started;
+  Request(encoder.get(), old_file,
+          [&](Result<CompressionCache::File> file) {
+            ASSERT_TRUE(file.ok());
+            EXPECT_FALSE(file->complete());
+            encoder->PostTask(BindOnce([&] { release.WaitForNotification(); }));
+            started.Notify();
+          });
+  ASSERT_TRUE(started.WaitForNotificationWithTimeout(absl::Seconds(10)));
+
+  auto requester = TaskRunner::Create();
+
+  // The same version follows the encoder.
+  absl::Notification followed;
+  Request(requester.get(), old_file,
+          [&](Result<CompressionCache::File> file) {
+            ASSERT_TRUE(file.ok());
+            EXPECT_FALSE(file->complete());
+            followed.Notify();
+          });
+  EXPECT_TRUE(followed.WaitForNotificationWithTimeout(absl::Seconds(10)));
+
+  // A new version doesn't wait for the old one, and gets its own encoding.
+  std::string new_contents = MakeContents(100 * 1000, 2);
+  auto new_file = WriteFile("/foo.txt", new_contents);
+  absl::Notification encoded;
+  std::string gzip;
+  Request(requester.get(), new_file,
+          [&](Result<CompressionCache::File> file) {
+            ASSERT_TRUE(file.ok());
+            auto reader =
+                std::make_shared<CompressionCache::File>(std::move(*file));
+            // Encoded on |requester|, so read it elsewhere.
+            std::thread([&, reader] {
+              gzip = ReadAll(reader.get());
+              encoded.Notify();
+            }).detach();
+          });
+  ASSERT_TRUE(encoded.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  EXPECT_EQ(new_contents, Gunzip(gzip));
+
+  release.Notify();
+  encoder->Stop();
+  requester->Stop();
+}
+
+TEST_F(CompressionCacheTest, EncodesVersionReplacedByRename) {
+  std::string old_contents = MakeContents(100 * 1000, 1);
+  auto old_file = WriteFile("/foo.txt", old_contents);
+
+  // Like a deploy, which replaces the file atomically.
+  WriteFile("/foo.txt.new", MakeContents(100 * 1000, 2));
+  ASSERT_EQ(0, rename((dir_ + "/foo.txt.new").c_str(),
+                      (dir_ + "/foo.txt").c_str()));
+  EXPECT_EQ(old_contents, Encode(old_file));
+}
+
+TEST_F(CompressionCacheTest, RequestsFromThreadWithoutTaskRunner) {
+  std::string contents = MakeContents(100 * 1000, 1);
+  auto file = WriteFile("/foo.txt", contents);
+
+  absl::optional<Result<CompressionCache::File>> requested;
+  absl::Notification done;
+  std::thread([&] {
+    cache_->RequestFile(file, Encoding::kGzip,
+                        [&](Result<CompressionCache::File> file) {
+                          requested.emplace(std::move(file));
+                          done.Notify();
+                        });
+  }).join();
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  ASSERT_TRUE(requested->ok());
+  EXPECT_EQ(contents, Gunzip(ReadAll(&**requested)));
+}
+
+TEST_F(CompressionCacheTest, MaxFilesBoundsCachedFiles) {
+  CreateCache(/*max_size_bytes=*/100 * 1000 * 1000, /*max_files=*/2,
+              /*num_shards=*/1);
+  auto a = WriteFile("/a.txt", "a");
+  auto b = WriteFile("/b.txt", "b");
+  auto c = WriteFile("/c.txt", "c");
+
+  // Files are cached once requested twice.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ("a", Encode(a));
+    EXPECT_EQ("b", Encode(b));
+  }
+  EXPECT_EQ((std::vector<std::string>{"/a.txt", "/b.txt"}), CachedPaths());
+
+  // Requested more often than the others, so it takes the place of one.
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ("c", Encode(c));
+  }
+  auto paths = CachedPaths();
+  EXPECT_EQ(2u, paths.size());
+  EXPECT_NE(paths.end(), std::find(paths.begin(), paths.end(), "/c.txt"));
+}
+
+TEST_F(CompressionCacheTest, ReadsWhileEncoding) {
+  std::string contents = MakeContents(1000 * 1000, 3);
+  auto source = WriteFile("/foo.bin", contents);
+  auto encoder = TaskRunner::Create();
+  absl::Notification release;
+  auto file = RequestPaused(encoder.get(), source, &release);
+  ASSERT_TRUE(file.ok());
+  ASSERT_FALSE(file->complete());
+
+  // What was encoded so far can be read, then reads wait for the encoder.
+  std::string gzip;
+  while (true) {
+    char buf[BUFSIZ];
+    auto num_read = file->Read(absl::MakeSpan(buf, sizeof(buf)));
+    ASSERT_TRUE(num_read.ok());
+    ASSERT_NE(-1, *num_read);
+    if (*num_read == 0) {
+      break;
+    }
+    gzip.append(buf, *num_read);
+  }
+  EXPECT_EQ(file->size(), gzip.size());
+  absl::Notification readable;
+  file->NotifyWhenReadable([&readable] { readable.Notify(); });
+  EXPECT_FALSE(readable.WaitForNotificationWithTimeout(absl::Milliseconds(50)));
+
+  release.Notify();
+  EXPECT_TRUE(readable.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  gzip += ReadAll(&*file);
+  EXPECT_EQ(contents, Gunzip(gzip));
+  encoder->Stop();
+}
+
+TEST_F(CompressionCacheTest, SealedOnceComplete) {
+  auto source = WriteFile("/foo.bin", MakeContents(1000 * 1000, 4));
+  auto encoder = TaskRunner::Create();
+  absl::Notification release;
+  auto file = RequestPaused(encoder.get(), source, &release);
+  ASSERT_TRUE(file.ok());
+  EXPECT_EQ(0, fcntl(file->fd(), F_GET_SEALS));
+
+  release.Notify();
+  ReadAll(&*file);
+  ASSERT_TRUE(file->complete());
+  constexpr int kSeals =
+      F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+  EXPECT_EQ(kSeals, fcntl(file->fd(), F_GET_SEALS) & kSeals);
+  EXPECT_GT(0, pwrite(file->fd(), "x", 1, 0));
+  EXPECT_EQ(EPERM, errno);
+  EXPECT_GT(0, ftruncate(file->fd(), 0));
+  EXPECT_EQ(EPERM, errno);
+  encoder->Stop();
+}
+
+TEST_F(CompressionCacheTest, FailureReachesWaitingReaders) {
+  auto source = WriteFile("/foo.bin", MakeContents(1000 * 1000, 5));
+  auto encoder = TaskRunner::Create();
+  absl::Notification release;
+  auto file = RequestPaused(encoder.get(), source, &release);
+  ASSERT_TRUE(file.ok());
+
+  char buf[BUFSIZ];
+  while (true) {
+    auto num_read = file->Read(absl::MakeSpan(buf, sizeof(buf)));
+    ASSERT_TRUE(num_read.ok());
+    if (*num_read == 0) {
+      break;
+    }
+  }
+  absl::Notification readable;
+  file->NotifyWhenReadable([&readable] { readable.Notify(); });
+
+  // The encoder's next append fails, as it would grow the memfd past the file
+  // size limit.
+  struct rlimit old_limit;
+  ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old_limit));
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = file->size();
+  sighandler_t old_handler = signal(SIGXFSZ, SIG_IGN);
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+
+  release.Notify();
+  EXPECT_TRUE(readable.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  EXPECT_FALSE(file->Read(absl::MakeSpan(buf, sizeof(buf))).ok());
+  EXPECT_FALSE(file->complete());
+
+  encoder->Stop();
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &old_limit));
+  signal(SIGXFSZ, old_handler);
+}
+
+TEST_F(CompressionCacheTest, AdmitsFilesRequestedBefore) {
+  auto a = WriteFile("/a.txt", "a");
+
+  // Still encoded for the first request, without being cached.
+  EXPECT_EQ("a", Encode(a));
+  EXPECT_TRUE(CachedPaths().empty());
+
+  EXPECT_EQ("a", Encode(a));
+  EXPECT_EQ((std::vector<std::string>{"/a.txt"}), CachedPaths());
+}
+
+TEST_F(CompressionCacheTest, EvictsLeastRecentProbationaryFile) {
+  CreateCache(SizeForFiles(2), /*max_files=*/1000, /*num_shards=*/1);
+  auto a = WriteFile("/a.txt", "a");
+  auto b = WriteFile("/b.txt", "b");
+  auto c = WriteFile("/c.txt", "c");
+  for (int i = 0; i < 2; ++i) {
+    Encode(a);
+  }
+  for (int i = 0; i < 2; ++i) {
+    Encode(b);
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    Encode(c);
+  }
+  EXPECT_EQ((std::vector<std::string>{"/b.txt", "/c.txt"}), CachedPaths());
+}
+
+TEST_F(CompressionCacheTest, ScanOnlyEvictsProbationaryFiles) {
+  CreateCache(SizeForFiles(2), /*max_files=*/1000, /*num_shards=*/1);
+  auto a = WriteFile("/a.txt", "a");
+  for (int i = 0; i < 2; ++i) {
+    Encode(a);
+  }
+  // The hit moves it to the protected segment.
+  EXPECT_EQ("a", Encode(a));
+  HotFiles();
+
+  // Each file of the scan misses until it was requested more often than the
+  // previous one, and is then admitted in place of it. Had |a| stayed on
+  // probation, it would have been evicted first, as the least recent.
+  int num_requests = 2;
+  for (const char* name : {"/b.txt", "/c.txt", "/d.txt"}) {
+    auto file = WriteFile(name, name);
+    for (int i = 0; i < num_requests; ++i) {
+      EXPECT_EQ(name, Encode(file));
+    }
+    ++num_requests;
+  }
+  EXPECT_EQ((std::vector<std::string>{"/a.txt", "/d.txt"}), CachedPaths());
+}
+
+TEST_F(CompressionCacheTest, InvalidateReleasesMemory) {
+  CreateCache(SizeForFiles(2), /*max_files=*/1000, /*num_shards=*/1);
+  auto a = WriteFile("/a.txt", "a");
+  auto b = WriteFile("/b.txt", "b");
+  for (int i = 0; i < 3; ++i) {
+    Encode(a);
+  }
+  for (int i = 0; i < 2; ++i) {
+    Encode(b);
+  }
+  ASSERT_EQ((std::vector<std::string>{"/a.txt", "/b.txt"}), CachedPaths());
+
+  cache_->Invalidate(dir_);
+  EXPECT_TRUE(CachedPaths().empty());
+
+  // Both fit again, which they wouldn't if the memory of the invalidated files
+  // was still accounted for.
+  auto c = WriteFile("/c.txt", "c");
+  auto d = WriteFile("/d.txt", "d");
+  for (int i = 0; i < 2; ++i) {
+    Encode(c);
+  }
+  for (int i = 0; i < 2; ++i) {
+    Encode(d);
+  }
+  EXPECT_EQ((std::vector<std::string>{"/c.txt", "/d.txt"}), CachedPaths());
+}
+
+TEST_F(CompressionCacheTest, HitsServedFromSnapshot) {
+  auto a = WriteFile("/a.txt", "a");
+  for (int i = 0; i < 2; ++i) {
+    bool from_snapshot = true;
+    auto miss = Request(a, &from_snapshot);
+    ASSERT_TRUE(miss.ok());
+    EXPECT_FALSE(from_snapshot);
+    EXPECT_EQ("a", Gunzip(ReadAll(&*miss)));
+  }
+  // Waits for the snapshot holding it.
+  ASSERT_EQ(1u, HotFiles().size());
+
+  bool from_snapshot = false;
+  auto hit = Request(a, &from_snapshot);
+  ASSERT_TRUE(hit.ok());
+  EXPECT_TRUE(from_snapshot);
+  EXPECT_TRUE(hit->complete());
+  EXPECT_EQ("a", Gunzip(ReadAll(&*hit)));
+}
+
+TEST_F(CompressionCacheTest, AccountsForHitBatches) {
+  auto a = WriteFile("/a.txt", "a");
+  for (int i = 0; i < 2; ++i) {
+    Encode(a);
+  }
+  ASSERT_EQ(1u, HotFiles().size());
+
+  // Hits in a row are mostly accounted for in a single batch.
+  constexpr int kNumHits = 8;
+  absl::Notification hit;
+  requester_->PostTask(BindOnce([&] {
+    for (int i = 0; i < kNumHits; ++i) {
+      cache_->RequestFile(a, Encoding::kGzip,
+                          [](Result<CompressionCache::File> file) {
+                            EXPECT_TRUE(file.ok());
+                          });
+    }
+    hit.Notify();
+  }));
+  hit.WaitForNotification();
+
+  auto hot_files = HotFiles();
+  ASSERT_EQ(1u, hot_files.size());
+  EXPECT_EQ(2 + kNumHits, hot_files[0].frequency);
+}
+
+TEST_F(CompressionCacheTest, SnapshotSkipsChangedFiles) {
+  auto a = WriteFile("/a.txt", "a");
+  for (int i = 0; i < 2; ++i) {
+    Encode(a);
+  }
+  ASSERT_EQ(1u, HotFiles().size());
+
+  // Still in the snapshot, but encoded from the previous version.
+  auto new_a = WriteFile("/a.txt", "new a");
+  bool from_snapshot = true;
+  auto file = Request(new_a, &from_snapshot);
+  ASSERT_TRUE(file.ok());
+  EXPECT_FALSE(from_snapshot);
+  EXPECT_EQ("new a", Gunzip(ReadAll(&*file)));
+}
+
+TEST_F(CompressionCacheTest, InvalidateReachesEveryShard) {
+  constexpr size_t kNumShards = 4;
+  CreateCache(/*max_size_bytes=*/100 * 1000 * 1000, /*max_files=*/1000,
+              kNumShards);
+  ASSERT_EQ(0, mkdir((dir_ + "/dir").c_str(), 0755));
+  std::vector<std::string> names =
+      NamesInDistinctShards("/dir", /*num_files=*/2, kNumShards);
+  names.push_back("/other.txt");
+  for (const std::string& name : names) {
+    auto file = WriteFile(name, name);
+    for (int i = 0; i < 2; ++i) {
+      EXPECT_EQ(name, Encode(file));
+    }
+  }
+  ASSERT_EQ(3u, CachedPaths().size());
+
+  cache_->Invalidate(dir_ + "/dir");
+  EXPECT_EQ((std::vector<std::string>{"/other.txt"}), CachedPaths());
+}
+
+TEST_F(CompressionCacheTest, MissesInOtherShardsRunInParallel) {
+  constexpr size_t kNumShards = 4;
+  CreateCache(/*max_size_bytes=*/100 * 1000 * 1000, /*max_files=*/1000,
+              kNumShards);
+  std::vector<std::string> names =
+      NamesInDistinctShards("", /*num_files=*/2, kNumShards);
+  auto blocked = WriteFile(names[0], names[0]);
+  auto other = WriteFile(names[1], names[1]);
+
+  // A miss runs its callback on the thread of its shard, which this one holds
+  // up.
+  absl::Notification started;
+  absl::Notification release;
+  Request(requester_.get(), blocked,
+          [&](Result<CompressionCache::File> file) {
+            EXPECT_TRUE(file.ok());
+            started.Notify();
+            release.WaitForNotification();
+          });
+  ASSERT_TRUE(started.WaitForNotificationWithTimeout(absl::Seconds(10)));
+
+  auto file = Request(other);
+  release.Notify();
+  ASSERT_TRUE(file.ok()) << file.err();
+  EXPECT_EQ(names[1], Gunzip(ReadAll(&*file)));
+}
+
+TEST_F(CompressionCacheTest, OnlyCachesFilesWhichFitIntoAShard) {
+  constexpr size_t kNumShards = 4;
+  CreateCache(/*max_size_bytes=*/kNumShards * SizeForFiles(1),
+              /*max_files=*/1000, kNumShards);
+
+  auto small = WriteFile("/small.txt", "small");
+  EXPECT_TRUE(cache_->ShouldCache(*small));
+  // Fits into the whole cache, but not into the shard it would be cached in.
+  auto large = WriteFile("/large.txt", MakeContents(2 * SizeForFiles(1), 1));
+  EXPECT_FALSE(cache_->ShouldCache(*large));
+}
+
+TEST_F(CompressionCacheTest, FewerFilesThanShards) {
+  CreateCache(/*max_size_bytes=*/100 * 1000 * 1000, /*max_files=*/2,
+              /*num_shards=*/4);
+  auto a = WriteFile("/a.txt", "a");
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ("a", Encode(a));
+  }
+  EXPECT_EQ((std::vector<std::string>{"/a.txt"}), CachedPaths());
+}
@@ -0,0 +1,44 @@
+#include "main/compression-policy.h"
+
+#include <stdlib.h>
+
+#include <ctime>
+#include <thread>
+#include <utility>
+
+// static
+double CompressionPolicy::SystemLoad() {
+  double load = 0;
+  unsigned num_cores = std::thread::hardware_concurrency();
+  if (getloadavg(&load, 1) != 1 || num_cores == 0) {
+    return 0;
+  }
+
+  return load / num_cores;
+}
+
+CompressionPolicy::CompressionPolicy(const Config& config, LoadFunction load)
+    : level_(config.compression_level),
+      fast_level_(config.fast_compression_level),
+      best_level_(config.best_compression_level),
+      busy_load_(config.compression_busy_load),
+      recompress_min_frequency_(config.recompress_min_frequency),
+      load_(std::move(load)) {}
+
+int CompressionPolicy::Level(bool will_cache) const {
+  return will_cache && !IsBusy() ? level_ : fast_level_;
+}
+
+bool CompressionPolicy::ShouldRecompress(int level, int frequency) const {
+  return recompress_min_frequency_ > 0 && level < best_level_ &&
+         frequency >= recompress_min_frequency_ && !IsBusy();
+}
+
+bool CompressionPolicy::IsBusy() const {
+  int64_t now = time(nullptr);
+  if (sampled_at_.exchange(now, std::memory_order_relaxed) != now) {
+    busy_.store(load_() > busy_load_, std::memory_order_relaxed);
+  }
+
+  return busy_.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,47 @@
+#ifndef MAIN_COMPRESSION_POLICY_H_
+#define MAIN_COMPRESSION_POLICY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+#include "main/config.h"
+
+// Picks zlib compression levels, spending CPU where it saves the most bytes:
+// fast levels for output which is thrown away after one response or while the
+// machine is busy, and the best level for popular cached files. Thread safe.
+class CompressionPolicy {
+ public:
+  // Returns the recent load average per core.
+  using LoadFunction = std::function<double()>;
+  static double SystemLoad();
+
+  explicit CompressionPolicy(const Config& config,
+                             LoadFunction load = &SystemLoad);
+  CompressionPolicy(const CompressionPolicy&) = delete;
+  CompressionPolicy& operator=(const CompressionPolicy&) = delete;
+
+  // Level for encoding a file, which is kept in a cache if |will_cache|.
+  int Level(bool will_cache) const;
+
+  // Returns true if a cached file encoded at |level| and requested |frequency|
+  // times recently should be recompressed at |best_level|.
+  bool ShouldRecompress(int level, int frequency) const;
+  int best_level() const { return best_level_; }
+
+ private:
+  // Samples the load at most once per second.
+  bool IsBusy() const;
+
+  const int level_;
+  const int fast_level_;
+  const int best_level_;
+  const double busy_load_;
+  const int recompress_min_frequency_;
+  const LoadFunction load_;
+
+  mutable std::atomic<int64_t> sampled_at_{-1};
+  mutable std::atomic<bool> busy_{false};
+};
+
+#endif  // MAIN_COMPRESSION_POLICY_H_
@@ -0,0 +1,49 @@
+#include "main/compression-policy.h"
+
+#include "gtest/gtest.h"
+
+TEST(CompressionPolicyTest, Levels) {
+  Config config;
+  config.compression_level = 6;
+  config.fast_compression_level = 1;
+  config.compression_busy_load = 0.5;
+
+  CompressionPolicy idle(config, [] { return 0.1; });
+  EXPECT_EQ(6, idle.Level(/*will_cache=*/true));
+  EXPECT_EQ(1, idle.Level(/*will_cache=*/false));
+
+  CompressionPolicy busy(config, [] { return 0.9; });
+  EXPECT_EQ(1, busy.Level(/*will_cache=*/true));
+  EXPECT_EQ(1, busy.Level(/*will_cache=*/false));
+}
+
+TEST(CompressionPolicyTest, ShouldRecompress) {
+  Config config;
+  config.best_compression_level = 9;
+  config.compression_busy_load = 0.5;
+  config.recompress_min_frequency = 4;
+
+  CompressionPolicy idle(config, [] { return 0.1; });
+  EXPECT_TRUE(idle.ShouldRecompress(/*level=*/6, /*frequency=*/4));
+  EXPECT_FALSE(idle.ShouldRecompress(/*level=*/6, /*frequency=*/3));
+  EXPECT_FALSE(idle.ShouldRecompress(/*level=*/9, /*frequency=*/10));
+
+  CompressionPolicy busy(config, [] { return 0.9; });
+  EXPECT_FALSE(busy.ShouldRecompress(/*level=*/6, /*frequency=*/10));
+
+  config.recompress_min_frequency = 0;
+  CompressionPolicy disabled(config, [] { return 0.1; });
+  EXPECT_FALSE(disabled.ShouldRecompress(/*level=*/1, /*frequency=*/16));
+}
+
+TEST(CompressionPolicyTest, SamplesLoadOncePerSecond) {
+  int num_samples = 0;
+  CompressionPolicy policy(Config(), [&] {
+    ++num_samples;
+    return 0.0;
+  });
+  for (int i = 0; i < 100; ++i) {
+    policy.Level(/*will_cache=*/true);
+  }
+  EXPECT_LE(num_samples, 2);
+}
@@ -0,0 +1,67 @@
+#include "main/conditional-request.h"
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "main/http-response.h"
+
+namespace conditional_request {
+
+namespace {
+
+constexpr char kWeakPrefix[] = "W/";
+
+absl::string_view StripWeak(absl::string_view etag) {
+  if (absl::StartsWith(etag, kWeakPrefix)) {
+    etag.remove_prefix(strlen(kWeakPrefix));
+  }
+  return etag;
+}
+
+}  // namespace
+
+std::string MakeETag(ino_t inode, size_t size, time_t mtime) {
+  return absl::StrFormat("\"%x-%x-%x\"", inode, size, mtime);
+}
+
+bool IfNoneMatchMatches(absl::string_view field_value,
+                        absl::string_view etag) {
+  field_value = absl::StripAsciiWhitespace(field_value);
+  if (field_value == "*") {
+    return true;
+  }
+
+  etag = StripWeak(etag);
+  for (absl::string_view candidate : absl::StrSplit(field_value, ',')) {
+    if (StripWeak(absl::StripAsciiWhitespace(candidate)) == etag) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool IsNotModified(const HttpRequest& request, absl::string_view etag,
+                   time_t mtime) {
+  if (request.method != HttpRequest::Method::kGet) {
+    return false;
+  }
+
+  absl::string_view if_none_match =
+      request.header(HttpRequest::Header::kIfNoneMatch);
+  if (!if_none_match.empty()) {
+    return IfNoneMatchMatches(if_none_match, etag);
+  }
+
+  absl::string_view if_modified_since =
+      request.header(HttpRequest::Header::kIfModifiedSince);
+  if (!if_modified_since.empty()) {
+    auto since = HttpResponse::ParseTime(if_modified_since);
+    return since.ok() && mtime <= *since;
+  }
+
+  return false;
+}
+
+}  // namespace conditional_request
@@ -0,0 +1,30 @@
+#ifndef MAIN_CONDITIONAL_REQUEST_H_
+#define MAIN_CONDITIONAL_REQUEST_H_
+
+#include <sys/types.h>
+
+#include <ctime>
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "main/http-request.h"
+
+// Validators and preconditions for conditional requests. See rfc7232.
+namespace conditional_request {
+
+// Returns a strong entity-tag derived from the identity and version of a file.
+std::string MakeETag(ino_t inode, size_t size, time_t mtime);
+
+// Returns true if |etag| matches an entry of an If-None-Match field value.
+// Uses the weak comparison function. rfc7232 - 3.2
+bool IfNoneMatchMatches(absl::string_view field_value, absl::string_view etag);
+
+// Returns true if |request| is a GET whose client copy is still current, so
+// 304 (Not Modified) should be sent. If-None-Match takes precedence over
+// If-Modified-Since. rfc7232 - 6
+bool IsNotModified(const HttpRequest& request, absl::string_view etag,
+                   time_t mtime);
+
+}  // namespace conditional_request
+
+#endif  // MAIN_CONDITIONAL_REQUEST_H_
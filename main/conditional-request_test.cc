@@ -0,0 +1,69 @@
+#include "main/conditional-request.h"
+
+#include "gtest/gtest.h"
+#include "main/http-response.h"
+
+namespace {
+
+constexpr char kETag[] = "\"1f-400-5cd1\"";
+
+HttpRequest MakeGet() {
+  HttpRequest request;
+  request.method = HttpRequest::Method::kGet;
+  request.target = "/";
+  request.version = "HTTP/1.1";
+  return request;
+}
+
+void SetHeader(HttpRequest* request, HttpRequest::Header header,
+               absl::string_view value) {
+  request->header_values_[static_cast<size_t>(header)] = value;
+}
+
+}  // namespace
+
+TEST(ConditionalRequestTest, MakeETag) {
+  EXPECT_EQ(kETag, conditional_request::MakeETag(0x1f, 0x400, 0x5cd1));
+}
+
+TEST(ConditionalRequestTest, IfNoneMatchMatches) {
+  using conditional_request::IfNoneMatchMatches;
+  EXPECT_TRUE(IfNoneMatchMatches(kETag, kETag));
+  EXPECT_TRUE(IfNoneMatchMatches("*", kETag));
+  EXPECT_TRUE(IfNoneMatchMatches("\"a\", W/\"1f-400-5cd1\"", kETag));
+  EXPECT_FALSE(IfNoneMatchMatches("\"a\", \"b\"", kETag));
+  EXPECT_FALSE(IfNoneMatchMatches("", kETag));
+}
+
+TEST(ConditionalRequestTest, IsNotModified) {
+  using conditional_request::IsNotModified;
+  constexpr time_t kMtime = 784111777;  // Sun, 06 Nov 1994 08:49:37 GMT
+
+  HttpRequest request = MakeGet();
+  EXPECT_FALSE(IsNotModified(request, kETag, kMtime));
+
+  SetHeader(&request, HttpRequest::Header::kIfModifiedSince,
+            "Sun, 06 Nov 1994 08:49:37 GMT");
+  EXPECT_TRUE(IsNotModified(request, kETag, kMtime));
+  EXPECT_FALSE(IsNotModified(request, kETag, kMtime + 1));
+
+  SetHeader(&request, HttpRequest::Header::kIfModifiedSince, "garbage");
+  EXPECT_FALSE(IsNotModified(request, kETag, kMtime));
+
+  // If-None-Match takes precedence.
+  SetHeader(&request, HttpRequest::Header::kIfModifiedSince,
+            "Sun, 06 Nov 1994 08:49:37 GMT");
+  SetHeader(&request, HttpRequest::Header::kIfNoneMatch, "\"other\"");
+  EXPECT_FALSE(IsNotModified(request, kETag, kMtime));
+  SetHeader(&request, HttpRequest::Header::kIfNoneMatch, kETag);
+  EXPECT_TRUE(IsNotModified(request, kETag, kMtime));
+}
+
+TEST(ConditionalRequestTest, TimeRoundTrip) {
+  auto formatted = HttpResponse::FormatTime(784111777);
+  ASSERT_TRUE(formatted.ok());
+  EXPECT_EQ("Sun, 06 Nov 1994 08:49:37 GMT", *formatted);
+  auto parsed = HttpResponse::ParseTime(*formatted);
+  ASSERT_TRUE(parsed.ok());
+  EXPECT_EQ(784111777, *parsed);
+}
@@ -7,9 +7,65 @@
 struct Config {
   uint16_t port = 0;
   int num_worker_threads = 0;  // If 0, will pick based on number of cores.
+  // Threads for CPU heavy compression work, kept apart from the workers so
+  // that it doesn't delay connections. If 0, will pick the number of cores.
+  int num_compression_threads = 0;
+  // If true, every worker thread accepts and serves its own connections on a
+  // SO_REUSEPORT socket instead of a single thread dispatching to workers.
+  bool reuse_port = false;
+  // If true, connections are accepted and received from with io_uring
+  // instead of epoll. Each reactor falls back to epoll if it can't set up its
+  // ring.
+  bool io_uring = false;
+  // If true, precompressed sidecar files like "foo.js.gz" are served to
+  // clients which accept their encoding.
+  bool serve_precompressed = false;
   int verbosity = 1;
   std::string path_to_serve;
   size_t compression_cache_size = 1000ul * 1000 * 1000;
+  // Each cached file holds a descriptor open, so this is capped like
+  // |file_cache_size|.
+  size_t compression_cache_max_files = 10000;
+  // Larger files, or files larger than a shard's part of
+  // |compression_cache_size|, are compressed on the fly for each response
+  // instead.
+  size_t compression_cache_max_file_size = 64ul * 1000 * 1000;
+  // Files are split by path between shards with a thread of their own. If 0,
+  // will pick the number of cores.
+  size_t compression_cache_shards = 0;
+  // If set, cached compressed files are also kept in this directory, up to
+  // |compression_disk_cache_size| bytes, so they survive restarts.
+  std::string compression_cache_dir;
+  size_t compression_disk_cache_size = 4000ul * 1000 * 1000;
+  // If set, the files in the compression cache are recorded in this file
+  // every |hot_set_interval_ms|. At startup, the ones recorded by the previous
+  // run are compressed again while requests are served, for at most
+  // |warm_up_timeout_ms| and |warm_up_max_bytes| of source files.
+  std::string hot_set_file;
+  int hot_set_interval_ms = 60 * 1000;
+  int warm_up_timeout_ms = 60 * 1000;
+  size_t warm_up_max_bytes = 1000ul * 1000 * 1000;
+  // If set, created once warm-up is done, e.g. for readiness probes.
+  std::string ready_file;
+  // zlib compression levels, from 1 (fastest) to 9 (smallest). The fast level
+  // is used when the load average per core exceeds |compression_busy_load|,
+  // and for output which isn't cached. Cached files requested at least
+  // |recompress_min_frequency| times are recompressed at the best level in the
+  // background. 0 disables recompression.
+  int compression_level = 6;
+  int fast_compression_level = 1;
+  int best_compression_level = 9;
+  double compression_busy_load = 0.75;
+  int recompress_min_frequency = 8;
+  // Number of entries. 0 disables. Each holds its file open, and its sidecars.
+  // Along with the files in the compression cache, they're capped to fit in
+  // half of the open files limit, which is raised to the hard limit at
+  // startup.
+  size_t file_cache_size = 10000;
+  // Only used if the served files can't be watched for changes.
+  int file_cache_ttl_ms = 1000;
+  size_t response_cache_size = 64ul * 1000 * 1000;  // 0 disables.
+  size_t response_cache_max_file_size = 16 * 1024;
 };
 
 #endif  // _MAIN_CONFIG_H_
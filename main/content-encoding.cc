@@ -0,0 +1,176 @@
+#include "main/content-encoding.h"
+
+#include <algorithm>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+
+namespace content_encoding {
+
+namespace {
+
+constexpr int kMaxWeight = 1000;
+constexpr char kQParam[] = "q=";
+
+// qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] )
+// rfc7231 - 5.3.1
+bool ParseQValue(absl::string_view text, int* weight) {
+  if (text.empty() || (text[0] != '0' && text[0] != '1')) {
+    return false;
+  }
+  int result = text[0] == '1' ? kMaxWeight : 0;
+  text.remove_prefix(1);
+  if (!text.empty()) {
+    if (text[0] != '.' || text.size() > 4) {
+      return false;
+    }
+    int scale = kMaxWeight / 10;
+    for (char c : text.substr(1)) {
+      if (!absl::ascii_isdigit(c)) {
+        return false;
+      }
+      result += (c - '0') * scale;
+      scale /= 10;
+    }
+  }
+  if (result > kMaxWeight) {
+    return false;
+  }
+
+  *weight = result;
+  return true;
+}
+
+bool Matches(absl::string_view coding, Encoding encoding) {
+  switch (encoding) {
+    case Encoding::kIdentity:
+      return absl::EqualsIgnoreCase(coding, "identity");
+    case Encoding::kGzip:
+      // rfc7230 - 4.2.3: x-gzip is equivalent to gzip.
+      return absl::EqualsIgnoreCase(coding, "gzip") ||
+             absl::EqualsIgnoreCase(coding, "x-gzip");
+    case Encoding::kBrotli:
+    case Encoding::kZstd:
+      return absl::EqualsIgnoreCase(coding, Name(encoding));
+  }
+
+  return false;
+}
+
+}  // namespace
+
+absl::string_view Name(Encoding encoding) {
+  switch (encoding) {
+    case Encoding::kIdentity:
+      return "";
+    case Encoding::kGzip:
+      return "gzip";
+    case Encoding::kBrotli:
+      return "br";
+    case Encoding::kZstd:
+      return "zstd";
+  }
+
+  return "";
+}
+
+absl::string_view FileExtension(Encoding encoding) {
+  switch (encoding) {
+    case Encoding::kIdentity:
+      return "";
+    case Encoding::kGzip:
+      return ".gz";
+    case Encoding::kBrotli:
+      return ".br";
+    case Encoding::kZstd:
+      return ".zst";
+  }
+
+  return "";
+}
+
+int Weight(absl::string_view accept_encoding, Encoding encoding) {
+  // -1 when there's no matching element.
+  int exact_weight = -1;
+  int wildcard_weight = -1;
+
+  for (absl::string_view element : absl::StrSplit(accept_encoding, ',')) {
+    std::pair<absl::string_view, absl::string_view> coding_and_params =
+        absl::StrSplit(element, absl::MaxSplits(';', 1));
+    absl::string_view coding =
+        absl::StripAsciiWhitespace(coding_and_params.first);
+    // Empty list elements are allowed. rfc7230 - 7
+    if (coding.empty()) {
+      continue;
+    }
+
+    int weight = kMaxWeight;
+    bool valid = true;
+    for (absl::string_view param :
+         absl::StrSplit(coding_and_params.second, ';', absl::SkipEmpty())) {
+      param = absl::StripAsciiWhitespace(param);
+      if (absl::StartsWithIgnoreCase(param, kQParam)) {
+        valid = ParseQValue(param.substr(strlen(kQParam)), &weight);
+      }
+    }
+    // Elements with a malformed weight are ignored.
+    if (!valid) {
+      continue;
+    }
+
+    if (coding == "*") {
+      wildcard_weight = std::max(wildcard_weight, weight);
+    } else if (Matches(coding, encoding)) {
+      exact_weight = std::max(exact_weight, weight);
+    }
+  }
+
+  if (exact_weight >= 0) {
+    return exact_weight;
+  }
+  if (wildcard_weight >= 0) {
+    return wildcard_weight;
+  }
+
+  // Identity is acceptable unless excluded. Other codings must be listed.
+  return encoding == Encoding::kIdentity ? kMaxWeight : 0;
+}
+
+Encoding Select(absl::string_view accept_encoding,
+                absl::Span<const Encoding> available) {
+  Encoding best = Encoding::kIdentity;
+  int best_weight = 0;
+  for (Encoding encoding : available) {
+    int weight = Weight(accept_encoding, encoding);
+    if (weight > best_weight) {
+      best = encoding;
+      best_weight = weight;
+    }
+  }
+
+  // A coding the client accepts as much as identity is preferred, as it's
+  // smaller.
+  if (best_weight == 0 ||
+      best_weight < Weight(accept_encoding, Encoding::kIdentity)) {
+    return Encoding::kIdentity;
+  }
+  return best;
+}
+
+std::string ETag(absl::string_view identity_etag, Encoding encoding) {
+  if (encoding == Encoding::kIdentity) {
+    return std::string(identity_etag);
+  }
+
+  // Insert the coding before the closing quote.
+  absl::ConsumePrefix(&identity_etag, "W/");
+  if (absl::ConsumeSuffix(&identity_etag, "\"")) {
+    return absl::StrCat("W/", identity_etag, "-", Name(encoding), "\"");
+  }
+  return absl::StrCat("W/", identity_etag, "-", Name(encoding));
+}
+
+}  // namespace content_encoding
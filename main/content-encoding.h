@@ -0,0 +1,54 @@
+#ifndef MAIN_CONTENT_ENCODING_H_
+#define MAIN_CONTENT_ENCODING_H_
+
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+
+// Content codings and Accept-Encoding negotiation. See rfc7231 - 3.1.2.2 and
+// 5.3.4.
+namespace content_encoding {
+
+enum class Encoding {
+  kIdentity,
+  kGzip,
+  kBrotli,
+  kZstd,
+};
+
+// Codings a precompressed sidecar file, e.g. "foo.js.br" next to "foo.js",
+// may have. Most preferred first.
+constexpr Encoding kSidecarEncodings[] = {
+    Encoding::kBrotli,
+    Encoding::kZstd,
+    Encoding::kGzip,
+};
+
+// Content-Encoding field value for |encoding|. Empty for |kIdentity|.
+absl::string_view Name(Encoding encoding);
+
+// File name extension of sidecar files with |encoding|, e.g. ".gz". Empty for
+// |kIdentity|.
+absl::string_view FileExtension(Encoding encoding);
+
+// Returns the weight an Accept-Encoding field value gives |encoding| in
+// thousandths, so q=1 is 1000. 0 means not acceptable. rfc7231 - 5.3.1
+int Weight(absl::string_view accept_encoding, Encoding encoding);
+
+// Picks the coding out of |available| the client prefers, earlier ones
+// winning ties. Falls back to |kIdentity| if the client prefers it or
+// accepts none of them.
+Encoding Select(absl::string_view accept_encoding,
+                absl::Span<const Encoding> available);
+
+// Entity-tag of the |encoding| representation of a file whose unencoded
+// representation has |identity_etag|. Weak unless |encoding| is identity:
+// the encoder's output depends on the compression level, which changes when
+// the file is recompressed, so the bytes aren't guaranteed to be the same.
+// rfc7232 - 2.1, 2.3.3
+std::string ETag(absl::string_view identity_etag, Encoding encoding);
+
+}  // namespace content_encoding
+
+#endif  // MAIN_CONTENT_ENCODING_H_
@@ -0,0 +1,66 @@
+#include "main/content-encoding.h"
+
+#include "gtest/gtest.h"
+
+using content_encoding::Encoding;
+
+TEST(ContentEncodingTest, Weight) {
+  EXPECT_EQ(1000, content_encoding::Weight("gzip, deflate", Encoding::kGzip));
+  EXPECT_EQ(1000, content_encoding::Weight("X-GZIP", Encoding::kGzip));
+  EXPECT_EQ(500, content_encoding::Weight("br, gzip;q=0.5", Encoding::kGzip));
+  EXPECT_EQ(125, content_encoding::Weight("gzip ; Q=0.125", Encoding::kGzip));
+  EXPECT_EQ(0, content_encoding::Weight("gzip;q=0", Encoding::kGzip));
+  EXPECT_EQ(0, content_encoding::Weight("br", Encoding::kGzip));
+  EXPECT_EQ(0, content_encoding::Weight("", Encoding::kGzip));
+  EXPECT_EQ(300, content_encoding::Weight("*;q=0.3", Encoding::kGzip));
+  EXPECT_EQ(0, content_encoding::Weight("gzip;q=0, *", Encoding::kGzip));
+
+  // Malformed weights drop the element.
+  EXPECT_EQ(0, content_encoding::Weight("gzip;q=2", Encoding::kGzip));
+  EXPECT_EQ(0, content_encoding::Weight("gzip;q=0.1234", Encoding::kGzip));
+  EXPECT_EQ(0, content_encoding::Weight("gzip;q=1.5", Encoding::kGzip));
+}
+
+TEST(ContentEncodingTest, IdentityWeight) {
+  EXPECT_EQ(1000, content_encoding::Weight("", Encoding::kIdentity));
+  EXPECT_EQ(1000, content_encoding::Weight("gzip", Encoding::kIdentity));
+  EXPECT_EQ(0, content_encoding::Weight("*;q=0", Encoding::kIdentity));
+  EXPECT_EQ(0, content_encoding::Weight("identity;q=0", Encoding::kIdentity));
+  EXPECT_EQ(1000, content_encoding::Weight("*;q=0, identity",
+                                           Encoding::kIdentity));
+}
+
+TEST(ContentEncodingTest, Select) {
+  const Encoding kGzip[] = {Encoding::kGzip};
+  EXPECT_EQ(Encoding::kGzip,
+            content_encoding::Select("gzip, deflate, br", kGzip));
+  EXPECT_EQ(Encoding::kGzip, content_encoding::Select("*", kGzip));
+  EXPECT_EQ(Encoding::kIdentity, content_encoding::Select("", kGzip));
+  EXPECT_EQ(Encoding::kIdentity, content_encoding::Select("deflate", kGzip));
+  EXPECT_EQ(Encoding::kIdentity, content_encoding::Select("gzip;q=0", kGzip));
+  EXPECT_EQ(Encoding::kIdentity,
+            content_encoding::Select("gzip;q=0.5, identity", kGzip));
+  EXPECT_EQ(Encoding::kIdentity, content_encoding::Select("gzip", {}));
+
+  const Encoding kBrotliAndGzip[] = {Encoding::kBrotli, Encoding::kGzip};
+  EXPECT_EQ(Encoding::kBrotli,
+            content_encoding::Select("gzip, deflate, br", kBrotliAndGzip));
+  EXPECT_EQ(Encoding::kGzip,
+            content_encoding::Select("br;q=0.5, gzip", kBrotliAndGzip));
+  EXPECT_EQ(Encoding::kGzip, content_encoding::Select("gzip", kBrotliAndGzip));
+}
+
+TEST(ContentEncodingTest, FileExtension) {
+  EXPECT_EQ(".gz", content_encoding::FileExtension(Encoding::kGzip));
+  EXPECT_EQ(".br", content_encoding::FileExtension(Encoding::kBrotli));
+  EXPECT_EQ(".zst", content_encoding::FileExtension(Encoding::kZstd));
+  EXPECT_EQ("zstd", content_encoding::Name(Encoding::kZstd));
+}
+
+TEST(ContentEncodingTest, ETag) {
+  EXPECT_EQ("\"abc\"", content_encoding::ETag("\"abc\"", Encoding::kIdentity));
+  EXPECT_EQ("W/\"abc-gzip\"",
+            content_encoding::ETag("\"abc\"", Encoding::kGzip));
+  EXPECT_EQ("W/\"abc-gzip\"",
+            content_encoding::ETag("W/\"abc\"", Encoding::kGzip));
+}
@@ -0,0 +1,295 @@
+#include "main/disk-cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "base/scoped-destructor.h"
+#include "base/scoped-fd.h"
+#include "base/util.h"
+
+namespace {
+
+// Changes whenever |FileHeader| does.
+constexpr char kMagic[8] = {'t', 'h', 't', 't', 'p', 'd', 'c', '1'};
+
+// Files being stored start with this, so ones left by a crash are recognized.
+constexpr char kTempPrefix[] = ".tmp";
+
+// Followed by the path of the source, then the encoded data. Integers are in
+// host byte order, the cache isn't meant to move between machines.
+struct FileHeader {
+  char magic[sizeof(kMagic)];
+  uint64_t source_size;
+  int64_t source_mtime;
+  uint64_t source_inode;
+  uint64_t data_size;
+  uint32_t encoding;
+  uint32_t level;
+  uint32_t path_size;
+  // CRC-32 of the path and the data.
+  uint32_t crc;
+};
+
+uLong Crc32(uLong crc, absl::string_view data) {
+  // crc32() takes at most a uInt at once.
+  while (!data.empty()) {
+    size_t length =
+        std::min<size_t>(data.size(), std::numeric_limits<uInt>::max());
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(data.data()), length);
+    data.remove_prefix(length);
+  }
+  return crc;
+}
+
+// FNV-1a. Names must be stable across runs, which absl::Hash isn't.
+uint64_t StableHash(absl::string_view data) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : data) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+}  // namespace
+
+DiskCache::StoredFile::StoredFile(void* mapping, size_t mapping_size)
+    : mapping_(mapping), mapping_size_(mapping_size) {}
+
+DiskCache::StoredFile::~StoredFile() { munmap(mapping_, mapping_size_); }
+
+// static
+Result<std::unique_ptr<DiskCache>> DiskCache::Create(std::string dir,
+                                                     size_t max_size_bytes) {
+  if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+    return BuildPosixErr(absl::StrCat("Failed to create ", dir));
+  }
+
+  auto ret = absl::WrapUnique(new DiskCache(std::move(dir), max_size_bytes));
+  TRY(ret->Scan());
+  return ret;
+}
+
+DiskCache::DiskCache(std::string dir, size_t max_size_bytes)
+    : dir_(std::move(dir)), max_size_bytes_(max_size_bytes) {}
+
+Result<void> DiskCache::Scan() {
+  DIR* dir = opendir(dir_.c_str());
+  if (dir == nullptr) {
+    return BuildPosixErr(absl::StrCat("Failed to open ", dir_));
+  }
+  ScopedDestructor close_dir([dir] { closedir(dir); });
+
+  // mtime, name, size.
+  std::vector<std::tuple<time_t, std::string, size_t>> files;
+  while (struct dirent* entry = readdir(dir)) {
+    absl::string_view name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    if (absl::StartsWith(name, kTempPrefix)) {
+      unlinkat(dirfd(dir), entry->d_name, 0);
+      continue;
+    }
+
+    struct stat stat_buf;
+    int result =
+        fstatat(dirfd(dir), entry->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW);
+    if (result < 0 || !S_ISREG(stat_buf.st_mode)) {
+      continue;
+    }
+    files.emplace_back(stat_buf.st_mtime, std::string(name),
+                       stat_buf.st_size);
+  }
+
+  // The most recently stored files end up in front.
+  std::sort(files.begin(), files.end());
+  absl::MutexLock lock(&mu_);
+  for (const auto& file : files) {
+    Add(std::get<1>(file), std::get<2>(file));
+  }
+  VLOG(1) << "Found " << name_to_entry_.size() << " cached files in " << dir_;
+  return {};
+}
+
+std::string DiskCache::FilePath(const Key& key) const {
+  uint64_t hash = StableHash(
+      absl::StrCat(key.path, "#", static_cast<int>(key.encoding)));
+  return absl::StrCat(dir_, "/", absl::Hex(hash, absl::kZeroPad16),
+                      content_encoding::FileExtension(key.encoding));
+}
+
+Result<std::unique_ptr<DiskCache::StoredFile>> DiskCache::Load(
+    const Key& key) {
+  std::string path = FilePath(key);
+  ScopedFd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!fd) {
+    if (errno == ENOENT) {
+      return std::unique_ptr<StoredFile>();
+    }
+    return BuildPosixErr(absl::StrCat("Failed to open ", path));
+  }
+
+  std::string name = path.substr(dir_.size() + 1);
+  auto corrupt = [&](absl::string_view what) {
+    absl::MutexLock lock(&mu_);
+    unlink(path.c_str());
+    Remove(name);
+    return Err(absl::StrCat("Deleted corrupt cached file ", path, ": ", what));
+  };
+
+  struct stat stat_buf;
+  if (fstat(*fd, &stat_buf) < 0) {
+    return BuildPosixErr(absl::StrCat("Failed to stat ", path));
+  }
+  size_t file_size = stat_buf.st_size;
+  if (file_size < sizeof(FileHeader)) {
+    return corrupt("truncated header");
+  }
+
+  void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, *fd, 0);
+  if (mapping == MAP_FAILED) {
+    return BuildPosixErr(absl::StrCat("Failed to map ", path));
+  }
+  auto ret = absl::WrapUnique(new StoredFile(mapping, file_size));
+
+  FileHeader header;
+  memcpy(&header, mapping, sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    return corrupt("bad magic");
+  }
+  if (file_size - sizeof(header) != header.path_size + header.data_size) {
+    return corrupt("bad size");
+  }
+
+  const char* bytes = static_cast<const char*>(mapping);
+  absl::string_view stored_path(bytes + sizeof(header), header.path_size);
+  absl::string_view data(stored_path.end(), header.data_size);
+
+  // Another file with the same name, or another version of this one.
+  if (stored_path != key.path ||
+      header.encoding != static_cast<uint32_t>(key.encoding) ||
+      header.source_size != key.source_size ||
+      header.source_mtime != key.source_mtime ||
+      header.source_inode != key.source_inode) {
+    return std::unique_ptr<StoredFile>();
+  }
+
+  if (Crc32(Crc32(crc32(0, nullptr, 0), stored_path), data) != header.crc) {
+    return corrupt("bad checksum");
+  }
+
+  {
+    absl::MutexLock lock(&mu_);
+    auto it = name_to_entry_.find(name);
+    if (it != name_to_entry_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+    }
+  }
+
+  ret->level_ = header.level;
+  ret->data_ = data;
+  return ret;
+}
+
+Result<void> DiskCache::Store(const Key& key, int level, int fd, size_t size) {
+  FileHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.source_size = key.source_size;
+  header.source_mtime = key.source_mtime;
+  header.source_inode = key.source_inode;
+  header.data_size = size;
+  header.encoding = static_cast<uint32_t>(key.encoding);
+  header.level = level;
+  header.path_size = key.path.size();
+
+  size_t file_size = sizeof(header) + key.path.size() + size;
+  if (file_size > max_size_bytes_) {
+    return {};
+  }
+
+  void* mapping = nullptr;
+  if (size > 0) {
+    mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      return BuildPosixErr("Failed to map encoded file");
+    }
+  }
+  ScopedDestructor unmap([mapping, size] {
+    if (mapping) {
+      munmap(mapping, size);
+    }
+  });
+  absl::string_view data(static_cast<const char*>(mapping), size);
+  header.crc = Crc32(Crc32(crc32(0, nullptr, 0), key.path), data);
+
+  // Written to a temporary file first, so a crash never leaves a partial
+  // file under the final name.
+  std::string temp_path = absl::StrCat(dir_, "/", kTempPrefix, "XXXXXX");
+  ScopedFd out(mkostemp(&temp_path[0], O_CLOEXEC));
+  if (!out) {
+    return BuildPosixErr(absl::StrCat("Failed to create ", temp_path));
+  }
+  ScopedDestructor remove_temp([&temp_path] {
+    if (!temp_path.empty()) {
+      unlink(temp_path.c_str());
+    }
+  });
+
+  TRY(util::WriteAll(
+      *out, {reinterpret_cast<const char*>(&header), sizeof(header)},
+      temp_path));
+  TRY(util::WriteAll(*out, key.path, temp_path));
+  TRY(util::WriteAll(*out, data, temp_path));
+
+  std::string path = FilePath(key);
+  absl::MutexLock lock(&mu_);
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    return BuildPosixErr(absl::StrCat("Failed to rename to ", path));
+  }
+  temp_path.clear();
+  Add(path.substr(dir_.size() + 1), file_size);
+  return {};
+}
+
+void DiskCache::Add(const std::string& name, size_t size) {
+  Remove(name);
+  lru_.push_front({name, size});
+  name_to_entry_.emplace(name, lru_.begin());
+  size_bytes_ += size;
+
+  while (size_bytes_ > max_size_bytes_) {
+    std::string victim = lru_.back().name;
+    VLOG(3) << "Deleting cached file " << victim;
+    unlink(absl::StrCat(dir_, "/", victim).c_str());
+    Remove(victim);
+  }
+}
+
+void DiskCache::Remove(const std::string& name) {
+  auto it = name_to_entry_.find(name);
+  if (it == name_to_entry_.end()) {
+    return;
+  }
+
+  size_bytes_ -= it->second->size;
+  lru_.erase(it->second);
+  name_to_entry_.erase(it);
+}
@@ -0,0 +1,109 @@
+#ifndef MAIN_DISK_CACHE_H_
+#define MAIN_DISK_CACHE_H_
+
+#include <sys/types.h>
+
+#include <list>
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "base/err.h"
+#include "main/content-encoding.h"
+#include "main/file-cache.h"
+
+// Keeps encoded files in a directory, so they survive restarts. Each is stored
+// in a file of its own, named after the path and encoding of the source. Its
+// header tells which version of the source it was encoded from, and holds a
+// CRC-32 which is checked when it's loaded.
+//
+// The files stored by an earlier run are only read once requested. Their total
+// size is bounded: the least recently used ones are deleted first. Thread
+// safe.
+class DiskCache {
+ public:
+  // Identifies an encoding of a version of a source file, like
+  // FileCache::Entry::etag does.
+  struct Key {
+    std::string path;
+    content_encoding::Encoding encoding;
+    size_t source_size;
+    time_t source_mtime;
+    ino_t source_inode;
+  };
+  static Key KeyFor(const FileCache::Entry& source,
+                    content_encoding::Encoding encoding) {
+    return {source.path, encoding, source.size, source.mtime, source.inode};
+  }
+
+  // A stored file, mapped into memory.
+  class StoredFile {
+   public:
+    ~StoredFile();
+    StoredFile(const StoredFile&) = delete;
+    StoredFile& operator=(const StoredFile&) = delete;
+
+    // zlib level the file was encoded at.
+    int level() const { return level_; }
+    absl::string_view data() const { return data_; }
+
+   private:
+    friend class DiskCache;
+    StoredFile(void* mapping, size_t mapping_size);
+
+    void* const mapping_;
+    const size_t mapping_size_;
+    int level_ = 0;
+    absl::string_view data_;
+  };
+
+  // Creates |dir| if needed. Files already in it are accounted for, up to
+  // |max_size_bytes|.
+  static Result<std::unique_ptr<DiskCache>> Create(std::string dir,
+                                                   size_t max_size_bytes);
+
+  DiskCache(const DiskCache&) = delete;
+  DiskCache& operator=(const DiskCache&) = delete;
+
+  // Returns null if no file is stored for |key|. A stored file which is
+  // corrupt is deleted, and an error is returned.
+  Result<std::unique_ptr<StoredFile>> Load(const Key& key);
+
+  // Stores the |size| bytes at the start of |fd|, encoded at zlib |level|,
+  // replacing any file stored for another version of the source.
+  Result<void> Store(const Key& key, int level, int fd, size_t size);
+
+ private:
+  DiskCache(std::string dir, size_t max_size_bytes);
+
+  // Accounts for the files left by an earlier run, oldest first.
+  Result<void> Scan();
+
+  std::string FilePath(const Key& key) const;
+
+  // Accounts for |name| taking |size| bytes, and deletes the least recently
+  // used files if over budget.
+  void Add(const std::string& name, size_t size)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void Remove(const std::string& name) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const std::string dir_;
+  const size_t max_size_bytes_;
+
+  struct Entry {
+    std::string name;
+    size_t size;
+  };
+  // Most recently used first.
+  using Lru = std::list<Entry>;
+
+  absl::Mutex mu_;
+  Lru lru_ GUARDED_BY(mu_);
+  absl::flat_hash_map<std::string, Lru::iterator> name_to_entry_
+      GUARDED_BY(mu_);
+  size_t size_bytes_ GUARDED_BY(mu_) = 0;
+};
+
+#endif  // MAIN_DISK_CACHE_H_
@@ -0,0 +1,132 @@
+#include "main/disk-cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "base/scoped-fd.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+using content_encoding::Encoding;
+
+class DiskCacheTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = testing::TempDir() + "/disk-cache_testXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(&dir_[0]));
+    cache_dir_ = dir_ + "/cache";
+  }
+
+  void TearDown() override {
+    ASSERT_EQ(0, system(("rm -rf " + dir_).c_str()));
+  }
+
+  // Stores |data| as the encoding described by |key|.
+  void Store(DiskCache* cache, const DiskCache::Key& key,
+             const std::string& data) {
+    std::string path = dir_ + "/data";
+    ScopedFd fd(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600));
+    ASSERT_TRUE(fd);
+    ASSERT_EQ(static_cast<ssize_t>(data.size()),
+              write(*fd, data.data(), data.size()));
+    ASSERT_TRUE(cache->Store(key, /*level=*/6, *fd, data.size()).ok());
+  }
+
+  // Names of the files in the cache directory.
+  std::vector<std::string> CachedFiles() {
+    std::vector<std::string> names;
+    DIR* dir = opendir(cache_dir_.c_str());
+    while (struct dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        names.push_back(entry->d_name);
+      }
+    }
+    closedir(dir);
+    return names;
+  }
+
+  std::string dir_;
+  std::string cache_dir_;
+};
+
+}  // namespace
+
+TEST_F(DiskCacheTest, StoresAcrossRestarts) {
+  DiskCache::Key key{"/www/foo.js", Encoding::kGzip, 100, 12345, 7};
+  {
+    auto cache = DiskCache::Create(cache_dir_, 1024 * 1024);
+    ASSERT_TRUE(cache.ok());
+    auto missing = (*cache)->Load(key);
+    ASSERT_TRUE(missing.ok());
+    EXPECT_EQ(nullptr, *missing);
+    Store(cache->get(), key, "encoded");
+  }
+
+  auto cache = DiskCache::Create(cache_dir_, 1024 * 1024);
+  ASSERT_TRUE(cache.ok());
+  auto stored = (*cache)->Load(key);
+  ASSERT_TRUE(stored.ok());
+  ASSERT_NE(nullptr, *stored);
+  EXPECT_EQ("encoded", (*stored)->data());
+  EXPECT_EQ(6, (*stored)->level());
+
+  // Other versions of the source miss.
+  DiskCache::Key modified = key;
+  modified.source_mtime = 12346;
+  auto stale = (*cache)->Load(modified);
+  ASSERT_TRUE(stale.ok());
+  EXPECT_EQ(nullptr, *stale);
+  DiskCache::Key replaced = key;
+  replaced.source_inode = 8;
+  EXPECT_EQ(nullptr, *(*cache)->Load(replaced));
+
+  // And replace the stored file.
+  Store(cache->get(), modified, "modified");
+  EXPECT_EQ(1u, CachedFiles().size());
+  EXPECT_EQ(nullptr, *(*cache)->Load(key));
+  EXPECT_EQ("modified", (*(*cache)->Load(modified))->data());
+}
+
+TEST_F(DiskCacheTest, DeletesCorruptFiles) {
+  DiskCache::Key key{"/www/foo.js", Encoding::kGzip, 100, 12345, 7};
+  auto cache = DiskCache::Create(cache_dir_, 1024 * 1024);
+  ASSERT_TRUE(cache.ok());
+  Store(cache->get(), key, "encoded");
+
+  auto names = CachedFiles();
+  ASSERT_EQ(1u, names.size());
+  std::string path = cache_dir_ + "/" + names[0];
+  ScopedFd fd(open(path.c_str(), O_WRONLY));
+  ASSERT_TRUE(fd);
+  off_t end = lseek(*fd, 0, SEEK_END);
+  ASSERT_EQ(1, pwrite(*fd, "E", 1, end - 1));
+
+  EXPECT_FALSE((*cache)->Load(key).ok());
+  EXPECT_TRUE(CachedFiles().empty());
+}
+
+TEST_F(DiskCacheTest, EvictsLeastRecentlyUsed) {
+  DiskCache::Key a{"/www/a", Encoding::kGzip, 1000, 1, 1};
+  DiskCache::Key b{"/www/b", Encoding::kGzip, 1000, 1, 2};
+  DiskCache::Key c{"/www/c", Encoding::kGzip, 1000, 1, 3};
+  std::string data(1000, 'x');
+  // Room for two files.
+  auto cache = DiskCache::Create(cache_dir_, 2500);
+  ASSERT_TRUE(cache.ok());
+
+  Store(cache->get(), a, data);
+  Store(cache->get(), b, data);
+  ASSERT_NE(nullptr, *(*cache)->Load(a));  // Make "b" the oldest.
+  Store(cache->get(), c, data);
+
+  EXPECT_EQ(2u, CachedFiles().size());
+  EXPECT_NE(nullptr, *(*cache)->Load(a));
+  EXPECT_EQ(nullptr, *(*cache)->Load(b));
+  EXPECT_NE(nullptr, *(*cache)->Load(c));
+}
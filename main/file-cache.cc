@@ -0,0 +1,196 @@
+#include "main/file-cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "base/util.h"
+#include "main/conditional-request.h"
+#include "main/http-response.h"
+
+namespace {
+
+constexpr char kIndexHtml[] = "/index.html";
+
+Result<void> OpenAndStat(FileCache::Entry* entry, struct stat* stat_buf) {
+  // O_NONBLOCK so that opening a FIFO doesn't wait for a writer. It has no
+  // effect on regular files.
+  entry->fd = ScopedFd(
+      open(entry->path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK));
+  if (!entry->fd) {
+    return BuildPosixErr(absl::StrCat("Failed to open ", entry->path));
+  }
+  if (fstat(*entry->fd, stat_buf) < 0) {
+    return BuildPosixErr(absl::StrCat("Failed to stat ", entry->path));
+  }
+
+  return {};
+}
+
+// Adds the sidecar of |entry| with |encoding| if there is a current one. Like
+// the file itself, it must not resolve to outside of |path_to_serve|.
+void FindSidecar(FileCache::Entry* entry, content_encoding::Encoding encoding,
+                 absl::string_view path_to_serve) {
+  auto path_or = util::CanonicalizePath(
+      absl::StrCat(entry->path, content_encoding::FileExtension(encoding)));
+  if (!path_or.ok()) {
+    return;
+  }
+  std::string path = std::move(*path_or);
+  if (!util::IsPathWithin(path, path_to_serve)) {
+    VLOG(1) << "Ignoring sidecar outside of path_to_serve: " << path;
+    return;
+  }
+
+  FileCache::Entry::Sidecar sidecar;
+  sidecar.encoding = encoding;
+  // Like in |OpenAndStat|, a FIFO must not block the open.
+  sidecar.fd = ScopedFd(open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK));
+  if (!sidecar.fd) {
+    return;
+  }
+
+  struct stat stat_buf;
+  if (fstat(*sidecar.fd, &stat_buf) < 0 || !S_ISREG(stat_buf.st_mode)) {
+    return;
+  }
+  // An older sidecar may have been built from an older version of the file.
+  if (stat_buf.st_mtime < entry->mtime) {
+    VLOG(1) << "Ignoring stale " << path;
+    return;
+  }
+
+  sidecar.size = stat_buf.st_size;
+  sidecar.etag = conditional_request::MakeETag(
+      stat_buf.st_ino, stat_buf.st_size, stat_buf.st_mtime);
+  entry->sidecars.push_back(std::move(sidecar));
+}
+
+}  // namespace
+
+const FileCache::Entry::Sidecar* FileCache::Entry::FindSidecar(
+    content_encoding::Encoding encoding) const {
+  for (const auto& sidecar : sidecars) {
+    if (sidecar.encoding == encoding) {
+      return &sidecar;
+    }
+  }
+  return nullptr;
+}
+
+FileCache::FileCache(std::string path_to_serve, size_t max_entries,
+                     absl::Duration ttl, bool find_sidecars)
+    : path_to_serve_(std::move(path_to_serve)),
+      max_entries_(max_entries),
+      find_sidecars_(find_sidecars),
+      ttl_(ttl) {}
+
+Result<std::shared_ptr<const FileCache::Entry>> FileCache::Lookup(
+    absl::string_view target) {
+  absl::Time now = absl::Now();
+  uint64_t generation;
+  {
+    absl::MutexLock lock(&mu_);
+    generation = generation_;
+    auto it = target_to_node_.find(target);
+    if (it != target_to_node_.end()) {
+      if (now < it->second->expiry) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->entry;
+      }
+
+      lru_.erase(it->second);
+      target_to_node_.erase(it);
+    }
+  }
+
+  // Resolve without holding the lock. Concurrent misses on the same target
+  // may both resolve it, which is harmless.
+  auto entry = TRY(Resolve(target));
+  if (max_entries_ == 0) {
+    return entry;
+  }
+
+  absl::MutexLock lock(&mu_);
+  if (generation != generation_ || target_to_node_.contains(target)) {
+    return entry;
+  }
+  lru_.push_front({std::string(target), entry, now + ttl_});
+  target_to_node_.emplace(lru_.front().target, lru_.begin());
+  while (lru_.size() > max_entries_) {
+    target_to_node_.erase(lru_.back().target);
+    lru_.pop_back();
+  }
+
+  return entry;
+}
+
+void FileCache::Invalidate(absl::string_view path) {
+  absl::MutexLock lock(&mu_);
+  ++generation_;
+  for (auto it = lru_.begin(); it != lru_.end();) {
+    if (util::IsPathWithin(it->entry->path, path)) {
+      VLOG(3) << "Invalidating " << it->target;
+      target_to_node_.erase(it->target);
+      it = lru_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void FileCache::SetTtl(absl::Duration ttl) {
+  absl::MutexLock lock(&mu_);
+  ttl_ = ttl;
+  ++generation_;
+  lru_.clear();
+  target_to_node_.clear();
+}
+
+Result<std::shared_ptr<const FileCache::Entry>> FileCache::Resolve(
+    absl::string_view target) {
+  auto entry = std::make_shared<Entry>();
+  entry->path =
+      TRY(util::CanonicalizePath(absl::StrCat(path_to_serve_, target)));
+  if (!util::IsPathWithin(entry->path, path_to_serve_)) {
+    return Err(absl::StrCat("Requested file not inside of path_to_serve: ",
+                            entry->path));
+  }
+
+  struct stat stat_buf;
+  TRY(OpenAndStat(entry.get(), &stat_buf));
+  if (S_ISDIR(stat_buf.st_mode)) {
+    entry->path += kIndexHtml;
+    TRY(OpenAndStat(entry.get(), &stat_buf));
+  }
+  // Only regular files have a size to send, e.g. not an index.html directory.
+  if (!S_ISREG(stat_buf.st_mode)) {
+    return Err(absl::StrCat("Not a regular file: ", entry->path));
+  }
+
+  entry->size = stat_buf.st_size;
+  entry->mtime = stat_buf.st_mtime;
+  entry->inode = stat_buf.st_ino;
+
+  auto modified_date = HttpResponse::FormatTime(entry->mtime);
+  if (!modified_date.ok()) {
+    VLOG(1) << "Failed to generate Last-Modified";
+  } else {
+    entry->last_modified = std::move(*modified_date);
+  }
+  entry->etag =
+      conditional_request::MakeETag(entry->inode, entry->size, entry->mtime);
+
+  if (find_sidecars_) {
+    for (auto encoding : content_encoding::kSidecarEncodings) {
+      FindSidecar(entry.get(), encoding, path_to_serve_);
+    }
+  }
+
+  return std::shared_ptr<const Entry>(std::move(entry));
+}
@@ -0,0 +1,96 @@
+#ifndef MAIN_FILE_CACHE_H_
+#define MAIN_FILE_CACHE_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "base/err.h"
+#include "base/scoped-fd.h"
+#include "main/content-encoding.h"
+
+// Caches what serving a request target needs from the file system: the
+// canonical path (with index.html resolved), an open descriptor and the stat
+// results. Lets hot files be served without any metadata syscalls.
+class FileCache {
+ public:
+  struct Entry {
+    std::string path;
+    ScopedFd fd;
+    size_t size = 0;
+    time_t mtime = 0;
+    ino_t inode = 0;
+
+    // Preformatted Last-Modified and ETag header values.
+    std::string last_modified;
+    std::string etag;
+
+    // A precompressed sibling of the file, e.g. "foo.js.gz" for "foo.js".
+    struct Sidecar {
+      content_encoding::Encoding encoding;
+      ScopedFd fd;
+      size_t size = 0;
+      std::string etag;
+    };
+    // Ordered like |content_encoding::kSidecarEncodings|.
+    std::vector<Sidecar> sidecars;
+
+    // Returns nullptr if there is no sidecar with |encoding|.
+    const Sidecar* FindSidecar(content_encoding::Encoding encoding) const;
+  };
+
+  // Entries are dropped after |ttl| so changes on disk are picked up. Pass
+  // absl::InfiniteDuration() if changes are reported through |Invalidate|.
+  // If |find_sidecars| is set, sidecars which are at least as new as their
+  // file are opened along with it.
+  FileCache(std::string path_to_serve, size_t max_entries, absl::Duration ttl,
+            bool find_sidecars = false);
+  FileCache(const FileCache&) = delete;
+  FileCache& operator=(const FileCache&) = delete;
+
+  // Resolves |target| relative to the served path. Thread safe. The descriptor
+  // is shared, so only use it with positional I/O (pread, sendfile).
+  Result<std::shared_ptr<const Entry>> Lookup(absl::string_view target);
+
+  // Drops the entries of |path| and of everything inside of it. Thread safe.
+  void Invalidate(absl::string_view path);
+
+  // Drops all entries and caches new ones for |ttl|. For when changes stop
+  // being reported through |Invalidate|. Thread safe.
+  void SetTtl(absl::Duration ttl);
+
+ private:
+  struct Node {
+    std::string target;
+    std::shared_ptr<const Entry> entry;
+    absl::Time expiry;
+  };
+  using Lru = std::list<Node>;
+
+  Result<std::shared_ptr<const Entry>> Resolve(absl::string_view target);
+
+  const std::string path_to_serve_;
+  const size_t max_entries_;
+  const bool find_sidecars_;
+
+  absl::Mutex mu_;
+
+  absl::Duration ttl_ GUARDED_BY(mu_);
+
+  // Most recently used first.
+  Lru lru_ GUARDED_BY(mu_);
+  absl::flat_hash_map<std::string, Lru::iterator> target_to_node_
+      GUARDED_BY(mu_);
+  // Incremented by |Invalidate|, so entries resolved before don't get cached.
+  uint64_t generation_ GUARDED_BY(mu_) = 0;
+};
+
+#endif  // MAIN_FILE_CACHE_H_
@@ -0,0 +1,207 @@
+#include "main/file-cache.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+
+#include "absl/time/time.h"
+#include "base/util.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class FileCacheTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    std::string tmpl = testing::TempDir() + "/file-cache_testXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(&tmpl[0]));
+    auto dir_or = util::CanonicalizePath(tmpl);
+    ASSERT_TRUE(dir_or.ok());
+    dir_ = std::move(*dir_or);
+    ASSERT_EQ(0, mkdir((dir_ + "/sub").c_str(), 0755));
+  }
+
+  void TearDown() override {
+    ASSERT_EQ(0, system(("rm -rf " + dir_).c_str()));
+  }
+
+  void WriteFile(const std::string& name, const std::string& contents) {
+    FILE* fp = fopen((dir_ + name).c_str(), "w");
+    ASSERT_NE(nullptr, fp);
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+  }
+
+  std::string dir_;
+};
+
+}  // namespace
+
+TEST_F(FileCacheTest, ResolvesFileAndIndex) {
+  WriteFile("/foo.txt", "hello");
+  WriteFile("/sub/index.html", "index");
+  FileCache cache(dir_, /*max_entries=*/10, absl::Seconds(60));
+
+  auto entry = cache.Lookup("/foo.txt");
+  ASSERT_TRUE(entry.ok());
+  EXPECT_EQ(dir_ + "/foo.txt", (*entry)->path);
+  EXPECT_EQ(5u, (*entry)->size);
+  EXPECT_TRUE((*entry)->fd);
+  EXPECT_FALSE((*entry)->last_modified.empty());
+
+  auto index = cache.Lookup("/sub/");
+  ASSERT_TRUE(index.ok());
+  EXPECT_EQ(dir_ + "/sub/index.html", (*index)->path);
+  EXPECT_EQ(5u, (*index)->size);
+}
+
+TEST_F(FileCacheTest, Errors) {
+  FileCache cache(dir_, /*max_entries=*/10, absl::Seconds(60));
+  EXPECT_FALSE(cache.Lookup("/missing").ok());
+  EXPECT_FALSE(cache.Lookup("/../../etc/passwd").ok());
+  EXPECT_FALSE(cache.Lookup("/sub").ok());  // No index.html.
+
+  // A sibling directory which shares the served path as a prefix.
+  ASSERT_EQ(0, mkdir((dir_ + "x").c_str(), 0755));
+  ASSERT_NO_FATAL_FAILURE(WriteFile("x/secret", "secret"));
+  std::string sibling = dir_.substr(dir_.rfind('/'));
+  EXPECT_FALSE(cache.Lookup("/.." + sibling + "x/secret").ok());
+  EXPECT_EQ(0, system(("rm -rf " + dir_ + "x").c_str()));
+
+  ASSERT_EQ(0, mkdir((dir_ + "/sub/index.html").c_str(), 0755));
+  EXPECT_FALSE(cache.Lookup("/sub/").ok());
+  ASSERT_EQ(0, mkfifo((dir_ + "/fifo").c_str(), 0644));
+  EXPECT_FALSE(cache.Lookup("/fifo").ok());
+}
+
+TEST_F(FileCacheTest, HitsUntilExpired) {
+  WriteFile("/foo.txt", "hello");
+  FileCache cache(dir_, /*max_entries=*/10, absl::Seconds(60));
+  auto first = cache.Lookup("/foo.txt");
+  ASSERT_TRUE(first.ok());
+
+  WriteFile("/foo.txt", "hello world");
+  auto second = cache.Lookup("/foo.txt");
+  ASSERT_TRUE(second.ok());
+  EXPECT_EQ(first->get(), second->get());
+
+  FileCache no_ttl_cache(dir_, /*max_entries=*/10, absl::ZeroDuration());
+  ASSERT_TRUE(no_ttl_cache.Lookup("/foo.txt").ok());
+  auto fresh = no_ttl_cache.Lookup("/foo.txt");
+  ASSERT_TRUE(fresh.ok());
+  EXPECT_EQ(11u, (*fresh)->size);
+}
+
+TEST_F(FileCacheTest, EvictsLeastRecentlyUsed) {
+  WriteFile("/a", "a");
+  WriteFile("/b", "b");
+  WriteFile("/c", "c");
+  FileCache cache(dir_, /*max_entries=*/2, absl::Seconds(60));
+
+  auto a = cache.Lookup("/a");
+  auto b = cache.Lookup("/b");
+  ASSERT_TRUE(a.ok() && b.ok());
+  ASSERT_TRUE(cache.Lookup("/a").ok());  // Make "/b" the oldest.
+  ASSERT_TRUE(cache.Lookup("/c").ok());
+
+  auto a_again = cache.Lookup("/a");
+  auto b_again = cache.Lookup("/b");
+  ASSERT_TRUE(a_again.ok() && b_again.ok());
+  EXPECT_EQ(a->get(), a_again->get());
+  EXPECT_NE(b->get(), b_again->get());
+}
+
+TEST_F(FileCacheTest, Invalidate) {
+  WriteFile("/a", "a");
+  WriteFile("/sub/b", "b");
+  WriteFile("/sub/index.html", "index");
+  FileCache cache(dir_, /*max_entries=*/10, absl::InfiniteDuration());
+
+  auto a = cache.Lookup("/a");
+  auto b = cache.Lookup("/sub/b");
+  auto index = cache.Lookup("/sub/");
+  ASSERT_TRUE(a.ok() && b.ok() && index.ok());
+
+  // Everything inside the directory is dropped.
+  cache.Invalidate(dir_ + "/sub");
+  auto a_again = cache.Lookup("/a");
+  auto b_again = cache.Lookup("/sub/b");
+  auto index_again = cache.Lookup("/sub/");
+  ASSERT_TRUE(a_again.ok() && b_again.ok() && index_again.ok());
+  EXPECT_EQ(a->get(), a_again->get());
+  EXPECT_NE(b->get(), b_again->get());
+  EXPECT_NE(index->get(), index_again->get());
+
+  cache.Invalidate(dir_ + "/a");
+  EXPECT_NE(a->get(), cache.Lookup("/a")->get());
+}
+
+TEST_F(FileCacheTest, SetTtl) {
+  WriteFile("/a", "a");
+  FileCache cache(dir_, /*max_entries=*/10, absl::InfiniteDuration());
+  auto a = cache.Lookup("/a");
+  ASSERT_TRUE(a.ok());
+
+  // Entries cached until then are dropped too.
+  cache.SetTtl(absl::ZeroDuration());
+  auto a_again = cache.Lookup("/a");
+  ASSERT_TRUE(a_again.ok());
+  EXPECT_NE(a->get(), a_again->get());
+  EXPECT_NE(a_again->get(), cache.Lookup("/a")->get());
+}
+
+TEST_F(FileCacheTest, FindsSidecars) {
+  WriteFile("/foo.js", "hello hello hello");
+  WriteFile("/foo.js.gz", "gzip");
+  WriteFile("/foo.js.br", "br");
+  // A sidecar older than its file is stale.
+  struct timeval times[2] = {{1, 0}, {1, 0}};
+  ASSERT_EQ(0, utimes((dir_ + "/foo.js.br").c_str(), times));
+  // Not a regular file, and opening it mustn't wait for a writer.
+  ASSERT_EQ(0, mkfifo((dir_ + "/foo.js.zst").c_str(), 0644));
+
+  FileCache cache(dir_, /*max_entries=*/10, absl::Seconds(60),
+                  /*find_sidecars=*/true);
+  auto entry = cache.Lookup("/foo.js");
+  ASSERT_TRUE(entry.ok());
+  ASSERT_EQ(1u, (*entry)->sidecars.size());
+  EXPECT_EQ(nullptr,
+            (*entry)->FindSidecar(content_encoding::Encoding::kBrotli));
+  auto* gzip = (*entry)->FindSidecar(content_encoding::Encoding::kGzip);
+  ASSERT_NE(nullptr, gzip);
+  EXPECT_EQ(4u, gzip->size);
+  EXPECT_TRUE(gzip->fd);
+  EXPECT_NE((*entry)->etag, gzip->etag);
+
+  FileCache no_sidecars_cache(dir_, /*max_entries=*/10, absl::Seconds(60));
+  entry = no_sidecars_cache.Lookup("/foo.js");
+  ASSERT_TRUE(entry.ok());
+  EXPECT_TRUE((*entry)->sidecars.empty());
+}
+
+TEST_F(FileCacheTest, SidecarsStayInsidePathToServe) {
+  WriteFile("/sub/foo.js", "hello hello hello");
+  WriteFile("/sub/bar.js", "hello hello hello");
+  WriteFile("/sub/bar.js.br", "br");
+  // A sibling directory which shares the prefix of |dir_|.
+  ASSERT_EQ(0, mkdir((dir_ + "x").c_str(), 0755));
+  ASSERT_NO_FATAL_FAILURE(WriteFile("x/secret", "secret"));
+  ASSERT_EQ(0, symlink((dir_ + "x/secret").c_str(),
+                       (dir_ + "/sub/foo.js.gz").c_str()));
+  // Links which stay inside are followed, like for the file itself.
+  ASSERT_EQ(0, symlink("bar.js.br", (dir_ + "/sub/foo.js.br").c_str()));
+
+  FileCache cache(dir_ + "/sub", /*max_entries=*/10, absl::Seconds(60),
+                  /*find_sidecars=*/true);
+  auto entry = cache.Lookup("/foo.js");
+  EXPECT_EQ(0, system(("rm -rf " + dir_ + "x").c_str()));
+  ASSERT_TRUE(entry.ok());
+  EXPECT_EQ(nullptr, (*entry)->FindSidecar(content_encoding::Encoding::kGzip));
+  auto* brotli = (*entry)->FindSidecar(content_encoding::Encoding::kBrotli);
+  ASSERT_NE(nullptr, brotli);
+  EXPECT_EQ(2u, brotli->size);
+}
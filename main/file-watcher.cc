@@ -0,0 +1,155 @@
+#include "main/file-watcher.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "base/util.h"
+
+namespace {
+
+constexpr uint32_t kWatchMask =
+    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+}  // namespace
+
+// static
+Result<std::unique_ptr<FileWatcher>> FileWatcher::Create(std::string root) {
+  ScopedFd inotify_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+  if (*inotify_fd < 0) {
+    return BuildPosixErr("inotify_init1 failed");
+  }
+
+  auto ret =
+      absl::WrapUnique(new FileWatcher(std::move(root), std::move(inotify_fd)));
+  TRY(ret->AddWatches(ret->root_));
+  return ret;
+}
+
+FileWatcher::FileWatcher(std::string root, ScopedFd inotify_fd)
+    : root_(std::move(root)), inotify_fd_(std::move(inotify_fd)) {}
+
+Result<void> FileWatcher::ReadEvents(const ChangeCallback& on_change) {
+  // A burst of events, e.g. from a deploy, often names the same path many
+  // times.
+  absl::flat_hash_set<std::string> changed;
+
+  alignas(inotify_event) char buf[16 * 1024];
+  while (true) {
+    ssize_t num_read = read(*inotify_fd_, buf, sizeof(buf));
+    if (num_read < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return BuildPosixErr("Read inotify_fd failed");
+    }
+
+    for (ssize_t offset = 0; offset < num_read;) {
+      const auto* event = reinterpret_cast<const inotify_event*>(buf + offset);
+      offset += sizeof(inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        LOG(WARN) << "inotify queue overflowed";
+        changed.insert(root_);
+        continue;
+      }
+
+      auto it = wd_to_path_.find(event->wd);
+      if (it == wd_to_path_.end()) {
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        wd_to_path_.erase(it);
+        continue;
+      }
+
+      std::string path = event->len > 0
+                             ? absl::StrCat(it->second, "/", event->name)
+                             : it->second;
+      if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          auto result = AddWatches(path);
+          if (!result.ok()) {
+            LOG(WARN) << result.err();
+            complete_ = false;
+          }
+        } else if (event->mask & IN_MOVED_FROM) {
+          RemoveWatches(path);
+        }
+      }
+      changed.insert(std::move(path));
+    }
+  }
+
+  for (const auto& path : changed) {
+    VLOG(2) << "Changed: " << path;
+    on_change(path);
+  }
+  return {};
+}
+
+Result<void> FileWatcher::AddWatches(const std::string& dir) {
+  int wd = inotify_add_watch(*inotify_fd_, dir.c_str(), kWatchMask);
+  if (wd < 0) {
+    // It may have been removed already.
+    if (errno == ENOENT || errno == ENOTDIR) {
+      return {};
+    }
+    return BuildPosixErr(absl::StrCat("inotify_add_watch failed on ", dir));
+  }
+  wd_to_path_[wd] = dir;
+
+  DIR* dir_stream = opendir(dir.c_str());
+  if (dir_stream == nullptr) {
+    return {};
+  }
+  std::vector<std::string> sub_dirs;
+  while (const dirent* entry = readdir(dir_stream)) {
+    absl::string_view name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    bool is_dir = entry->d_type == DT_DIR;
+    // Some file systems don't report the type.
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat stat_buf;
+      is_dir = fstatat(dirfd(dir_stream), entry->d_name, &stat_buf,
+                       AT_SYMLINK_NOFOLLOW) == 0 &&
+               S_ISDIR(stat_buf.st_mode);
+    }
+    if (is_dir) {
+      sub_dirs.push_back(absl::StrCat(dir, "/", name));
+    }
+  }
+  closedir(dir_stream);
+
+  for (const auto& sub_dir : sub_dirs) {
+    TRY(AddWatches(sub_dir));
+  }
+  return {};
+}
+
+void FileWatcher::RemoveWatches(absl::string_view dir) {
+  // The IN_IGNORED events that follow find nothing to erase.
+  for (auto it = wd_to_path_.begin(); it != wd_to_path_.end();) {
+    if (util::IsPathWithin(it->second, dir)) {
+      inotify_rm_watch(*inotify_fd_, it->first);
+      wd_to_path_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef MAIN_FILE_WATCHER_H_
+#define MAIN_FILE_WATCHER_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "base/err.h"
+#include "base/scoped-fd.h"
+
+// Watches a directory tree with inotify and reports which paths changed.
+// Directories created later are watched as well. Not thread safe.
+class FileWatcher {
+ public:
+  // |root| must be canonical.
+  static Result<std::unique_ptr<FileWatcher>> Create(std::string root);
+
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+
+  // Becomes readable when there are events. For epoll.
+  int fd() const { return *inotify_fd_; }
+
+  using ChangeCallback = std::function<void(absl::string_view path)>;
+
+  // Reads the pending events without blocking and calls |on_change| once for
+  // every path that was modified, created, moved or deleted. If |path| is a
+  // directory, anything inside of it may have changed.
+  Result<void> ReadEvents(const ChangeCallback& on_change);
+
+  // False once a new directory couldn't be watched, e.g. because the
+  // inotify watch limit was reached. Changes inside of it go unreported.
+  bool complete() const { return complete_; }
+
+ private:
+  FileWatcher(std::string root, ScopedFd inotify_fd);
+
+  // Watches |dir| and the directories inside of it.
+  Result<void> AddWatches(const std::string& dir);
+  // Stops watching |dir| and the directories inside of it.
+  void RemoveWatches(absl::string_view dir);
+
+  const std::string root_;
+  const ScopedFd inotify_fd_;
+  absl::flat_hash_map<int, std::string> wd_to_path_;
+  bool complete_ = true;
+};
+
+#endif  // MAIN_FILE_WATCHER_H_
@@ -0,0 +1,92 @@
+#include "main/file-watcher.h"
+
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "base/util.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class FileWatcherTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    std::string tmpl = testing::TempDir() + "/file-watcher_testXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(&tmpl[0]));
+    auto dir_or = util::CanonicalizePath(tmpl);
+    ASSERT_TRUE(dir_or.ok());
+    dir_ = std::move(*dir_or);
+    ASSERT_EQ(0, mkdir((dir_ + "/sub").c_str(), 0755));
+    WriteFile("/sub/a.txt", "a");
+
+    auto watcher_or = FileWatcher::Create(dir_);
+    ASSERT_TRUE(watcher_or.ok());
+    watcher_ = std::move(*watcher_or);
+  }
+
+  void TearDown() override {
+    ASSERT_EQ(0, system(("rm -rf " + dir_).c_str()));
+  }
+
+  void WriteFile(const std::string& name, const std::string& contents) {
+    FILE* fp = fopen((dir_ + name).c_str(), "w");
+    ASSERT_NE(nullptr, fp);
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+  }
+
+  // Returns the changed paths relative to |dir_|, in no particular order.
+  std::vector<std::string> ReadChanges() {
+    std::vector<std::string> changes;
+    pollfd poll_fd = {watcher_->fd(), POLLIN, 0};
+    while (poll(&poll_fd, 1, /*timeout=*/100) > 0) {
+      auto result = watcher_->ReadEvents([&](absl::string_view path) {
+        changes.emplace_back(path.substr(dir_.size()));
+      });
+      EXPECT_TRUE(result.ok());
+    }
+    std::sort(changes.begin(), changes.end());
+    return changes;
+  }
+
+  std::string dir_;
+  std::unique_ptr<FileWatcher> watcher_;
+};
+
+using Changes = std::vector<std::string>;
+
+}  // namespace
+
+TEST_F(FileWatcherTest, ReportsChanges) {
+  WriteFile("/sub/a.txt", "changed");
+  WriteFile("/b.txt", "b");
+  EXPECT_EQ((Changes{"/b.txt", "/sub/a.txt"}), ReadChanges());
+
+  ASSERT_EQ(0, rename((dir_ + "/b.txt").c_str(), (dir_ + "/c.txt").c_str()));
+  EXPECT_EQ((Changes{"/b.txt", "/c.txt"}), ReadChanges());
+
+  ASSERT_EQ(0, unlink((dir_ + "/c.txt").c_str()));
+  EXPECT_EQ((Changes{"/c.txt"}), ReadChanges());
+  EXPECT_EQ(Changes{}, ReadChanges());
+}
+
+TEST_F(FileWatcherTest, WatchesNewDirectories) {
+  ASSERT_EQ(0, mkdir((dir_ + "/new").c_str(), 0755));
+  EXPECT_EQ((Changes{"/new"}), ReadChanges());
+
+  WriteFile("/new/d.txt", "d");
+  EXPECT_EQ((Changes{"/new/d.txt"}), ReadChanges());
+
+  // A moved directory is reported and watched under its new name.
+  ASSERT_EQ(0, rename((dir_ + "/sub").c_str(), (dir_ + "/moved").c_str()));
+  EXPECT_EQ((Changes{"/moved", "/sub"}), ReadChanges());
+  WriteFile("/moved/a.txt", "moved");
+  EXPECT_EQ((Changes{"/moved/a.txt"}), ReadChanges());
+}
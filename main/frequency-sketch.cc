@@ -0,0 +1,105 @@
+#include "main/frequency-sketch.h"
+
+#include <algorithm>
+
+namespace {
+
+constexpr size_t kMinWidth = 64;
+constexpr size_t kDoorkeeperBitsPerKey = 4;
+
+// Odd multipliers which give each row and the doorkeeper their own hash.
+constexpr uint64_t kSeeds[] = {
+    0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull,
+    0xd6e8feb86659fd93ull, 0xff51afd7ed558ccdull, 0xc4ceb9fe1a85ec53ull,
+};
+
+// Mixes all bits of |hash| into the low ones, which index the tables.
+uint64_t Rehash(uint64_t hash, int seed) {
+  hash ^= hash >> 33;
+  hash *= kSeeds[seed];
+  return hash ^ (hash >> 29);
+}
+
+size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t result = 1;
+  while (result < n) {
+    result <<= 1;
+  }
+  return result;
+}
+
+}  // namespace
+
+FrequencySketch::FrequencySketch(size_t expected_keys)
+    : width_(RoundUpToPowerOfTwo(std::max(expected_keys, kMinWidth))),
+      counters_(kDepth * width_),
+      doorkeeper_(kDoorkeeperBitsPerKey * width_ / 64),
+      sample_size_(10 * width_) {}
+
+void FrequencySketch::Increment(uint64_t hash) {
+  if (++num_increments_ == sample_size_) {
+    Age();
+  }
+
+  if (!DoorkeeperContains(hash)) {
+    DoorkeeperAdd(hash);
+    return;
+  }
+
+  // Conservative update: only the smallest counters grow, which keeps the
+  // overestimate of other keys sharing them down.
+  int min = kMaxFrequency;
+  for (int row = 0; row < kDepth; ++row) {
+    min = std::min<int>(min, counters_[CounterIndex(hash, row)]);
+  }
+  if (min == kMaxFrequency) {
+    return;
+  }
+  for (int row = 0; row < kDepth; ++row) {
+    uint8_t& counter = counters_[CounterIndex(hash, row)];
+    if (counter == min) {
+      ++counter;
+    }
+  }
+}
+
+int FrequencySketch::Frequency(uint64_t hash) const {
+  if (!DoorkeeperContains(hash)) {
+    return 0;
+  }
+
+  int min = kMaxFrequency;
+  for (int row = 0; row < kDepth; ++row) {
+    min = std::min<int>(min, counters_[CounterIndex(hash, row)]);
+  }
+  return min + 1;
+}
+
+size_t FrequencySketch::CounterIndex(uint64_t hash, int row) const {
+  return row * width_ + (Rehash(hash, row) & (width_ - 1));
+}
+
+bool FrequencySketch::DoorkeeperContains(uint64_t hash) const {
+  for (int seed = kDepth; seed < kDepth + 2; ++seed) {
+    uint64_t bit = Rehash(hash, seed) & (doorkeeper_.size() * 64 - 1);
+    if (!(doorkeeper_[bit / 64] & (1ull << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void FrequencySketch::DoorkeeperAdd(uint64_t hash) {
+  for (int seed = kDepth; seed < kDepth + 2; ++seed) {
+    uint64_t bit = Rehash(hash, seed) & (doorkeeper_.size() * 64 - 1);
+    doorkeeper_[bit / 64] |= 1ull << (bit % 64);
+  }
+}
+
+void FrequencySketch::Age() {
+  for (uint8_t& counter : counters_) {
+    counter /= 2;
+  }
+  std::fill(doorkeeper_.begin(), doorkeeper_.end(), 0);
+  num_increments_ = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef MAIN_FREQUENCY_SKETCH_H_
+#define MAIN_FREQUENCY_SKETCH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Estimates how often keys were seen recently, for cache admission. This is
+// TinyLFU (Einziger et al.): a count-min sketch of small saturating counters
+// in front of which a doorkeeper bloom filter absorbs the first occurrence of
+// each key, so one-hit wonders don't pollute the counters. All counts are
+// halved periodically so old popularity fades. Not thread safe.
+class FrequencySketch {
+ public:
+  // Counters saturate at this value.
+  static constexpr int kMaxFrequency = 15;
+
+  // Sized to track about |expected_keys| distinct keys.
+  explicit FrequencySketch(size_t expected_keys);
+  FrequencySketch(const FrequencySketch&) = delete;
+  FrequencySketch& operator=(const FrequencySketch&) = delete;
+
+  // Records an occurrence of the key with |hash|.
+  void Increment(uint64_t hash);
+
+  // Returns the estimated number of recent occurrences of the key with
+  // |hash|, at most |kMaxFrequency| + 1. Never underestimates, except for
+  // the aging.
+  int Frequency(uint64_t hash) const;
+
+ private:
+  static constexpr int kDepth = 4;
+
+  size_t CounterIndex(uint64_t hash, int row) const;
+  bool DoorkeeperContains(uint64_t hash) const;
+  void DoorkeeperAdd(uint64_t hash);
+  // Halves all counters and clears the doorkeeper.
+  void Age();
+
+  // |kDepth| rows of |width_| counters.
+  const size_t width_;
+  std::vector<uint8_t> counters_;
+  std::vector<uint64_t> doorkeeper_;
+
+  // Counts are aged after |sample_size_| increments.
+  const size_t sample_size_;
+  size_t num_increments_ = 0;
+};
+
+#endif  // MAIN_FREQUENCY_SKETCH_H_
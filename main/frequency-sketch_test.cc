@@ -0,0 +1,59 @@
+#include "main/frequency-sketch.h"
+
+#include "gtest/gtest.h"
+
+TEST(FrequencySketchTest, CountsOccurrences) {
+  FrequencySketch sketch(/*expected_keys=*/1024);
+  EXPECT_EQ(0, sketch.Frequency(1));
+
+  // The doorkeeper absorbs the first occurrence.
+  sketch.Increment(1);
+  EXPECT_EQ(1, sketch.Frequency(1));
+  EXPECT_EQ(0, sketch.Frequency(2));
+
+  for (int i = 0; i < 4; ++i) {
+    sketch.Increment(1);
+  }
+  EXPECT_EQ(5, sketch.Frequency(1));
+
+  for (int i = 0; i < 100; ++i) {
+    sketch.Increment(1);
+  }
+  EXPECT_EQ(FrequencySketch::kMaxFrequency + 1, sketch.Frequency(1));
+}
+
+TEST(FrequencySketchTest, DistinguishesKeys) {
+  FrequencySketch sketch(/*expected_keys=*/1024);
+  for (uint64_t key = 0; key < 500; ++key) {
+    sketch.Increment(key * 0x1234567);
+  }
+  for (int i = 0; i < 5; ++i) {
+    sketch.Increment(42);
+  }
+
+  EXPECT_EQ(5, sketch.Frequency(42));
+  int overestimated = 0;
+  for (uint64_t key = 0; key < 500; ++key) {
+    if (sketch.Frequency(key * 0x1234567) > 1) {
+      ++overestimated;
+    }
+  }
+  EXPECT_LT(overestimated, 25);
+}
+
+TEST(FrequencySketchTest, Ages) {
+  FrequencySketch sketch(/*expected_keys=*/64);
+  for (int i = 0; i < 9; ++i) {
+    sketch.Increment(7);
+  }
+  EXPECT_EQ(9, sketch.Frequency(7));
+
+  // Enough other increments to trigger aging, which halves the counter and
+  // clears the doorkeeper.
+  for (int i = 0; i < 10 * 64; ++i) {
+    sketch.Increment(100);
+  }
+  EXPECT_EQ(0, sketch.Frequency(7));
+  sketch.Increment(7);
+  EXPECT_EQ(5, sketch.Frequency(7));
+}
@@ -0,0 +1,50 @@
+#include "main/hot-set.h"
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+
+namespace hot_set {
+
+std::string Format(const std::vector<HotFile>& files) {
+  std::string ret;
+  for (const HotFile& file : files) {
+    absl::string_view encoding = content_encoding::Name(file.encoding);
+    if (encoding.empty() || file.path.find('\n') != std::string::npos) {
+      continue;
+    }
+    absl::StrAppend(&ret, file.frequency, " ", encoding, " ", file.path, "\n");
+  }
+  return ret;
+}
+
+std::vector<HotFile> Parse(absl::string_view data) {
+  std::vector<HotFile> ret;
+  for (absl::string_view line : absl::StrSplit(data, '\n')) {
+    // The path may contain spaces.
+    std::vector<absl::string_view> fields =
+        absl::StrSplit(line, absl::MaxSplits(' ', 2));
+    HotFile file;
+    if (fields.size() != 3 || fields[2].empty() ||
+        !absl::SimpleAtoi(fields[0], &file.frequency) || file.frequency < 0) {
+      continue;
+    }
+
+    bool known_encoding = false;
+    for (auto encoding : content_encoding::kSidecarEncodings) {
+      if (fields[1] == content_encoding::Name(encoding)) {
+        file.encoding = encoding;
+        known_encoding = true;
+      }
+    }
+    if (!known_encoding) {
+      continue;
+    }
+
+    file.path = std::string(fields[2]);
+    ret.push_back(std::move(file));
+  }
+  return ret;
+}
+
+}  // namespace hot_set
@@ -0,0 +1,32 @@
+#ifndef MAIN_HOT_SET_H_
+#define MAIN_HOT_SET_H_
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "main/content-encoding.h"
+
+// The files a server was busy with, recorded so the next run can warm up its
+// caches with them.
+namespace hot_set {
+
+struct HotFile {
+  std::string path;
+  content_encoding::Encoding encoding;
+  // How often the file was requested lately, as estimated by a
+  // FrequencySketch.
+  int frequency;
+};
+
+// One line per file: "<frequency> <encoding> <path>". Files with a newline in
+// their path, or with the identity encoding, are skipped.
+std::string Format(const std::vector<HotFile>& files);
+
+// Parses what |Format| returned, in the same order. Malformed lines are
+// skipped.
+std::vector<HotFile> Parse(absl::string_view data);
+
+}  // namespace hot_set
+
+#endif  // MAIN_HOT_SET_H_
@@ -0,0 +1,39 @@
+#include "main/hot-set.h"
+
+#include "gtest/gtest.h"
+
+using content_encoding::Encoding;
+
+TEST(HotSetTest, FormatAndParse) {
+  std::vector<hot_set::HotFile> files = {
+      {"/index.html", Encoding::kGzip, 15},
+      {"/with space.js", Encoding::kBrotli, 3},
+      {"/skipped\n.js", Encoding::kGzip, 9},
+      {"/skipped.js", Encoding::kIdentity, 9},
+  };
+
+  std::string data = hot_set::Format(files);
+  EXPECT_EQ("15 gzip /index.html\n3 br /with space.js\n", data);
+
+  auto parsed = hot_set::Parse(data);
+  ASSERT_EQ(2u, parsed.size());
+  EXPECT_EQ("/index.html", parsed[0].path);
+  EXPECT_EQ(Encoding::kGzip, parsed[0].encoding);
+  EXPECT_EQ(15, parsed[0].frequency);
+  EXPECT_EQ("/with space.js", parsed[1].path);
+  EXPECT_EQ(Encoding::kBrotli, parsed[1].encoding);
+  EXPECT_EQ(3, parsed[1].frequency);
+}
+
+TEST(HotSetTest, SkipsMalformedLines) {
+  auto parsed = hot_set::Parse(
+      "x gzip /a.js\n"
+      "-1 gzip /b.js\n"
+      "2 deflate /c.js\n"
+      "2 gzip\n"
+      "2 gzip \n"
+      "\n"
+      "2 gzip /d.js");
+  ASSERT_EQ(1u, parsed.size());
+  EXPECT_EQ("/d.js", parsed[0].path);
+}
@@ -2,6 +2,8 @@
 #include <vector>
 
 #include "absl/base/macros.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "base/logging.h"
 #include "main/http-request.h"
 
@@ -14,6 +16,22 @@ static_assert(ABSL_ARRAYSIZE(kMethodStrs) ==
                   static_cast<size_t>(HttpRequest::Method::kInvalid) + 1,
               "");
 
+const char* kHeaderStrs[] = {
+    "Host",
+    "Connection",
+    "Accept-Encoding",
+    "Range",
+    "If-Range",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Content-Length",
+    "Transfer-Encoding",
+    "UNKNOWN",
+};
+static_assert(ABSL_ARRAYSIZE(kHeaderStrs) ==
+                  static_cast<size_t>(HttpRequest::Header::kUnknown) + 1,
+              "");
+
 }  // namespace
 
 // static
@@ -27,6 +45,42 @@ HttpRequest::Method HttpRequest::ParseMethod(absl::string_view text) {
   return HttpRequest::Method::kInvalid;
 }
 
+// static
+HttpRequest::Header HttpRequest::ParseHeader(absl::string_view name) {
+  constexpr size_t kNumHeaders = static_cast<size_t>(Header::kUnknown);
+  for (size_t i = 0; i < kNumHeaders; ++i) {
+    // Compare lengths first, most fields are rejected there.
+    if (strlen(kHeaderStrs[i]) == name.size() &&
+        absl::EqualsIgnoreCase(kHeaderStrs[i], name)) {
+      return static_cast<Header>(i);
+    }
+  }
+
+  return Header::kUnknown;
+}
+
+bool HttpRequest::HasBody() const {
+  if (!header(Header::kTransferEncoding).empty()) {
+    return true;
+  }
+  absl::string_view content_length = header(Header::kContentLength);
+  return !content_length.empty() && content_length != "0";
+}
+
+void HttpRequest::AddHeader(Header header, absl::string_view value) {
+  auto& existing = header_values_[static_cast<size_t>(header)];
+  if (existing.empty()) {
+    existing = value;
+    return;
+  }
+
+  // RFC2616 - Multiple message-header fields with the same field-name MAY be
+  // present in a message if and only if the entire field-value for that
+  // header field is defined as a comma-separated list.
+  combined_values_.push_back(absl::StrCat(existing, ", ", value));
+  existing = combined_values_.back();
+}
+
 std::ostream& operator<<(std::ostream& os, HttpRequest::Method method) {
   auto as_int = static_cast<size_t>(method);
   if (as_int >= ABSL_ARRAYSIZE(kMethodStrs)) {
@@ -38,12 +92,26 @@ std::ostream& operator<<(std::ostream& os, HttpRequest::Method method) {
   return os << kMethodStrs[as_int];
 }
 
+std::ostream& operator<<(std::ostream& os, HttpRequest::Header header) {
+  auto as_int = static_cast<size_t>(header);
+  if (as_int >= ABSL_ARRAYSIZE(kHeaderStrs)) {
+    LOG(ERR) << "Invalid header: " << as_int;
+    ABSL_ASSERT(false);
+    return os;
+  }
+
+  return os << kHeaderStrs[as_int];
+}
+
 std::ostream& operator<<(std::ostream& os, const HttpRequest& request) {
   os << request.method << " " << request.target << " " << request.version
      << "\n";
 
-  for (const auto& item : request.header_to_value_) {
-    os << item.first << ":" << item.second << "\n";
+  for (size_t i = 0; i < request.header_values_.size(); ++i) {
+    if (!request.header_values_[i].empty()) {
+      os << static_cast<HttpRequest::Header>(i) << ":"
+         << request.header_values_[i] << "\n";
+    }
   }
 
   return os;
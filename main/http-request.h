@@ -1,12 +1,15 @@
 #ifndef MAIN_HTTP_REQUEST_H_
 #define MAIN_HTTP_REQUEST_H_
 
+#include <array>
 #include <iostream>
-#include <map>
+#include <list>
 #include <string>
 
 #include "absl/strings/string_view.h"
 
+// A parsed request. Views point into the buffer the request was parsed from,
+// see |RequestParser|.
 struct HttpRequest {
   enum class Method {
     kGet,
@@ -14,16 +17,60 @@ struct HttpRequest {
     kInvalid,  // Must be last.
   };
 
+  // Header fields the server acts on. Other fields are validated by the parser
+  // but not stored.
+  enum class Header {
+    kHost,
+    kConnection,
+    kAcceptEncoding,
+    kRange,
+    kIfRange,
+    kIfNoneMatch,
+    kIfModifiedSince,
+    kContentLength,
+    kTransferEncoding,
+
+    kUnknown,  // Must be last.
+  };
+
   // Returns kInvalid if |text| is not a valid method.
   static Method ParseMethod(absl::string_view text);
 
+  // Returns kUnknown if |name| is not a well-known field name. Field names are
+  // case-insensitive.
+  static Header ParseHeader(absl::string_view name);
+
+  HttpRequest() = default;
+  // Not copyable since |header_values_| may point into |combined_values_|.
+  HttpRequest(const HttpRequest&) = delete;
+  HttpRequest& operator=(const HttpRequest&) = delete;
+  HttpRequest(HttpRequest&&) = default;
+  HttpRequest& operator=(HttpRequest&&) = default;
+
+  // Returns an empty view if the field is missing.
+  absl::string_view header(Header header) const {
+    return header_values_[static_cast<size_t>(header)];
+  }
+
+  // Returns true if a body follows the head. rfc7230 - 3.3.3
+  bool HasBody() const;
+
+  // Sets |header| to |value|. |value| must outlive the request. A repeated
+  // field is combined into a comma separated list. rfc7230 - 3.2.2
+  void AddHeader(Header header, absl::string_view value);
+
   Method method = Method::kInvalid;
-  std::string target;
-  std::string version;
-  std::map<std::string, std::string> header_to_value_;
+  absl::string_view target;
+  absl::string_view version;
+  std::array<absl::string_view, static_cast<size_t>(Header::kUnknown)>
+      header_values_;
+
+  // Owns combined values of repeated fields. Empty on the common path.
+  std::list<std::string> combined_values_;
 };
 
 std::ostream& operator<<(std::ostream& os, HttpRequest::Method method);
+std::ostream& operator<<(std::ostream& os, HttpRequest::Header header);
 std::ostream& operator<<(std::ostream& os, const HttpRequest& request);
 
 #endif  // MAIN_HTTP_REQUEST_H_
@@ -1,16 +1,51 @@
 #include "main/http-response.h"
 
+#include <errno.h>
+#include <string.h>
+
 #include <ctime>
 #include <utility>
 
 #include "absl/base/macros.h"
+#include "absl/strings/str_cat.h"
 #include "base/logging.h"
 
 namespace {
 
-constexpr char kVersion[] = "HTTP/1.1";
 constexpr char kNewline[] = "\r\n";
-constexpr char kServerName[] = "thttpd";
+
+// Sent with every response.
+constexpr char kConstantHeaders[] =
+    "Server: thttpd\r\n"
+    "Connection: keep-alive\r\n";
+// Sent with the last response on a connection.
+constexpr char kClosingHeaders[] =
+    "Server: thttpd\r\n"
+    "Connection: close\r\n";
+
+// Pre-rendered status lines. rfc7230 - 3.1.2
+absl::string_view StatusLine(HttpResponse::Code code) {
+  using Code = HttpResponse::Code;
+  switch (code) {
+    case Code::kOk:
+      return "HTTP/1.1 200 OK\r\n";
+    case Code::kPartialContent:
+      return "HTTP/1.1 206 Partial Content\r\n";
+    case Code::kNotModified:
+      return "HTTP/1.1 304 Not Modified\r\n";
+    case Code::kBadRequest:
+      return "HTTP/1.1 400 Bad Request\r\n";
+    case Code::kNotFound:
+      return "HTTP/1.1 404 Not Found\r\n";
+    case Code::kRangeNotSatisfiable:
+      return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+    case Code::kInternalServerError:
+      return "HTTP/1.1 500 Internal Server Error\r\n";
+  }
+
+  ABSL_ASSERT(false);
+  return "";
+}
 
 }  // namespace
 
@@ -20,10 +55,16 @@ const char* HttpResponse::CodeToString(Code code) {
   switch (code) {
     case Code::kOk:
       return "OK";
+    case Code::kPartialContent:
+      return "Partial Content";
+    case Code::kNotModified:
+      return "Not Modified";
     case Code::kBadRequest:
       return "Bad Request";
     case Code::kNotFound:
       return "Not Found";
+    case Code::kRangeNotSatisfiable:
+      return "Range Not Satisfiable";
     case Code::kInternalServerError:
       return "Internal Server Error";
   }
@@ -33,32 +74,67 @@ const char* HttpResponse::CodeToString(Code code) {
 }
 
 // static
-HttpResponse HttpResponse::BuildWithDefaultHeaders(
-    Code code, const std::map<std::string, std::string>& additional_headers) {
-  HttpResponse result;
-  result.code = code;
+void HttpResponse::AppendStatusLine(Code code, std::string* out,
+                                    bool keep_alive) {
+  absl::string_view constant_headers =
+      keep_alive ? kConstantHeaders : kClosingHeaders;
+  absl::string_view date = CurrentDate();
+  if (date.empty()) {
+    absl::StrAppend(out, StatusLine(code), constant_headers);
+  } else {
+    absl::StrAppend(out, StatusLine(code), "Date: ", date, kNewline,
+                    constant_headers);
+  }
+}
+
+// static
+void HttpResponse::AppendHeader(absl::string_view name,
+                                const absl::AlphaNum& value,
+                                std::string* out) {
+  absl::StrAppend(out, name, ": ", value, kNewline);
+}
+
+// static
+void HttpResponse::AppendEnd(std::string* out) { out->append(kNewline); }
+
+// static
+void HttpResponse::AppendChunkHeader(size_t size, std::string* out) {
+  absl::StrAppend(out, absl::Hex(size), kNewline);
+}
+
+// static
+void HttpResponse::AppendChunkEnd(std::string* out) { out->append(kNewline); }
+
+// static
+void HttpResponse::AppendLastChunk(std::string* out) {
+  absl::StrAppend(out, "0", kNewline, kNewline);
+}
+
+// static
+absl::string_view HttpResponse::CurrentDate() {
+  // Kept trivially destructible, so they're cheap to access.
+  thread_local time_t cached_time = -1;
+  thread_local char cached_date[64];
+  thread_local size_t cached_date_length = 0;
 
   time_t now = time(nullptr);
-  bool time_valid = now != static_cast<time_t>(-1);
-  if (!time_valid) {
+  if (now == static_cast<time_t>(-1)) {
     LOG(WARN) << "time failed: " << strerror(errno);
-  } else {
-    auto date_str = FormatTime(now);
-    if (!date_str.ok()) {
-      LOG(WARN) << "Failed to get date: " << date_str.err();
-    } else {
-      result.header_to_value_.emplace("Date", std::move(*date_str));
-    }
+    return {};
   }
 
-  result.header_to_value_.emplace("Server", kServerName);
-  result.header_to_value_.emplace("Connection", "keep-alive");
-
-  for (const auto& item : additional_headers) {
-    result.header_to_value_[item.first] = item.second;
+  if (now != cached_time) {
+    auto date = FormatTime(now);
+    if (!date.ok() || date->size() > sizeof(cached_date)) {
+      LOG(WARN) << "Failed to get date";
+      return {};
+    }
+    memcpy(cached_date, date->data(), date->size());
+    cached_date_length = date->size();
+    cached_time = now;
   }
 
-  return result;
+  return {cached_date, cached_date_length};
 }
 
 // static
@@ -77,16 +153,20 @@ Result<std::string> HttpResponse::FormatTime(time_t time_val) {
   return std::string(buf);
 }
 
-std::ostream& operator<<(std::ostream& os, HttpResponse::Code code) {
-  return os << HttpResponse::CodeToString(code);
-}
-
-std::ostream& operator<<(std::ostream& os, const HttpResponse& response) {
-  os << kVersion << " " << static_cast<int>(response.code) << " "
-     << response.code << kNewline;
-  for (const auto& item : response.header_to_value_) {
-    os << item.first << ": " << item.second << kNewline;
+// static
+Result<time_t> HttpResponse::ParseTime(absl::string_view text) {
+  // strptime requires a C string.
+  std::string text_str(text);
+  struct tm tm {};
+  const char* end =
+      strptime(text_str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == nullptr || *end != '\0') {
+    return Err(absl::StrCat("Invalid HTTP-date: ", text));
   }
 
-  return os << kNewline;
+  return timegm(&tm);
+}
+
+std::ostream& operator<<(std::ostream& os, HttpResponse::Code code) {
+  return os << HttpResponse::CodeToString(code);
 }
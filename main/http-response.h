@@ -1,32 +1,57 @@
 #ifndef _HTTP_RESPONSE_H_
 #define _HTTP_RESPONSE_H_
 
+#include <ctime>
 #include <iostream>
-#include <map>
 #include <string>
 
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "base/err.h"
 
-// Http response header.
+// Http response header serialization. Appends to a caller owned string, so a
+// per-connection buffer can be reused without allocating for each response.
 // rfc7231
 struct HttpResponse {
   enum class Code {
     kOk = 200,
+    kPartialContent = 206,
+    kNotModified = 304,
     kBadRequest = 400,
     kNotFound = 404,
+    kRangeNotSatisfiable = 416,
     kInternalServerError = 500,
   };
 
   static const char* CodeToString(Code code);
-  static HttpResponse BuildWithDefaultHeaders(
-      Code code, const std::map<std::string, std::string>& additional_headers);
+
+  // Appends the status line and the default Date, Server and Connection
+  // header fields. Unless |keep_alive|, the connection is announced to close.
+  static void AppendStatusLine(Code code, std::string* out,
+                               bool keep_alive = true);
+  static void AppendHeader(absl::string_view name,
+                           const absl::AlphaNum& value, std::string* out);
+  // Appends the empty line which ends the header.
+  static void AppendEnd(std::string* out);
+
+  // Chunked transfer coding. rfc7230 - 4.1
+  // Appends the line which starts a chunk of |size| bytes.
+  static void AppendChunkHeader(size_t size, std::string* out);
+  // Appends the line break which follows the data of a chunk.
+  static void AppendChunkEnd(std::string* out);
+  // Appends the last chunk and an empty trailer, which end the body.
+  static void AppendLastChunk(std::string* out);
+
+  // Returns the current time as an HTTP-date. It's formatted at most once per
+  // second on each thread. Empty if the time isn't available.
+  static absl::string_view CurrentDate();
+
   static Result<std::string> FormatTime(time_t time_val);
 
-  Code code = Code::kInternalServerError;
-  std::map<std::string, std::string> header_to_value_;
+  // Parses an HTTP-date as produced by |FormatTime|. rfc7231 - 7.1.1.1
+  static Result<time_t> ParseTime(absl::string_view text);
 };
 
 std::ostream& operator<<(std::ostream& os, HttpResponse::Code code);
-std::ostream& operator<<(std::ostream& os, const HttpResponse& response);
 
 #endif  // _HTTP_RESPONSE_H_
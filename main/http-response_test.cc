@@ -0,0 +1,47 @@
+#include "main/http-response.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+TEST(HttpResponseTest, Serialize) {
+  std::string out = "previous";
+  HttpResponse::AppendStatusLine(HttpResponse::Code::kNotFound, &out);
+  HttpResponse::AppendHeader("Content-Length", 42, &out);
+  HttpResponse::AppendEnd(&out);
+
+  std::string date(HttpResponse::CurrentDate());
+  ASSERT_FALSE(date.empty());
+  // The date may have changed since the response was serialized.
+  size_t date_start = out.find("Date: ") + 6;
+  out.replace(date_start, out.find("\r\n", date_start) - date_start, date);
+
+  EXPECT_EQ("previousHTTP/1.1 404 Not Found\r\nDate: " + date +
+                "\r\nServer: thttpd\r\nConnection: keep-alive\r\n"
+                "Content-Length: 42\r\n\r\n",
+            out);
+}
+
+TEST(HttpResponseTest, Closing) {
+  std::string out;
+  HttpResponse::AppendStatusLine(HttpResponse::Code::kBadRequest, &out,
+                                 /*keep_alive=*/false);
+  EXPECT_NE(std::string::npos, out.find("\r\nConnection: close\r\n"));
+  EXPECT_EQ(std::string::npos, out.find("keep-alive"));
+}
+
+TEST(HttpResponseTest, Chunks) {
+  std::string out;
+  HttpResponse::AppendChunkHeader(0x1f40, &out);
+  out += "data";
+  HttpResponse::AppendChunkEnd(&out);
+  HttpResponse::AppendLastChunk(&out);
+  EXPECT_EQ("1f40\r\ndata\r\n0\r\n\r\n", out);
+}
+
+TEST(HttpResponseTest, CurrentDate) {
+  auto parsed = HttpResponse::ParseTime(HttpResponse::CurrentDate());
+  ASSERT_TRUE(parsed.ok());
+  EXPECT_LE(*parsed, time(nullptr));
+  EXPECT_GE(*parsed, time(nullptr) - 2);
+}
@@ -0,0 +1,104 @@
+#include "main/http-scan.h"
+
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif  // defined(__x86_64__)
+
+namespace http_scan {
+
+namespace {
+
+constexpr char kMaxControl = 0x1f;
+constexpr char kDelete = 0x7f;
+
+using FindControlFn = size_t (*)(absl::string_view data);
+
+FindControlFn SelectFindControl() {
+#if defined(__x86_64__)
+  // May run before the compiler's own CPU detection was initialized.
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return internal::FindControlAvx2;
+  }
+  // SSE2 is part of x86-64.
+  return internal::FindControlSse2;
+#else
+  return internal::FindControlScalar;
+#endif  // defined(__x86_64__)
+}
+
+const FindControlFn kFindControl = SelectFindControl();
+
+}  // namespace
+
+size_t FindControl(absl::string_view data) { return kFindControl(data); }
+
+namespace internal {
+
+size_t FindControlScalar(absl::string_view data) {
+  for (size_t i = 0; i < data.size(); ++i) {
+    char c = data[i];
+    if ((static_cast<unsigned char>(c) <= kMaxControl && c != '\t') ||
+        c == kDelete) {
+      return i;
+    }
+  }
+
+  return data.size();
+}
+
+#if defined(__x86_64__)
+
+size_t FindControlSse2(absl::string_view data) {
+  const __m128i max_control = _mm_set1_epi8(kMaxControl);
+  const __m128i del = _mm_set1_epi8(kDelete);
+  const __m128i tab = _mm_set1_epi8('\t');
+
+  size_t i = 0;
+  for (; i + sizeof(__m128i) <= data.size(); i += sizeof(__m128i)) {
+    __m128i chars =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data.data() + i));
+    // There is no unsigned compare, but max(c, 0x1f) == 0x1f iff c <= 0x1f.
+    __m128i control =
+        _mm_cmpeq_epi8(_mm_max_epu8(chars, max_control), max_control);
+    control = _mm_andnot_si128(_mm_cmpeq_epi8(chars, tab), control);
+    control = _mm_or_si128(control, _mm_cmpeq_epi8(chars, del));
+    int mask = _mm_movemask_epi8(control);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + FindControlScalar(data.substr(i));
+}
+
+__attribute__((target("avx2"))) size_t FindControlAvx2(
+    absl::string_view data) {
+  const __m256i max_control = _mm256_set1_epi8(kMaxControl);
+  const __m256i del = _mm256_set1_epi8(kDelete);
+  const __m256i tab = _mm256_set1_epi8('\t');
+
+  size_t i = 0;
+  for (; i + sizeof(__m256i) <= data.size(); i += sizeof(__m256i)) {
+    __m256i chars =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data.data() + i));
+    __m256i control =
+        _mm256_cmpeq_epi8(_mm256_max_epu8(chars, max_control), max_control);
+    control = _mm256_andnot_si256(_mm256_cmpeq_epi8(chars, tab), control);
+    control = _mm256_or_si256(control, _mm256_cmpeq_epi8(chars, del));
+    uint32_t mask = _mm256_movemask_epi8(control);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + FindControlSse2(data.substr(i));
+}
+
+#endif  // defined(__x86_64__)
+
+}  // namespace internal
+
+}  // namespace http_scan
@@ -0,0 +1,31 @@
+#ifndef MAIN_HTTP_SCAN_H_
+#define MAIN_HTTP_SCAN_H_
+
+#include <cstddef>
+
+#include "absl/strings/string_view.h"
+
+// Vectorized scanning of request data. The implementation is picked at
+// startup: AVX2 or SSE2 on x86-64 depending on the CPU, plain C++ elsewhere.
+namespace http_scan {
+
+// Returns the offset of the first control character in |data| other than
+// HTAB, or |data.size()| if there is none. CR and LF are control characters,
+// so this finds line ends and invalid bytes in one pass. rfc7230 - 3.2.6
+size_t FindControl(absl::string_view data);
+
+// Implementations, exposed for tests.
+namespace internal {
+
+size_t FindControlScalar(absl::string_view data);
+#if defined(__x86_64__)
+size_t FindControlSse2(absl::string_view data);
+// Requires a CPU with AVX2.
+size_t FindControlAvx2(absl::string_view data);
+#endif  // defined(__x86_64__)
+
+}  // namespace internal
+
+}  // namespace http_scan
+
+#endif  // MAIN_HTTP_SCAN_H_
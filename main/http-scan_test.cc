@@ -0,0 +1,63 @@
+#include "main/http-scan.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+using FindControlFn = size_t (*)(absl::string_view data);
+
+std::vector<FindControlFn> Implementations() {
+  std::vector<FindControlFn> result = {
+      http_scan::FindControl,
+      http_scan::internal::FindControlScalar,
+  };
+#if defined(__x86_64__)
+  result.push_back(http_scan::internal::FindControlSse2);
+  if (__builtin_cpu_supports("avx2")) {
+    result.push_back(http_scan::internal::FindControlAvx2);
+  }
+#endif  // defined(__x86_64__)
+  return result;
+}
+
+}  // namespace
+
+TEST(HttpScanTest, FindControl) {
+  for (FindControlFn find_control : Implementations()) {
+    EXPECT_EQ(0u, find_control(""));
+    EXPECT_EQ(5u, find_control("Host:"));
+    EXPECT_EQ(4u, find_control("Host\r\n"));
+    EXPECT_EQ(1u, find_control("a\nb"));
+    EXPECT_EQ(3u, find_control("a\tb"));
+    EXPECT_EQ(1u, find_control(absl::string_view("a\0b", 3)));
+    EXPECT_EQ(1u, find_control("a\x7f"));
+    // obs-text is allowed.
+    EXPECT_EQ(2u, find_control("\x80\xff"));
+  }
+}
+
+TEST(HttpScanTest, MatchesScalar) {
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> byte_dist(0, 255);
+  for (int round = 0; round < 2000; ++round) {
+    // Mostly printable data with a rare control character at any alignment.
+    std::string data(rng() % 200, 'a');
+    for (char& c : data) {
+      c = static_cast<char>(byte_dist(rng));
+      if (c >= 0 && c < 0x20 && c != '\t' && rng() % 32 != 0) {
+        c = 'x';
+      }
+    }
+    size_t offset = data.empty() ? 0 : rng() % data.size();
+    absl::string_view view = absl::string_view(data).substr(offset);
+
+    size_t expected = http_scan::internal::FindControlScalar(view);
+    for (FindControlFn find_control : Implementations()) {
+      EXPECT_EQ(expected, find_control(view));
+    }
+  }
+}
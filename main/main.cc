@@ -4,13 +4,19 @@
 
 #include <limits>
 
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
 #include "base/logging.h"
 #include "base/util.h"
 #include "main/thttpd.h"
 
 int main(int argc, char** argv) {
   if (argc < 3) {
-    LOG(ERR) << "Usage: " << argv[0] << " port path_to_serve";
+    LOG(ERR) << "Usage: " << argv[0]
+             << " port path_to_serve [--reuse_port] [--io_uring]"
+             << " [--precompressed]"
+             << " [--compression_cache_dir=DIR] [--hot_set_file=FILE]"
+             << " [--ready_file=FILE]";
     return EXIT_FAILURE;
   }
 
@@ -51,6 +57,26 @@ int main(int argc, char** argv) {
   config.port = port;
   config.path_to_serve = path_to_serve;
 
+  for (int i = 3; i < argc; ++i) {
+    absl::string_view arg = argv[i];
+    if (arg == "--reuse_port") {
+      config.reuse_port = true;
+    } else if (arg == "--io_uring") {
+      config.io_uring = true;
+    } else if (arg == "--precompressed") {
+      config.serve_precompressed = true;
+    } else if (absl::ConsumePrefix(&arg, "--compression_cache_dir=")) {
+      config.compression_cache_dir = std::string(arg);
+    } else if (absl::ConsumePrefix(&arg, "--hot_set_file=")) {
+      config.hot_set_file = std::string(arg);
+    } else if (absl::ConsumePrefix(&arg, "--ready_file=")) {
+      config.ready_file = std::string(arg);
+    } else {
+      LOG(ERR) << "Unknown flag: " << arg;
+      return EXIT_FAILURE;
+    }
+  }
+
   auto thttpd_or = Thttpd::Create(config);
   if (!thttpd_or.ok()) {
     LOG(ERR) << "Failed to create Thttpd: " << thttpd_or.err();
@@ -0,0 +1,193 @@
+#include "main/parallel-gzip.h"
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
+#include "base/logging.h"
+#include "base/scoped-destructor.h"
+
+namespace parallel_gzip {
+namespace {
+
+// Same as ZlibDeflateReader.
+constexpr int kMemLevel = 8;
+
+// Negative means raw deflate, without zlib or gzip framing.
+constexpr int kRawWindowBits = -MAX_WBITS;
+
+// Blocks are primed with this much of the preceding data, the size of the
+// deflate window.
+constexpr size_t kDictionarySize = 32 * 1024;
+
+// Fixed gzip member header: deflate, no flags, no mtime, Unix.
+constexpr char kHeader[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+
+struct Block {
+  std::string data;
+  uLong crc = 0;
+};
+
+struct Job {
+  std::shared_ptr<const FileCache::Entry> file;
+  Callback callback;
+  int level = 0;
+  size_t num_blocks = 0;
+
+  absl::Mutex mu;
+  // Compressed blocks which can't be passed on until the ones before are.
+  std::vector<absl::optional<Block>> blocks GUARDED_BY(mu);
+  size_t next_block GUARDED_BY(mu) = 0;
+  uLong crc GUARDED_BY(mu) = crc32(0, nullptr, 0);
+  bool failed GUARDED_BY(mu) = false;
+};
+
+size_t BlockLength(const Job& job, size_t idx) {
+  return std::min(kBlockSize, job.file->size - idx * kBlockSize);
+}
+
+// Reads |length| bytes at |offset|, failing if the file got shorter.
+Result<void> ReadFully(int fd, off_t offset, char* buf, size_t length) {
+  while (length > 0) {
+    ssize_t num_read = pread(fd, buf, length, offset);
+    if (num_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return BuildPosixErr("pread failed");
+    }
+    if (num_read == 0) {
+      return Err("File shrank while compressing");
+    }
+    buf += num_read;
+    length -= num_read;
+    offset += num_read;
+  }
+
+  return {};
+}
+
+Result<Block> CompressBlock(const FileCache::Entry& file, int level,
+                            size_t idx, bool last) {
+  off_t offset = idx * kBlockSize;
+  size_t dictionary_size = std::min<size_t>(offset, kDictionarySize);
+  size_t length = std::min(kBlockSize, file.size - offset);
+
+  std::string in(dictionary_size + length, '\0');
+  TRY(ReadFully(*file.fd, offset - dictionary_size, &in[0], in.size()));
+
+  z_stream stream{};
+  if (deflateInit2(&stream, level, Z_DEFLATED, kRawWindowBits, kMemLevel,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return Err("deflateInit failed");
+  }
+  ScopedDestructor end_stream([&stream] { deflateEnd(&stream); });
+
+  auto* in_bytes = reinterpret_cast<unsigned char*>(&in[0]);
+  if (dictionary_size > 0 &&
+      deflateSetDictionary(&stream, in_bytes, dictionary_size) != Z_OK) {
+    return Err("deflateSetDictionary failed");
+  }
+
+  Block block;
+  block.crc = crc32(crc32(0, nullptr, 0), in_bytes + dictionary_size, length);
+
+  // Non final blocks end with a sync flush, which byte aligns the output.
+  int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+  stream.next_in = in_bytes + dictionary_size;
+  stream.avail_in = length;
+  int ret;
+  do {
+    size_t used = block.data.size();
+    block.data.resize(used + deflateBound(&stream, stream.avail_in) + 16);
+    stream.next_out = reinterpret_cast<unsigned char*>(&block.data[used]);
+    stream.avail_out = block.data.size() - used;
+    ret = deflate(&stream, flush);
+    if (ret == Z_STREAM_ERROR) {
+      return Err("deflate failed");
+    }
+    block.data.resize(block.data.size() - stream.avail_out);
+  } while (last ? ret != Z_STREAM_END : stream.avail_out == 0);
+
+  return block;
+}
+
+void AppendLittleEndian32(uint32_t value, std::string* out) {
+  for (int i = 0; i < 4; ++i) {
+    out->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+void OnBlockCompressed(Job* job, size_t idx, Result<Block> block) {
+  absl::MutexLock lock(&job->mu);
+  if (job->failed) {
+    return;
+  }
+  if (!block.ok()) {
+    job->failed = true;
+    job->callback(std::move(block.err()));
+    return;
+  }
+
+  // Pass on the blocks which are next in order.
+  job->blocks[idx] = std::move(*block);
+  while (job->next_block < job->num_blocks && job->blocks[job->next_block]) {
+    absl::optional<Block>& next = job->blocks[job->next_block];
+    job->crc = crc32_combine(job->crc, next->crc,
+                             BlockLength(*job, job->next_block));
+    job->callback(absl::string_view(next->data));
+    next.reset();
+    ++job->next_block;
+  }
+  if (job->next_block < job->num_blocks) {
+    return;
+  }
+
+  std::string trailer;
+  AppendLittleEndian32(job->crc, &trailer);
+  AppendLittleEndian32(job->file->size, &trailer);
+  job->callback(absl::string_view(trailer));
+  job->callback(absl::string_view());
+}
+
+void CompressBlockOfJob(std::shared_ptr<Job> job, size_t idx) {
+  bool last = idx + 1 == job->num_blocks;
+  OnBlockCompressed(job.get(), idx,
+                    CompressBlock(*job->file, job->level, idx, last));
+}
+
+}  // namespace
+
+bool ShouldCompressInParallel(size_t size, const ThreadPool& thread_pool) {
+  return thread_pool.size() > 1 && size > kBlockSize;
+}
+
+void Compress(std::shared_ptr<const FileCache::Entry> file, int level,
+              ThreadPool* thread_pool, Callback callback) {
+  auto job = std::make_shared<Job>();
+  size_t num_blocks = std::max<size_t>(
+      (file->size + kBlockSize - 1) / kBlockSize, 1);
+  VLOG(3) << "Compressing " << file->path << " in " << num_blocks
+          << " blocks";
+  job->file = std::move(file);
+  job->callback = std::move(callback);
+  job->level = level;
+  job->num_blocks = num_blocks;
+  job->blocks.resize(num_blocks);
+
+  // Nothing runs concurrently yet.
+  job->callback(absl::string_view(kHeader, sizeof(kHeader)));
+
+  for (size_t i = 0; i < num_blocks; ++i) {
+    thread_pool->PostTask(BindOnce(&CompressBlockOfJob, job, i));
+  }
+}
+
+}  // namespace parallel_gzip
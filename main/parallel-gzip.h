@@ -0,0 +1,39 @@
+#ifndef MAIN_PARALLEL_GZIP_H_
+#define MAIN_PARALLEL_GZIP_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "base/err.h"
+#include "main/file-cache.h"
+#include "main/thread-pool.h"
+
+// Gzip compression of large files on several threads, like pigz. The file is
+// split into blocks, each compressed on its own into raw deflate data primed
+// with the end of the previous block, and ended with a sync flush so the
+// blocks concatenate into one deflate stream. The CRC32 of the gzip trailer
+// is combined from the CRC32s of the blocks. rfc1952
+namespace parallel_gzip {
+
+// Bytes of the file compressed by each task.
+constexpr size_t kBlockSize = 128 * 1024;
+
+// Returns true if compressing |size| bytes is worth splitting across
+// |thread_pool|.
+bool ShouldCompressInParallel(size_t size, const ThreadPool& thread_pool);
+
+// Receives consecutive pieces of the gzip data as soon as they are ready, and
+// then an empty piece. Or an error, after which it isn't called again.
+using Callback = std::function<void(Result<absl::string_view>)>;
+
+// Compresses |file| at zlib |level| on the runners of |thread_pool|.
+// |callback| is never run concurrently, but may run on any thread.
+void Compress(std::shared_ptr<const FileCache::Entry> file, int level,
+              ThreadPool* thread_pool, Callback callback);
+
+}  // namespace parallel_gzip
+
+#endif  // MAIN_PARALLEL_GZIP_H_
@@ -0,0 +1,135 @@
+#include "main/parallel-gzip.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/synchronization/notification.h"
+#include "absl/types/optional.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class ParallelGzipTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = testing::TempDir() + "/parallel-gzip_testXXXXXX";
+    int fd = mkstemp(&path_[0]);
+    ASSERT_GE(fd, 0);
+    close(fd);
+  }
+
+  void TearDown() override { unlink(path_.c_str()); }
+
+  std::shared_ptr<const FileCache::Entry> WriteFile(
+      const std::string& contents) {
+    FILE* fp = fopen(path_.c_str(), "w");
+    EXPECT_NE(nullptr, fp);
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+
+    auto entry = std::make_shared<FileCache::Entry>();
+    entry->path = path_;
+    entry->fd = ScopedFd(open(path_.c_str(), O_RDONLY));
+    entry->size = contents.size();
+    return entry;
+  }
+
+  Result<std::string> Compress(std::shared_ptr<const FileCache::Entry> file) {
+    absl::Notification done;
+    std::string gzip;
+    absl::optional<Err> err;
+    parallel_gzip::Compress(std::move(file), /*level=*/6, &thread_pool_,
+                            [&](Result<absl::string_view> piece) {
+                              if (!piece.ok()) {
+                                err = std::move(piece.err());
+                                done.Notify();
+                              } else if (piece->empty()) {
+                                done.Notify();
+                              } else {
+                                gzip.append(piece->data(), piece->size());
+                              }
+                            });
+    done.WaitForNotification();
+    if (err) {
+      return std::move(*err);
+    }
+    return gzip;
+  }
+
+  std::string path_;
+  ThreadPool thread_pool_{4};
+};
+
+// Compressible, but not trivially so.
+std::string MakeContents(size_t size) {
+  std::string contents;
+  unsigned seed = 1;
+  while (contents.size() < size) {
+    seed = seed * 1103515245 + 12345;
+    contents += "line " + std::to_string(seed % 1000) + " of some text\n";
+  }
+  contents.resize(size);
+  return contents;
+}
+
+// Decompresses |gzip| with zlib, which checks the CRC32 and size trailer.
+std::string Gunzip(const std::string& gzip) {
+  z_stream stream{};
+  EXPECT_EQ(Z_OK, inflateInit2(&stream, 16 + MAX_WBITS));
+  stream.next_in =
+      reinterpret_cast<unsigned char*>(const_cast<char*>(gzip.data()));
+  stream.avail_in = gzip.size();
+
+  std::string out;
+  int ret = Z_OK;
+  while (ret == Z_OK) {
+    char buf[BUFSIZ];
+    stream.next_out = reinterpret_cast<unsigned char*>(buf);
+    stream.avail_out = sizeof(buf);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    out.append(buf, sizeof(buf) - stream.avail_out);
+  }
+  EXPECT_EQ(Z_STREAM_END, ret);
+  EXPECT_EQ(0u, stream.avail_in);
+  inflateEnd(&stream);
+  return out;
+}
+
+}  // namespace
+
+TEST_F(ParallelGzipTest, RoundTrips) {
+  for (size_t size : {size_t{0}, size_t{100}, parallel_gzip::kBlockSize,
+                      parallel_gzip::kBlockSize * 5 + 12345}) {
+    std::string contents = MakeContents(size);
+    auto gzip = Compress(WriteFile(contents));
+    ASSERT_TRUE(gzip.ok());
+    EXPECT_EQ(contents, Gunzip(*gzip)) << size;
+    if (size > 0) {
+      EXPECT_LT(gzip->size(), size);
+    }
+  }
+}
+
+TEST_F(ParallelGzipTest, FileShrank) {
+  auto file = WriteFile(MakeContents(parallel_gzip::kBlockSize * 3));
+  ASSERT_EQ(0, truncate(path_.c_str(), parallel_gzip::kBlockSize));
+  EXPECT_FALSE(Compress(std::move(file)).ok());
+}
+
+TEST(ParallelGzip, ShouldCompressInParallel) {
+  ThreadPool one_thread(1);
+  ThreadPool threads(4);
+  EXPECT_FALSE(parallel_gzip::ShouldCompressInParallel(
+      parallel_gzip::kBlockSize * 10, one_thread));
+  EXPECT_FALSE(parallel_gzip::ShouldCompressInParallel(
+      parallel_gzip::kBlockSize, threads));
+  EXPECT_TRUE(parallel_gzip::ShouldCompressInParallel(
+      parallel_gzip::kBlockSize + 1, threads));
+}
@@ -0,0 +1,566 @@
+#include "main/reactor.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <utility>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+#include "base/logging.h"
+#include "base/scoped-destructor.h"
+#include "main/request-handler.h"
+#include "main/thttpd.h"
+
+namespace {
+
+constexpr int kListenBacklog = 128;
+constexpr int kMaxEvents = 4096;
+
+// Bounds the time spent accepting so established connections aren't starved.
+constexpr int kMaxAcceptsPerWakeup = 64;
+
+// Sized for a few hundred connections, each with a receive and a poll
+// request. The ring is only ever short of entries while submitting.
+constexpr unsigned kIoUringEntries = 1024;
+// Received data is copied out of the buffers right away, so they're only
+// needed for the receives completed in one wakeup.
+constexpr unsigned kNumRecvBuffers = 256;
+constexpr size_t kRecvBufferSize = 4096;
+
+// What an io_uring request is for, in the low byte of its user_data. The rest
+// is the connection id, for requests on a connection.
+enum class Op : uint8_t {
+  kAccept,
+  kEvents,
+  kFileChanges,
+  kRecv,
+  kWritable,
+  kCancel,
+};
+
+uint64_t UserData(Op op, uint64_t conn_id = 0) {
+  return conn_id << 8 | static_cast<uint8_t>(op);
+}
+
+}  // namespace
+
+// static
+Result<std::unique_ptr<Reactor>> Reactor::Create(Thttpd* thttpd, Mode mode) {
+  // |closed_fds_| is cacheline aligned, which the global operator new only
+  // respects from C++17 on.
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, alignof(Reactor), sizeof(Reactor)) != 0) {
+    throw std::bad_alloc();
+  }
+  auto ret = absl::WrapUnique(::new (ptr) Reactor(thttpd, mode));
+  TRY(ret->Init());
+  return ret;
+}
+
+// static
+void Reactor::operator delete(void* ptr) { free(ptr); }
+
+Reactor::Reactor(Thttpd* thttpd, Mode mode) : thttpd_(thttpd), mode_(mode) {}
+
+Result<void> Reactor::Run() {
+  if (mode_ == Mode::kInline) {
+    task_runner_ = TaskRunner::CurrentTaskRunner();
+    ABSL_ASSERT(task_runner_);
+  }
+
+  if (task_runner_) {
+    // Tasks posted to us (e.g. from the compression cache) must run between
+    // calls to epoll_wait().
+    task_runner_->SetWakeupFd(*event_write_fd_);
+    // Tasks posted before didn't write to the pipe.
+    task_runner_->RunPendingTasks();
+  }
+  ScopedDestructor clear_wakeup_fd([this] {
+    if (task_runner_) {
+      task_runner_->SetWakeupFd(-1);
+    }
+  });
+
+  LOG(INFO) << "Listening on port " << thttpd_->config().port;
+  if (io_uring_) {
+    return RunIoUring();
+  }
+
+  const auto events = absl::make_unique<std::array<epoll_event, kMaxEvents>>();
+  while (!stopped_.load(std::memory_order_acquire)) {
+    int num_fds =
+        epoll_wait(*epoll_fd_, events->data(), events->size(), /*timeout=*/-1);
+    if (num_fds < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return BuildPosixErr("epoll_wait failed");
+    }
+
+    for (auto& event : absl::MakeSpan(events->data(), num_fds)) {
+      int fd = event.data.fd;
+      if (fd == *listen_fd_) {
+        // |listen_fd_| is level triggered, so anything left over will show up
+        // in the next epoll_wait().
+        for (int i = 0; i < kMaxAcceptsPerWakeup; ++i) {
+          if (!AcceptNewClient()) {
+            break;
+          }
+        }
+      } else if (fd == *event_read_fd_) {
+        HandleEvents();
+      } else if (file_watcher_ && fd == file_watcher_->fd()) {
+        HandleFileChanges();
+      } else {
+        HandleClient(fd, event.events);
+      }
+    }
+  }
+
+  return {};
+}
+
+Result<void> Reactor::WatchFiles(FileWatcher* file_watcher) {
+  if (io_uring_) {
+    // Polled once running.
+    file_watcher_ = file_watcher;
+    return {};
+  }
+
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = file_watcher->fd();
+  if (epoll_ctl(*epoll_fd_, EPOLL_CTL_ADD, file_watcher->fd(), &event) < 0) {
+    return BuildPosixErr("epoll_ctl on file_watcher fd failed");
+  }
+
+  file_watcher_ = file_watcher;
+  return {};
+}
+
+void Reactor::Stop() {
+  stopped_.store(true, std::memory_order_release);
+  NotifyEvent("stop");
+}
+
+void Reactor::NotifySocketClosed(int fd) {
+  closed_fds_.Push(fd);
+  NotifyEvent(absl::StrCat("socket closed: ", fd));
+}
+
+Result<void> Reactor::Init() {
+  listen_fd_ =
+      ScopedFd(socket(PF_INET6, SOCK_STREAM | SOCK_NONBLOCK, /*protocol=*/0));
+  if (*listen_fd_ < 0) {
+    return BuildPosixErr("socket failed");
+  }
+
+  {
+    int opt = 1;
+    if (setsockopt(*listen_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) <
+        0) {
+      return BuildPosixErr("socksockopt failed");
+    }
+
+    // Each reactor has its own listening socket and the kernel balances new
+    // connections between them.
+    if (mode_ == Mode::kInline &&
+        setsockopt(*listen_fd_, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) <
+            0) {
+      return BuildPosixErr("setsockopt(SO_REUSEPORT) failed");
+    }
+
+    // Responses are coalesced explicitly with sendmsg() and MSG_MORE, so
+    // Nagle's algorithm only delays them. Accepted sockets inherit this.
+    if (setsockopt(*listen_fd_, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) <
+        0) {
+      return BuildPosixErr("setsockopt(TCP_NODELAY) failed");
+    }
+  }
+
+  {
+    sockaddr_in6 addr{};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(thttpd_->config().port);
+    addr.sin6_addr = in6addr_any;
+    if (bind(*listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) <
+        0) {
+      return BuildPosixErr("bind failed");
+    }
+
+    if (listen(*listen_fd_, kListenBacklog) < 0) {
+      return BuildPosixErr("listen failed");
+    }
+  }
+
+  // Both ends are nonblocking. A full pipe means the loop will wake up anyway.
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_NONBLOCK) < 0) {
+    return BuildPosixErr("pipe2 failed");
+  }
+  event_read_fd_ = ScopedFd(pipe_fds[0]);
+  event_write_fd_ = ScopedFd(pipe_fds[1]);
+
+  if (thttpd_->config().io_uring) {
+    auto io_uring =
+        IoUring::Create(kIoUringEntries, kNumRecvBuffers, kRecvBufferSize);
+    if (io_uring.ok()) {
+      // The sockets are polled once running.
+      io_uring_ = std::move(*io_uring);
+      return {};
+    }
+    // Every ring locks memory for its buffers, so one may fail after others
+    // were set up.
+    LOG(WARN) << "Using epoll: " << io_uring.err();
+  }
+
+  epoll_fd_ = ScopedFd(epoll_create1(/*flags=*/0));
+  if (*epoll_fd_ < 0) {
+    return BuildPosixErr("epoll_create1 failed");
+  }
+
+  {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = *listen_fd_;
+    if (epoll_ctl(*epoll_fd_, EPOLL_CTL_ADD, *listen_fd_, &event) < 0) {
+      return BuildPosixErr("epoll_ctl on listen_fd failed");
+    }
+  }
+
+  {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = *event_read_fd_;
+    if (epoll_ctl(*epoll_fd_, EPOLL_CTL_ADD, *event_read_fd_, &event) < 0) {
+      return BuildPosixErr("epoll_ctl on event_read_fd failed");
+    }
+  }
+
+  return {};
+}
+
+void Reactor::NotifyEvent(absl::string_view event) {
+  std::string str_event(event);
+  str_event.push_back('\n');
+  ssize_t ret = write(*event_write_fd_, str_event.data(), str_event.size());
+  if (ret != static_cast<ssize_t>(str_event.size()) && errno != EAGAIN) {
+    LOG(ERR) << "Failed to write event: " << event;
+  }
+}
+
+bool Reactor::AcceptNewClient() {
+  sockaddr_storage remote_addr;
+  socklen_t remote_addr_len = sizeof(remote_addr);
+  ScopedFd conn_sock(accept4(*listen_fd_,
+                             reinterpret_cast<sockaddr*>(&remote_addr),
+                             &remote_addr_len, SOCK_NONBLOCK));
+  if (*conn_sock < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      LOG(ERR) << "accept failed : " << strerror(errno);
+    }
+    return false;
+  }
+  // EPOLLRDHUP tells the handler that the peer is done even when its data and
+  // FIN are read in one go, which leaves no edge to wait for.
+  epoll_event new_event{};
+  new_event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  new_event.data.fd = *conn_sock;
+  if (epoll_ctl(*epoll_fd_, EPOLL_CTL_ADD, *conn_sock, &new_event) < 0) {
+    LOG(ERR) << "epoll_ctl on conn_sock failed failed : " << strerror(errno);
+    return true;
+  }
+
+  AddClient(std::move(conn_sock), remote_addr);
+  return true;
+}
+
+void Reactor::AddClient(ScopedFd conn_sock,
+                        const sockaddr_storage& remote_addr) {
+  char addr_str[INET6_ADDRSTRLEN];
+  const void* in_addr = nullptr;
+  if (remote_addr.ss_family == AF_INET) {
+    in_addr = &(reinterpret_cast<const sockaddr_in*>(&remote_addr)->sin_addr);
+  } else {
+    in_addr =
+        &(reinterpret_cast<const sockaddr_in6*>(&remote_addr)->sin6_addr);
+  }
+  if (inet_ntop(remote_addr.ss_family, in_addr, addr_str, sizeof(addr_str)) ==
+      nullptr) {
+    LOG(WARN) << "inet_ntop failed: " << strerror(errno);
+    addr_str[0] = '\0';
+  } else {
+    addr_str[sizeof(addr_str) - 1] = '\0';
+    VLOG(2) << "Connection from: " << addr_str;
+  }
+
+  int raw_conn_sock = *conn_sock;
+
+  TaskRunner* task_runner = mode_ == Mode::kInline
+                                ? task_runner_.get()
+                                : thttpd_->thread_pool()->GetNextRunner();
+  auto request_handler = std::make_shared<RequestHandler>(
+      addr_str, thttpd_, this, task_runner, std::move(conn_sock));
+  request_handler->Init(request_handler);
+
+  conn_fd_to_handler_.emplace(raw_conn_sock, std::move(request_handler));
+}
+
+void Reactor::HandleEvents() {
+  char buf[BUFSIZ];
+  while (true) {
+    ssize_t ret = read(*event_read_fd_, buf, sizeof(buf));
+    if (ret < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG(ERR) << "Read event_fd failed: " << strerror(errno);
+      }
+      break;
+    }
+  }
+
+  if (task_runner_) {
+    task_runner_->RunPendingTasks();
+  }
+
+  while (!closed_fds_.Empty()) {
+    int fd = closed_fds_.Pop();
+    auto it = conn_fd_to_handler_.find(fd);
+    if (it == conn_fd_to_handler_.end()) {
+      LOG(ERR) << "Unknown socket!";
+      continue;
+    }
+
+    VLOG(2) << "Disconnected: " << it->second->client_ip();
+    conn_fd_to_handler_.erase(it);
+
+    auto id_it = conn_fd_to_id_.find(fd);
+    if (id_it != conn_fd_to_id_.end()) {
+      // The requests hold on to the socket until canceled.
+      for (Op op : {Op::kRecv, Op::kWritable}) {
+        io_uring_sqe* sqe = io_uring_->GetSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = UserData(op, id_it->second);
+        sqe->user_data = UserData(Op::kCancel);
+      }
+      conn_id_to_fd_.erase(id_it->second);
+      conn_fd_to_id_.erase(id_it);
+    }
+  }
+}
+
+void Reactor::HandleFileChanges() {
+  bool was_complete = file_watcher_->complete();
+  auto result = file_watcher_->ReadEvents(
+      [this](absl::string_view path) { thttpd_->InvalidatePath(path); });
+  if (!result.ok()) {
+    LOG(ERR) << result.err();
+  }
+  if (was_complete && !file_watcher_->complete()) {
+    thttpd_->OnFileWatcherIncomplete();
+  }
+}
+
+void Reactor::HandleClient(int fd, uint32_t epoll_events) {
+  auto it = conn_fd_to_handler_.find(fd);
+  if (it == conn_fd_to_handler_.end()) {
+    LOG(ERR) << "Unknown socket!";
+    return;
+  }
+  bool peer_closed = epoll_events & (EPOLLRDHUP | EPOLLHUP);
+  bool can_read = (epoll_events & EPOLLIN) || peer_closed;
+  bool can_write = epoll_events & EPOLLOUT;
+
+  const auto& request_handler = it->second;
+
+  if (mode_ == Mode::kInline) {
+    request_handler->HandleUpdate(can_read, can_write, peer_closed);
+    return;
+  }
+
+  request_handler->task_runner()->PostTask(
+      BindOnce(&RequestHandler::HandleUpdate, request_handler, can_read,
+               can_write, peer_closed));
+}
+
+Result<void> Reactor::RunIoUring() {
+  SubmitMultishotAccept();
+  SubmitMultishotPoll(*event_read_fd_, POLLIN, UserData(Op::kEvents));
+  if (file_watcher_) {
+    SubmitMultishotPoll(file_watcher_->fd(), POLLIN,
+                        UserData(Op::kFileChanges));
+  }
+
+  const auto handle_completion = [this](const io_uring_cqe& cqe) {
+    HandleCompletion(cqe);
+  };
+  while (!stopped_.load(std::memory_order_acquire)) {
+    TRY(io_uring_->SubmitAndWait(/*min_complete=*/1));
+    io_uring_->ForEachCompletion(handle_completion);
+  }
+
+  return {};
+}
+
+void Reactor::SubmitMultishotAccept() {
+  io_uring_sqe* sqe = io_uring_->GetSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = *listen_fd_;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = UserData(Op::kAccept);
+}
+
+void Reactor::SubmitMultishotPoll(int fd, uint32_t events,
+                                  uint64_t user_data) {
+  io_uring_sqe* sqe = io_uring_->GetSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = user_data;
+}
+
+void Reactor::SubmitMultishotRecv(int fd, uint64_t user_data) {
+  io_uring_sqe* sqe = io_uring_->GetSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = IoUring::kBufferGroup;
+  sqe->user_data = user_data;
+}
+
+void Reactor::HandleCompletion(const io_uring_cqe& cqe) {
+  Op op = static_cast<Op>(cqe.user_data & 0xff);
+  uint64_t conn_id = cqe.user_data >> 8;
+  // Multishot requests stop on errors, e.g. when the kernel is short of
+  // memory, and on cancellation.
+  bool ended = !(cqe.flags & IORING_CQE_F_MORE);
+
+  switch (op) {
+    case Op::kAccept:
+      HandleAcceptCompletion(cqe);
+      if (ended) {
+        SubmitMultishotAccept();
+      }
+      return;
+    case Op::kEvents:
+      HandleEvents();
+      if (ended) {
+        SubmitMultishotPoll(*event_read_fd_, POLLIN, cqe.user_data);
+      }
+      return;
+    case Op::kFileChanges:
+      HandleFileChanges();
+      if (ended) {
+        SubmitMultishotPoll(file_watcher_->fd(), POLLIN, cqe.user_data);
+      }
+      return;
+    case Op::kRecv:
+      HandleRecvCompletion(conn_id, cqe);
+      return;
+    case Op::kWritable: {
+      auto it = conn_id_to_fd_.find(conn_id);
+      if (it == conn_id_to_fd_.end()) {
+        // Canceled as the connection closed.
+        return;
+      }
+      if (ended) {
+        SubmitMultishotPoll(it->second, POLLOUT, cqe.user_data);
+      }
+      const auto& request_handler = conn_fd_to_handler_.at(it->second);
+      if (mode_ == Mode::kInline) {
+        request_handler->HandleWritable();
+      } else {
+        request_handler->task_runner()->PostTask(
+            BindOnce(&RequestHandler::HandleWritable, request_handler));
+      }
+      return;
+    }
+    case Op::kCancel:
+      return;
+  }
+}
+
+void Reactor::HandleAcceptCompletion(const io_uring_cqe& cqe) {
+  if (cqe.res < 0) {
+    LOG(ERR) << "accept failed : " << strerror(-cqe.res);
+    return;
+  }
+
+  ScopedFd conn_sock(cqe.res);
+  sockaddr_storage remote_addr = {};
+  socklen_t remote_addr_len = sizeof(remote_addr);
+  if (getpeername(*conn_sock, reinterpret_cast<sockaddr*>(&remote_addr),
+                  &remote_addr_len) < 0) {
+    // E.g. the client is already gone.
+    VLOG(2) << "getpeername failed: " << strerror(errno);
+    return;
+  }
+
+  int fd = *conn_sock;
+  uint64_t conn_id = next_conn_id_++;
+  AddClient(std::move(conn_sock), remote_addr);
+  conn_id_to_fd_.emplace(conn_id, fd);
+  conn_fd_to_id_.emplace(fd, conn_id);
+  SubmitMultishotRecv(fd, UserData(Op::kRecv, conn_id));
+  SubmitMultishotPoll(fd, POLLOUT, UserData(Op::kWritable, conn_id));
+}
+
+void Reactor::HandleRecvCompletion(uint64_t conn_id,
+                                   const io_uring_cqe& cqe) {
+  absl::string_view data;
+  bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+  uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+  if (has_buffer && cqe.res > 0) {
+    data = io_uring_->Buffer(buffer_id, cqe.res);
+  }
+  ScopedDestructor recycle_buffer([this, has_buffer, buffer_id] {
+    if (has_buffer) {
+      io_uring_->RecycleBuffer(buffer_id);
+    }
+  });
+
+  auto it = conn_id_to_fd_.find(conn_id);
+  if (it == conn_id_to_fd_.end() || cqe.res == -ECANCELED) {
+    return;
+  }
+  int fd = it->second;
+
+  if (cqe.res == -ENOBUFS) {
+    // The buffers were all in use. They're back by the time this is
+    // submitted.
+    SubmitMultishotRecv(fd, cqe.user_data);
+    return;
+  }
+  if (cqe.res < 0) {
+    VLOG(2) << "recv failed: " << strerror(-cqe.res);
+  } else if (cqe.res > 0 && !(cqe.flags & IORING_CQE_F_MORE)) {
+    SubmitMultishotRecv(fd, cqe.user_data);
+  }
+
+  // Empty |data| tells the handler that the peer is gone.
+  const auto& request_handler = conn_fd_to_handler_.at(fd);
+  if (mode_ == Mode::kInline) {
+    request_handler->HandleReceived(data);
+    return;
+  }
+  request_handler->task_runner()->PostTask(
+      BindOnce([request_handler, data = std::string(data)] {
+        request_handler->HandleReceived(data);
+      }));
+}
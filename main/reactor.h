@@ -0,0 +1,127 @@
+#ifndef MAIN_REACTOR_H_
+#define MAIN_REACTOR_H_
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "absl/base/attributes.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "base/err.h"
+#include "base/io-uring.h"
+#include "base/mpsc-queue.h"
+#include "base/scoped-fd.h"
+#include "base/task-runner.h"
+#include "main/file-watcher.h"
+
+class RequestHandler;
+class Thttpd;
+
+// Owns a listening socket, an epoll instance or io_uring, and the connections
+// accepted on them.
+class Reactor {
+ public:
+  enum class Mode {
+    // Connections are spread across the thread pool. Readiness events are
+    // posted to the TaskRunner of each connection's RequestHandler.
+    kDispatch,
+
+    // Connections are handled on the thread running the reactor, which must be
+    // a TaskRunner. The listening socket uses SO_REUSEPORT so that multiple
+    // reactors can share the port.
+    kInline,
+  };
+
+  enum class Backend {
+    // Connections are read from once epoll reports them readable.
+    kEpoll,
+
+    // Connections are accepted and received from by io_uring, which hands the
+    // data to |RequestHandler::HandleReceived|. Selected by |Config::io_uring|
+    // if the ring could be set up.
+    kIoUring,
+  };
+
+  // Creates the listening socket. Can be called from any thread.
+  static Result<std::unique_ptr<Reactor>> Create(Thttpd* thttpd, Mode mode);
+
+  Reactor(const Reactor&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+
+  // Frees the storage |Create| allocated with the alignment of |closed_fds_|.
+  static void operator delete(void* ptr);
+
+  // Blocks until |Stop| is called or an error occurs. In |Mode::kInline| must
+  // be called on a TaskRunner.
+  ABSL_MUST_USE_RESULT Result<void> Run();
+
+  // Reports the changes |file_watcher| sees to the caches, from this
+  // reactor's loop. Must be called before |Run|.
+  Result<void> WatchFiles(FileWatcher* file_watcher);
+
+  // Thread safe.
+  void Stop();
+
+  // Thread safe.
+  void NotifySocketClosed(int fd);
+
+  Backend backend() const {
+    return io_uring_ ? Backend::kIoUring : Backend::kEpoll;
+  }
+
+ private:
+  Reactor(Thttpd* thttpd, Mode mode);
+  Result<void> Init();
+  void NotifyEvent(absl::string_view event);
+  // Returns false if there was nothing to accept.
+  bool AcceptNewClient();
+  void AddClient(ScopedFd conn_sock, const sockaddr_storage& remote_addr);
+  void HandleEvents();
+  void HandleClient(int fd, uint32_t epoll_events);
+  void HandleFileChanges();
+
+  // io_uring counterparts of the above.
+  Result<void> RunIoUring();
+  // Queue multishot requests, which go on until they fail or are canceled.
+  // Their completions carry |user_data|.
+  void SubmitMultishotAccept();
+  void SubmitMultishotPoll(int fd, uint32_t events, uint64_t user_data);
+  void SubmitMultishotRecv(int fd, uint64_t user_data);
+  void HandleCompletion(const io_uring_cqe& cqe);
+  void HandleAcceptCompletion(const io_uring_cqe& cqe);
+  void HandleRecvCompletion(uint64_t conn_id, const io_uring_cqe& cqe);
+
+  Thttpd* const thttpd_;
+  const Mode mode_;
+
+  // Only set in |Mode::kInline|.
+  std::shared_ptr<TaskRunner> task_runner_;
+
+  ScopedFd listen_fd_;
+  // Exactly one of these is set.
+  ScopedFd epoll_fd_;
+  std::unique_ptr<IoUring> io_uring_;
+
+  FileWatcher* file_watcher_ = nullptr;
+
+  // Used for notifying the loop of events.
+  ScopedFd event_read_fd_;
+  ScopedFd event_write_fd_;
+  MpscQueue<int> closed_fds_;
+
+  std::atomic<bool> stopped_{false};
+
+  absl::flat_hash_map<int, std::shared_ptr<RequestHandler>> conn_fd_to_handler_;
+
+  // io_uring completions name connections by id, since fds are reused while
+  // requests on a closed connection are still being canceled.
+  uint64_t next_conn_id_ = 0;
+  absl::flat_hash_map<uint64_t, int> conn_id_to_fd_;
+  absl::flat_hash_map<int, uint64_t> conn_fd_to_id_;
+};
+
+#endif  // MAIN_REACTOR_H_
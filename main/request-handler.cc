@@ -2,30 +2,83 @@
 
 #include <errno.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
-#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <utility>
 
+#include "absl/container/inlined_vector.h"
+#include "absl/memory/memory.h"
+#include "base/file-reader.h"
 #include "base/logging.h"
-#include "base/util.h"
+#include "base/zlib-deflate-reader.h"
+#include "main/conditional-request.h"
 #include "main/content-type.h"
 #include "main/http-response.h"
+#include "main/reactor.h"
 #include "main/thttpd.h"
 
 namespace {
 
-constexpr char kIndexHtml[] = "/index.html";
-constexpr char kMsgTerminater[] = "\r\n";
+// Stop batching responses to pipelined requests past this size.
+constexpr size_t kMaxBatchedResponseBytes = 256 * 1024;
+
+// Smaller files gain too little from compression to be worth it.
+constexpr size_t kMinCompressSize = 256;
+
+// A client sending more than this without reading the responses is dropped,
+// since io_uring receives for it regardless.
+constexpr size_t kMaxReceivedBytes = 1024 * 1024;
+
+// Room in |tx_buf_| for the framing of a chunk: its size in hex and line
+// breaks.
+constexpr size_t kChunkHeaderSpace = 2 * sizeof(size_t) + 2;
+constexpr size_t kChunkEndSpace = 2;
+
+// Codings to offer for compressible content, most preferred first.
+constexpr content_encoding::Encoding kCompressedEncodings[] = {
+    content_encoding::Encoding::kGzip,
+};
+
+// Gzips a file as it's read, in a fixed amount of memory.
+class GzipFileReader : public Reader {
+ public:
+  // Reads the version of |file| which was looked up, even if it was replaced
+  // since.
+  static Result<std::unique_ptr<GzipFileReader>> Create(
+      const FileCache::Entry& file, int level) {
+    auto ret = absl::WrapUnique(new GzipFileReader(
+        TRY(FileReader::CreateFromFd(*file.fd, file.size, file.path))));
+    ret->zlib_reader_ =
+        TRY(ZlibDeflateReader::Create(&ret->file_reader_, level));
+    return ret;
+  }
+
+  // Reader implementation:
+  Result<ssize_t> Read(absl::Span<char> buf) override {
+    return zlib_reader_->Read(buf);
+  }
+
+ private:
+  explicit GzipFileReader(FileReader file_reader)
+      : file_reader_(std::move(file_reader)) {}
+
+  FileReader file_reader_;
+  std::unique_ptr<ZlibDeflateReader> zlib_reader_;
+};
 
 }  // namespace
 
 RequestHandler::RequestHandler(absl::string_view client_ip, Thttpd* thttpd,
-                               TaskRunner* task_runner, ScopedFd fd)
+                               Reactor* reactor, TaskRunner* task_runner,
+                               ScopedFd fd)
     : client_ip_(client_ip),
       thttpd_(thttpd),
+      reactor_(reactor),
       task_runner_(task_runner),
       fd_(std::move(fd)) {}
 
@@ -33,17 +86,46 @@ void RequestHandler::Init(std::shared_ptr<RequestHandler> shared_this) {
   shared_this_ = std::move(shared_this);
 }
 
-void RequestHandler::HandleUpdate(bool can_read, bool can_write) {
+void RequestHandler::HandleUpdate(bool can_read, bool can_write,
+                                  bool peer_closed) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  // Edges only report what changed. The flags are cleared once a syscall
+  // returns EAGAIN.
+  can_read_ = can_read_ || can_read;
+  can_write_ = can_write_ || can_write;
+  peer_closed_ = peer_closed_ || peer_closed;
+  Run();
+}
+
+void RequestHandler::HandleReceived(absl::string_view data) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  if (state_ == State::kSocketClosed) {
+    return;
+  }
+
+  if (data.empty()) {
+    peer_closed_ = true;
+  } else if (received_.size() + data.size() > kMaxReceivedBytes) {
+    VLOG(1) << "Too much data received from " << client_ip_;
+    state_ = CloseSocket();
+    return;
+  }
+  received_.append(data.data(), data.size());
+  can_read_ = true;
+  Run();
+}
+
+void RequestHandler::HandleWritable() {
   ABSL_ASSERT(task_runner_->IsCurrentThread());
-  can_read_ = can_read;
-  can_write_ = can_write;
+  can_write_ = true;
   Run();
 }
 
 void RequestHandler::Run() {
   ABSL_ASSERT(task_runner_->IsCurrentThread());
-  State old_state = state_;
+  State old_state;
   do {
+    old_state = state_;
     switch (state_) {
       case State::kPendingRequest:
         state_ = HandlePendingRequest();
@@ -58,20 +140,53 @@ void RequestHandler::Run() {
       case State::kSendingResponseBody:
         state_ = HandleSendingResponseBody();
         break;
+      case State::kWaitingForResponseBody:
+        return;
+      case State::kSendingFileBody:
+        state_ = HandleSendingFileBody();
+        break;
       case State::kSocketClosed:
         return;
     }
   } while (state_ != old_state);
 }
 
-Result<bool> RequestHandler::WriteBytes(const char* source) {
+ssize_t RequestHandler::Receive(absl::Span<char> buf) {
+  if (reactor_->backend() == Reactor::Backend::kEpoll) {
+    return recv(*fd_, buf.data(), buf.size(), /*flags=*/0);
+  }
+
+  if (received_.empty()) {
+    if (peer_closed_) {
+      return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+  size_t size = std::min(buf.size(), received_.size());
+  memcpy(buf.data(), received_.data(), size);
+  received_.erase(0, size);
+  return size;
+}
+
+RequestHandler::State RequestHandler::CloseSocket() {
+  ResetResponseBody();
+  response_header_string_.clear();
+  response_header_offset_ = 0;
+  shared_this_.reset();
+  reactor_->NotifySocketClosed(*fd_);
+  return State::kSocketClosed;
+}
+
+Result<bool> RequestHandler::WriteBytes(const char* source, bool more) {
   ABSL_ASSERT(task_runner_->IsCurrentThread());
   ssize_t remain_bytes = tx_buf_bytes_ - tx_buf_offset_;
   ssize_t sent = send(*fd_, source + tx_buf_offset_, remain_bytes,
-                      MSG_NOSIGNAL | MSG_DONTWAIT);
+                      MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
   if (sent < 0) {
     if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      return 0;
+      can_write_ = false;
+      return false;
     }
 
     return BuildPosixErr("send failed");
@@ -82,15 +197,42 @@ Result<bool> RequestHandler::WriteBytes(const char* source) {
 
 RequestHandler::State RequestHandler::HandlePendingRequest() {
   ABSL_ASSERT(task_runner_->IsCurrentThread());
-  if (!can_read_) {
-    return state_;
-  }
   while (true) {
-    char buf[BUFSIZ];
-    ssize_t ret = recv(*fd_, buf, sizeof(buf) - 1, /*flags=*/0);
+    // Serve requests that are already parsed first, they may have been
+    // pipelined. Responses which are entirely in memory are batched in
+    // |response_header_string_| and sent together.
+    while (!closing_ && request_parser_.HasRequest() &&
+           response_header_string_.size() < kMaxBatchedResponseBytes) {
+      State state = HandleRequest(request_parser_.PopRequest());
+      if (state != State::kPendingRequest) {
+        return state;
+      }
+    }
+    // The requests parsed before an invalid one were answered. What follows
+    // can't be framed, so the connection ends.
+    if (!closing_ && bad_request_ && !request_parser_.HasRequest()) {
+      AppendErrorResponse(HttpResponse::Code::kBadRequest);
+      closing_ = true;
+    }
+    if (!response_header_string_.empty()) {
+      return StartSendingResponseHeader();
+    }
+    if (closing_) {
+      shutdown(*fd_, SHUT_WR);
+      return CloseSocket();
+    }
+
+    if (!can_read_) {
+      return state_;
+    }
+
+    // Receive straight into the parser's buffer.
+    absl::Span<char> buf = request_parser_.GetWriteBuffer();
+    ssize_t ret = Receive(buf);
     bool failed = ret < 0;
     if (failed) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        can_read_ = false;
         return State::kPendingRequest;
       }
       LOG(ERR) << "recv failed: " << strerror(errno);
@@ -98,140 +240,426 @@ RequestHandler::State RequestHandler::HandlePendingRequest() {
 
     // Socket was closed.
     if (failed || ret == 0) {
-      shared_this_.reset();
-      thttpd_->NotifySocketClosed(*fd_);
-      return State::kSocketClosed;
+      return CloseSocket();
     }
 
-    auto state = request_parser_.AddData({buf, static_cast<size_t>(ret)});
-    switch (state) {
-      case RequestParser::State::kInvalid:
-        // TODO(bcf): Send 400 error.
-        VLOG(1) << "Parsing request failed";
-        return State::kPendingRequest;
-      case RequestParser::State::kPending:
-        continue;
-      case RequestParser::State::kReady:
-        break;
+    // A short read means the socket is drained, so skip the recv() which
+    // would just return EAGAIN. More data will trigger a new edge. Not so
+    // once the peer shut down, which triggers no more edges: the next recv()
+    // returns 0.
+    if (static_cast<size_t>(ret) < buf.size() && !peer_closed_) {
+      can_read_ = false;
     }
 
-    HttpRequest request = request_parser_.GetRequestAndReset();
-    VLOG(2) << "Got request:\n" << request;
-    if (request.method != HttpRequest::Method::kGet) {
-      VLOG(1) << "Unsupported method: " << request.method;
-      // TODO(bcf): Send 400 error.
-      return State::kPendingRequest;
+    auto state = request_parser_.CommitWrite(ret);
+    if (state == RequestParser::State::kInvalid) {
+      VLOG(1) << "Parsing request failed";
+      bad_request_ = true;
     }
+  }
+}
 
-    const std::string& served_path = thttpd_->config().path_to_serve;
+void RequestHandler::AppendErrorResponse(HttpResponse::Code code) {
+  // Only a 400 ends the connection, the other errors answer a request which
+  // was framed.
+  bool keep_alive = code != HttpResponse::Code::kBadRequest;
+  HttpResponse::AppendStatusLine(code, &response_header_string_, keep_alive);
+  HttpResponse::AppendHeader("Content-Length", 0, &response_header_string_);
+  HttpResponse::AppendEnd(&response_header_string_);
+}
 
-    std::string request_file_path = served_path + request.target;
-    auto path_or = util::CanonicalizePath(request_file_path);
-    if (!path_or.ok()) {
-      VLOG(1) << path_or.err();
-      // TODO(bcf): Send 400 error.
-      return State::kPendingRequest;
+RequestHandler::State RequestHandler::HandleRequest(
+    const HttpRequest& request) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  VLOG(2) << "Got request:\n" << request;
+  // A body is never read, so the next request can't be found after it.
+  if (request.method != HttpRequest::Method::kGet || request.HasBody()) {
+    VLOG(1) << "Unsupported request: " << request.method;
+    AppendErrorResponse(HttpResponse::Code::kBadRequest);
+    closing_ = true;
+    return State::kPendingRequest;
+  }
+
+  auto file_or = thttpd_->file_cache()->Lookup(request.target);
+  if (!file_or.ok()) {
+    VLOG(1) << file_or.err();
+    AppendErrorResponse(HttpResponse::Code::kNotFound);
+    return State::kPendingRequest;
+  }
+  std::shared_ptr<const FileCache::Entry> file = std::move(*file_or);
+
+  absl::string_view content_type = ContentType::ForFilename(file->path);
+
+  // Encoded representations come from sidecars, or from compressing
+  // compressible content at runtime. Ranges are always served from the
+  // identity representation.
+  absl::InlinedVector<content_encoding::Encoding, 4> encodings;
+  for (const auto& sidecar : file->sidecars) {
+    encodings.push_back(sidecar.encoding);
+  }
+  if (file->size >= kMinCompressSize &&
+      ContentType::ShouldCompress(content_type)) {
+    for (auto encoding : kCompressedEncodings) {
+      if (!file->FindSidecar(encoding)) {
+        encodings.push_back(encoding);
+      }
     }
-    request_file_path = std::move(*path_or);
-    if (request_file_path.compare(0, served_path.size(), served_path) != 0) {
-      VLOG(1) << "Requested file not inside of path_to_serve: "
-              << request_file_path;
-      // TODO(bcf): Send 400 error.
-      return State::kPendingRequest;
+  }
+  bool vary = !encodings.empty();
+  auto encoding = content_encoding::Encoding::kIdentity;
+  if (vary && request.header(HttpRequest::Header::kRange).empty()) {
+    encoding = content_encoding::Select(
+        request.header(HttpRequest::Header::kAcceptEncoding), encodings);
+  }
+
+  const FileCache::Entry::Sidecar* sidecar = file->FindSidecar(encoding);
+  std::string encoded_etag;
+  absl::string_view etag = file->etag;
+  if (sidecar) {
+    etag = sidecar->etag;
+  } else if (encoding != content_encoding::Encoding::kIdentity) {
+    encoded_etag = content_encoding::ETag(file->etag, encoding);
+    etag = encoded_etag;
+  }
+
+  if (conditional_request::IsNotModified(request, etag, file->mtime)) {
+    HttpResponse::AppendStatusLine(HttpResponse::Code::kNotModified,
+                                   &response_header_string_);
+    AppendRepresentationHeaders(*file, etag, vary, &response_header_string_);
+    HttpResponse::AppendEnd(&response_header_string_);
+    return State::kPendingRequest;
+  }
+
+  if (encoding == content_encoding::Encoding::kIdentity) {
+    auto ranges = byte_range::ForRequest(request, file->size, file->etag,
+                                         file->last_modified);
+    if (ranges) {
+      return SendRanges(std::move(file), content_type, vary, *ranges);
     }
 
-    struct stat stat_buf;
-    if (stat(request_file_path.c_str(), &stat_buf) < 0) {
-      VLOG(1) << "Failed to stat " << request_file_path << ": "
-              << strerror(errno);
-      // TODO(bcf): Send 404 error.
+    return SendIdentity(std::move(file), content_type, vary);
+  }
+
+  if (sidecar) {
+    return SendSidecar(std::move(file), content_type, *sidecar);
+  }
+
+  ResponseCache* response_cache = thttpd_->response_cache();
+  if (response_cache->ShouldCache(*file)) {
+    auto cached_response = response_cache->Lookup(*file, encoding);
+    if (cached_response) {
+      AppendCachedResponse(*cached_response);
       return State::kPendingRequest;
     }
+  }
 
-    if (S_ISDIR(stat_buf.st_mode)) {
-      request_file_path += kIndexHtml;
-      if (stat(request_file_path.c_str(), &stat_buf) < 0) {
-        VLOG(1) << "Failed to stat " << request_file_path << ": "
-                << strerror(errno);
-        // TODO(bcf): Send 404 error.
-        return State::kPendingRequest;
-      }
+  // HTTP/1.0 recipients don't understand chunked. rfc7230 - 3.3.1
+  bool can_chunk = request.version != "HTTP/1.0";
+  if (!thttpd_->compression_cache()->ShouldCache(*file)) {
+    if (!can_chunk) {
+      return SendIdentity(std::move(file), content_type, vary);
     }
+    return SendEncodedStream(std::move(file), content_type, encoding, etag);
+  }
 
-    absl::string_view content_type =
-        ContentType::ForFilename(request_file_path);
+  // The header is finished once the encoded size is known.
+  response_start_ = response_header_string_.size();
+  std::string* header = &response_header_string_;
+  HttpResponse::AppendStatusLine(HttpResponse::Code::kOk, header);
+  HttpResponse::AppendHeader("Content-Type", content_type, header);
+  HttpResponse::AppendHeader("Content-Encoding",
+                             content_encoding::Name(encoding), header);
+  AppendRepresentationHeaders(*file, etag, vary, header);
+
+  // Cache hits come back before |RequestFile| returns, and files encoded on
+  // this thread come back on it, neither needs a task.
+  absl::optional<Result<CompressionCache::File>> hit;
+  compressed_hit_ = &hit;
+  thttpd_->compression_cache()->RequestFile(
+      file, encoding,
+      [self = shared_this_, file, encoding, can_chunk](auto encoded) {
+        if (!self->task_runner_->IsCurrentThread()) {
+          self->task_runner_->PostTask(
+              BindOnce(&RequestHandler::OnCompressedFileRead, self, file,
+                       encoding, can_chunk, std::move(encoded)));
+        } else if (self->compressed_hit_) {
+          self->compressed_hit_->emplace(std::move(encoded));
+        } else {
+          self->OnCompressedFileRead(file, encoding, can_chunk,
+                                     std::move(encoded));
+        }
+      });
+  compressed_hit_ = nullptr;
+  if (hit) {
+    return OpenCompressedFile(std::move(file), encoding, can_chunk,
+                              std::move(*hit));
+  }
+  return State::kOpeningCompressedStream;
+}
 
-    response_header_fields_.emplace("Content-Type", std::string(content_type));
-    auto modified_date = HttpResponse::FormatTime(stat_buf.st_mtime);
-    if (!modified_date.ok()) {
-      VLOG(1) << "Failed to generate Last-Modified";
-    } else {
-      response_header_fields_.emplace("Last-Modified",
-                                      std::move(*modified_date));
+RequestHandler::State RequestHandler::OpenCompressedFile(
+    std::shared_ptr<const FileCache::Entry> source,
+    content_encoding::Encoding encoding, bool can_chunk,
+    Result<CompressionCache::File> file) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  absl::string_view content_type = ContentType::ForFilename(source->path);
+  if (!file.ok() || (!file->complete() && !can_chunk)) {
+    if (!file.ok()) {
+      VLOG(1) << "Compression failed: " << file.err();
     }
+    // Fall back to the identity representation.
+    response_header_string_.resize(response_start_);
+    return SendIdentity(std::move(source), content_type, /*vary=*/true);
+  }
+
+  // Follow the encoder, the length isn't known yet.
+  if (!file->complete()) {
+    HttpResponse::AppendHeader("Transfer-Encoding", "chunked",
+                               &response_header_string_);
+    HttpResponse::AppendEnd(&response_header_string_);
+    auto reader = absl::make_unique<CompressionCache::File>(std::move(*file));
+    encoding_file_ = reader.get();
+    reader_ = std::move(reader);
+    chunked_ = true;
+    return State::kStreamOpened;
+  }
 
-    // TODO(bcf): Enable compression.
-    if (false && ContentType::ShouldCompress(content_type)) {
-      thttpd_->compression_cache()->RequestFile(
-          request_file_path, [self = shared_this_](auto file) {
-            self->task_runner_->PostTask(
-                BindOnce(&RequestHandler::OnCompressedFileRead, self.get(),
-                         std::move(file)));
-          });
-      return State::kOpeningCompressedStream;
+  HttpResponse::AppendHeader("Content-Length", file->size(),
+                             &response_header_string_);
+  HttpResponse::AppendEnd(&response_header_string_);
+
+  ResponseCache* response_cache = thttpd_->response_cache();
+  if (response_cache->ShouldCache(*source)) {
+    std::string header = response_header_string_.substr(response_start_);
+    response_header_string_.resize(response_start_);
+    auto response_or =
+        ResponseCache::Build(*source, std::move(header), &*file, file->size());
+    if (response_or.ok()) {
+      response_cache->Insert(*source, encoding, *response_or);
+      AppendCachedResponse(**response_or);
+      return State::kPendingRequest;
     }
+    VLOG(1) << response_or.err();
+    return SendIdentity(std::move(source), content_type, /*vary=*/true);
+  }
+
+  // Send the sealed encoding straight from the cache.
+  file_segments_ = {{"", 0, static_cast<off_t>(file->size())}};
+  cur_file_segment_ = 0;
+  file_fd_ = file->fd();
+  file_ = std::move(source);
+  encoded_file_ = std::move(*file);
+  return StartSendingResponseHeader();
+}
 
-    auto file_or = FileReader::Create(request_file_path);
-    if (!file_or.ok()) {
-      VLOG(1) << "Requested file not found: " << request_file_path;
-      // TODO(bcf): Send 400 error.
+void RequestHandler::OnCompressedFileRead(
+    std::shared_ptr<const FileCache::Entry> source,
+    content_encoding::Encoding encoding, bool can_chunk,
+    Result<CompressionCache::File> file) {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  // The socket may have been closed meanwhile, e.g. by a flood of pipelined
+  // requests.
+  if (state_ == State::kSocketClosed) {
+    return;
+  }
+  ABSL_ASSERT(state_ == State::kOpeningCompressedStream);
+  state_ = OpenCompressedFile(std::move(source), encoding, can_chunk,
+                              std::move(file));
+  Run();
+}
+
+// static
+void RequestHandler::AppendRepresentationHeaders(const FileCache::Entry& file,
+                                                 absl::string_view etag,
+                                                 bool vary, std::string* out) {
+  HttpResponse::AppendHeader("ETag", etag, out);
+  if (!file.last_modified.empty()) {
+    HttpResponse::AppendHeader("Last-Modified", file.last_modified, out);
+  }
+  if (vary) {
+    HttpResponse::AppendHeader("Vary", "Accept-Encoding", out);
+  }
+}
+
+void RequestHandler::AppendCachedResponse(
+    const ResponseCache::Response& response) {
+  size_t start = response_header_string_.size();
+  response_header_string_ += response.data;
+  if (response.date_length > 0) {
+    absl::string_view date = HttpResponse::CurrentDate();
+    if (date.size() == response.date_length) {
+      response_header_string_.replace(start + response.date_offset,
+                                      response.date_length, date.data(),
+                                      date.size());
+    }
+  }
+}
+
+RequestHandler::State RequestHandler::StartSendingResponseHeader() {
+  // Set up variables for next state.
+  response_header_offset_ = 0;
+  tx_buf_offset_ = 0;
+  tx_buf_bytes_ = 0;
+
+  return State::kSendingResponseHeader;
+}
+
+RequestHandler::State RequestHandler::SendIdentity(
+    std::shared_ptr<const FileCache::Entry> file,
+    absl::string_view content_type, bool vary) {
+  ResponseCache* response_cache = thttpd_->response_cache();
+  bool use_response_cache = response_cache->ShouldCache(*file);
+  if (use_response_cache) {
+    auto cached_response =
+        response_cache->Lookup(*file, content_encoding::Encoding::kIdentity);
+    if (cached_response) {
+      AppendCachedResponse(*cached_response);
       return State::kPendingRequest;
     }
+  }
 
-    response_header_fields_.emplace("Content-Length",
-                                    absl::StrCat(file_or->size()));
+  // A response for |ResponseCache| needs a header of its own.
+  std::string cached_header;
+  std::string* header =
+      use_response_cache ? &cached_header : &response_header_string_;
+  HttpResponse::AppendStatusLine(HttpResponse::Code::kOk, header);
+  HttpResponse::AppendHeader("Content-Type", content_type, header);
+  HttpResponse::AppendHeader("Accept-Ranges", "bytes", header);
+  AppendRepresentationHeaders(*file, file->etag, vary, header);
+  HttpResponse::AppendHeader("Content-Length", file->size, header);
+  HttpResponse::AppendEnd(header);
+
+  if (use_response_cache) {
+    auto response_or = ResponseCache::Build(*file, std::move(cached_header));
+    if (!response_or.ok()) {
+      VLOG(1) << response_or.err();
+      AppendErrorResponse(HttpResponse::Code::kInternalServerError);
+      return State::kPendingRequest;
+    }
+    response_cache->Insert(*file, content_encoding::Encoding::kIdentity,
+                           *response_or);
+    AppendCachedResponse(**response_or);
+    return State::kPendingRequest;
+  }
 
-    reader_ = absl::make_unique<FileReader>(std::move(*file_or));
+  file_segments_ = {{"", 0, static_cast<off_t>(file->size)}};
+  cur_file_segment_ = 0;
+  file_fd_ = *file->fd;
+  file_ = std::move(file);
 
-    return State::kStreamOpened;
+  return StartSendingResponseHeader();
+}
+
+RequestHandler::State RequestHandler::SendSidecar(
+    std::shared_ptr<const FileCache::Entry> file,
+    absl::string_view content_type,
+    const FileCache::Entry::Sidecar& sidecar) {
+  std::string* header = &response_header_string_;
+  HttpResponse::AppendStatusLine(HttpResponse::Code::kOk, header);
+  HttpResponse::AppendHeader("Content-Type", content_type, header);
+  HttpResponse::AppendHeader("Content-Encoding",
+                             content_encoding::Name(sidecar.encoding), header);
+  AppendRepresentationHeaders(*file, sidecar.etag, /*vary=*/true, header);
+  HttpResponse::AppendHeader("Content-Length", sidecar.size, header);
+  HttpResponse::AppendEnd(header);
+
+  // |file_| keeps |sidecar| alive.
+  file_segments_ = {{"", 0, static_cast<off_t>(sidecar.size)}};
+  cur_file_segment_ = 0;
+  file_fd_ = *sidecar.fd;
+  file_ = std::move(file);
+
+  return StartSendingResponseHeader();
+}
+
+RequestHandler::State RequestHandler::SendEncodedStream(
+    std::shared_ptr<const FileCache::Entry> file,
+    absl::string_view content_type, content_encoding::Encoding encoding,
+    absl::string_view etag) {
+  ABSL_ASSERT(encoding == content_encoding::Encoding::kGzip);
+  // The output isn't kept, so it's compressed fast.
+  auto reader = GzipFileReader::Create(
+      *file, thttpd_->compression_policy()->Level(/*will_cache=*/false));
+  if (!reader.ok()) {
+    VLOG(1) << "Compression failed: " << reader.err();
+    return SendIdentity(std::move(file), content_type, /*vary=*/true);
   }
 
-  // Shouldn't reach here.
-  ABSL_ASSERT(false);
-  return State::kPendingRequest;
+  response_start_ = response_header_string_.size();
+  std::string* header = &response_header_string_;
+  HttpResponse::AppendStatusLine(HttpResponse::Code::kOk, header);
+  HttpResponse::AppendHeader("Content-Type", content_type, header);
+  HttpResponse::AppendHeader("Content-Encoding",
+                             content_encoding::Name(encoding), header);
+  AppendRepresentationHeaders(*file, etag, /*vary=*/true, header);
+  HttpResponse::AppendHeader("Transfer-Encoding", "chunked", header);
+  HttpResponse::AppendEnd(header);
+
+  reader_ = std::move(*reader);
+  chunked_ = true;
+  return StartSendingResponseHeader();
 }
 
-void RequestHandler::OnCompressedFileRead(Result<CompressionCache::File> file) {
-  ABSL_ASSERT(task_runner_->IsCurrentThread());
-  if (file.ok()) {
-    response_header_fields_.emplace("Content-Length",
-                                    absl::StrCat(file->size()));
-    reader_ = absl::make_unique<CompressionCache::File>(std::move(*file));
-    state_ = State::kStreamOpened;
+RequestHandler::State RequestHandler::SendRanges(
+    std::shared_ptr<const FileCache::Entry> file,
+    absl::string_view content_type, bool vary,
+    const std::vector<byte_range::Range>& ranges) {
+  off_t size = file->size;
+  std::string* header = &response_header_string_;
+
+  if (ranges.empty()) {
+    HttpResponse::AppendStatusLine(HttpResponse::Code::kRangeNotSatisfiable,
+                                   header);
+    AppendRepresentationHeaders(*file, file->etag, vary, header);
+    HttpResponse::AppendHeader("Content-Range",
+                               byte_range::ContentRange(nullptr, size), header);
+    HttpResponse::AppendHeader("Content-Length", 0, header);
+    HttpResponse::AppendEnd(header);
+    return State::kPendingRequest;
+  }
+
+  HttpResponse::AppendStatusLine(HttpResponse::Code::kPartialContent, header);
+  AppendRepresentationHeaders(*file, file->etag, vary, header);
+
+  file_segments_.clear();
+  cur_file_segment_ = 0;
+  off_t content_length = 0;
+  if (ranges.size() == 1) {
+    const byte_range::Range& range = ranges.front();
+    HttpResponse::AppendHeader("Content-Type", content_type, header);
+    HttpResponse::AppendHeader("Content-Range",
+                               byte_range::ContentRange(&range, size), header);
+    file_segments_.push_back({"", range.first, range.last + 1});
+    content_length = range.length();
   } else {
-    // TODO(bcf): Send 400 error.
-    state_ = State::kPendingRequest;
+    std::string boundary = byte_range::MakeBoundary();
+    HttpResponse::AppendHeader(
+        "Content-Type", byte_range::MultipartContentType(boundary), header);
+    for (const auto& range : ranges) {
+      file_segments_.push_back(
+          {byte_range::MultipartPartHeader(boundary, content_type, range,
+                                           size),
+           range.first, range.last + 1});
+      content_length += file_segments_.back().prefix.size() + range.length();
+    }
+    file_segments_.push_back(
+        {byte_range::MultipartCloseDelimiter(boundary), 0, 0});
+    content_length += file_segments_.back().prefix.size();
   }
+  HttpResponse::AppendHeader("Content-Length", content_length, header);
+  HttpResponse::AppendEnd(header);
 
-  Run();
+  file_fd_ = *file->fd;
+  file_ = std::move(file);
+  return StartSendingResponseHeader();
 }
 
 RequestHandler::State RequestHandler::HandleStreamOpened() {
   ABSL_ASSERT(task_runner_->IsCurrentThread());
   ABSL_ASSERT(reader_);
-  auto response = HttpResponse::BuildWithDefaultHeaders(
-      HttpResponse::Code::kOk, response_header_fields_);
-  response_header_fields_.clear();
-
-  std::ostringstream oss;
-  oss << response;
-
-  // Set up variables for next state.
-  response_header_string_ = oss.str();
-  tx_buf_offset_ = 0;
-  tx_buf_bytes_ = response_header_string_.size();
 
-  return State::kSendingResponseHeader;
+  // Responses batched before this one are sent along with its header.
+  return StartSendingResponseHeader();
 }
 
 RequestHandler::State RequestHandler::HandleSendingResponseHeader() {
@@ -240,25 +668,124 @@ RequestHandler::State RequestHandler::HandleSendingResponseHeader() {
     return state_;
   }
 
-  ABSL_ASSERT(tx_buf_bytes_ == response_header_string_.size());
-  while (tx_buf_offset_ < tx_buf_bytes_) {
-    auto send_result = WriteBytes(response_header_string_.data());
-    if (!send_result.ok()) {
-      LOG(ERR) << send_result.err();
-      // TODO(bcf): Send 500 error.
-      return State::kPendingRequest;
+  // Read the first chunk of a streamed body so it goes out in the same
+  // sendmsg() as the header.
+  if (reader_ && tx_buf_bytes_ == 0) {
+    auto num_read = ReadBody();
+    if (!num_read.ok()) {
+      VLOG(1) << "Read failed: " << num_read.err();
+      // Once part of the header is out, the response can't be replaced.
+      if (response_header_offset_ > response_start_) {
+        return CloseSocket();
+      }
+      ResetResponseBody();
+      response_header_string_.resize(response_start_);
+      std::string* header = &response_header_string_;
+      HttpResponse::AppendStatusLine(HttpResponse::Code::kInternalServerError,
+                                     header);
+      HttpResponse::AppendHeader("Content-Length", 0, header);
+      HttpResponse::AppendEnd(header);
+    } else if (*num_read == -1) {  // EOF
+      reader_.reset();
     }
+  }
 
-    if (!*send_result) {
-      return state_;
+  // sendfile() bodies can't share a syscall with the header. MSG_MORE lets
+  // the kernel still put them in the same packets. The last sendfile() chunk
+  // pushes the data out. What follows is |file_segments_|, which may be a
+  // range, a sidecar or an encoding of |file_|, so its size is what counts.
+  bool more =
+      file_ && std::any_of(file_segments_.begin(), file_segments_.end(),
+                           [](const FileSegment& segment) {
+                             return !segment.prefix.empty() ||
+                                    segment.offset < segment.end;
+                           });
+  while (response_header_offset_ < response_header_string_.size()) {
+    size_t header_remain =
+        response_header_string_.size() - response_header_offset_;
+    iovec iov[] = {
+        {&response_header_string_[response_header_offset_], header_remain},
+        {tx_buf_ + tx_buf_offset_, tx_buf_bytes_ - tx_buf_offset_},
+    };
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+    ssize_t sent = sendmsg(*fd_, &msg,
+                           MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        can_write_ = false;
+        return state_;
+      }
+
+      LOG(ERR) << "sendmsg failed: " << strerror(errno);
+      return CloseSocket();
     }
+
+    size_t header_sent = std::min(static_cast<size_t>(sent), header_remain);
+    response_header_offset_ += header_sent;
+    tx_buf_offset_ += sent - header_sent;
   }
   response_header_string_.clear();
+  response_header_offset_ = 0;
 
-  // Set up variables for next state.
-  tx_buf_offset_ = 0;
-  tx_buf_bytes_ = 0;
-  return State::kSendingResponseBody;
+  // |tx_buf_| may still hold the rest of the first body chunk.
+  if (file_) {
+    return State::kSendingFileBody;
+  }
+  if (reader_) {
+    return State::kSendingResponseBody;
+  }
+
+  // Only responses which are entirely in memory.
+  return State::kPendingRequest;
+}
+
+Result<ssize_t> RequestHandler::ReadBody() {
+  if (!chunked_) {
+    ssize_t num_read =
+        TRY(reader_->Read(absl::MakeSpan(tx_buf_, sizeof(tx_buf_))));
+    if (num_read > 0) {
+      tx_buf_offset_ = 0;
+      tx_buf_bytes_ = num_read;
+    }
+    return num_read;
+  }
+
+  if (sent_last_chunk_) {
+    return -1;
+  }
+
+  // Read the data where it's preceded by enough room for the chunk header.
+  ssize_t num_read = TRY(reader_->Read(
+      absl::MakeSpan(tx_buf_ + kChunkHeaderSpace,
+                     sizeof(tx_buf_) - kChunkHeaderSpace - kChunkEndSpace)));
+  if (num_read == 0) {
+    return 0;
+  }
+
+  chunk_framing_.clear();
+  if (num_read == -1) {
+    sent_last_chunk_ = true;
+    HttpResponse::AppendLastChunk(&chunk_framing_);
+    memcpy(tx_buf_, chunk_framing_.data(), chunk_framing_.size());
+    tx_buf_offset_ = 0;
+    tx_buf_bytes_ = chunk_framing_.size();
+    return tx_buf_bytes_;
+  }
+
+  HttpResponse::AppendChunkHeader(num_read, &chunk_framing_);
+  tx_buf_offset_ = kChunkHeaderSpace - chunk_framing_.size();
+  memcpy(tx_buf_ + tx_buf_offset_, chunk_framing_.data(),
+         chunk_framing_.size());
+  tx_buf_bytes_ = kChunkHeaderSpace + num_read;
+
+  chunk_framing_.clear();
+  HttpResponse::AppendChunkEnd(&chunk_framing_);
+  memcpy(tx_buf_ + tx_buf_bytes_, chunk_framing_.data(),
+         chunk_framing_.size());
+  tx_buf_bytes_ += chunk_framing_.size();
+  return tx_buf_bytes_ - tx_buf_offset_;
 }
 
 RequestHandler::State RequestHandler::HandleSendingResponseBody() {
@@ -270,24 +797,31 @@ RequestHandler::State RequestHandler::HandleSendingResponseBody() {
   while (true) {
     // Read the next chunk of the file.
     if (tx_buf_offset_ == tx_buf_bytes_) {
-      auto num_read = reader_->Read(absl::MakeSpan(tx_buf_, sizeof(tx_buf_)));
+      auto num_read = ReadBody();
       if (!num_read.ok()) {
+        // The header is out, so the client has to see the connection close.
         VLOG(1) << "Read failed: " << num_read.err();
-        // TODO(bcf): Send 500
-        return State::kPendingRequest;
+        return CloseSocket();
       }
       if (*num_read == -1) {  // EOF
         break;
       }
-      tx_buf_offset_ = 0;
-      tx_buf_bytes_ = *num_read;
+      // Caught up with the encoder.
+      if (*num_read == 0) {
+        ABSL_ASSERT(encoding_file_);
+        encoding_file_->NotifyWhenReadable([self = shared_this_] {
+          TaskRunner* task_runner = self->task_runner_;
+          task_runner->PostTask(BindOnce(
+              &RequestHandler::OnResponseBodyReadable, std::move(self)));
+        });
+        return State::kWaitingForResponseBody;
+      }
     }
 
-    auto send_result = WriteBytes(tx_buf_);
+    auto send_result = WriteBytes(tx_buf_, /*more=*/false);
     if (!send_result.ok()) {
       LOG(ERR) << send_result.err();
-      // TODO(bcf): Send 500 error.
-      return State::kPendingRequest;
+      return CloseSocket();
     }
 
     if (!*send_result) {
@@ -295,9 +829,88 @@ RequestHandler::State RequestHandler::HandleSendingResponseBody() {
     }
   }
 
-  // Clear state and get ready for next request.
+  // Get ready for next request.
+  ResetResponseBody();
+  return State::kPendingRequest;
+}
+
+void RequestHandler::OnResponseBodyReadable() {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  if (state_ == State::kSocketClosed) {
+    return;
+  }
+  ABSL_ASSERT(state_ == State::kWaitingForResponseBody);
+  state_ = State::kSendingResponseBody;
+  Run();
+}
+
+RequestHandler::State RequestHandler::HandleSendingFileBody() {
+  ABSL_ASSERT(task_runner_->IsCurrentThread());
+  if (!can_write_) {
+    return state_;
+  }
+
+  while (cur_file_segment_ < file_segments_.size()) {
+    FileSegment& segment = file_segments_[cur_file_segment_];
+    if (tx_buf_offset_ < segment.prefix.size()) {
+      tx_buf_bytes_ = segment.prefix.size();
+      // Everything but the final multipart delimiter is followed by more.
+      bool more = segment.offset < segment.end ||
+                  cur_file_segment_ + 1 < file_segments_.size();
+      auto send_result = WriteBytes(segment.prefix.data(), more);
+      if (!send_result.ok()) {
+        LOG(ERR) << send_result.err();
+        return CloseSocket();
+      }
+
+      if (!*send_result) {
+        return state_;
+      }
+    }
+
+    // Let the kernel copy straight from the page cache. sendfile() advances
+    // |segment.offset| by the amount sent.
+    while (segment.offset < segment.end) {
+      ssize_t sent = sendfile(*fd_, file_fd_, &segment.offset,
+                              segment.end - segment.offset);
+      if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          can_write_ = false;
+          return state_;
+        }
+
+        LOG(ERR) << "sendfile failed: " << strerror(errno);
+        return CloseSocket();
+      }
+
+      // The Content-Length sent can't be honored, so the client has to see
+      // the connection close.
+      if (sent == 0) {
+        LOG(ERR) << "File truncated while sending";
+        return CloseSocket();
+      }
+    }
+
+    ++cur_file_segment_;
+    tx_buf_offset_ = 0;
+    tx_buf_bytes_ = 0;
+  }
+
+  // Get ready for next request.
+  ResetResponseBody();
+  return State::kPendingRequest;
+}
+
+void RequestHandler::ResetResponseBody() {
   reader_.reset();
+  encoding_file_ = nullptr;
+  chunked_ = false;
+  sent_last_chunk_ = false;
+  file_.reset();
+  encoded_file_.reset();
+  file_fd_ = -1;
+  file_segments_.clear();
+  cur_file_segment_ = 0;
   tx_buf_offset_ = 0;
   tx_buf_bytes_ = 0;
-  return State::kPendingRequest;
 }
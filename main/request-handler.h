@@ -1,31 +1,44 @@
 #ifndef MAIN_REQUEST_HANDLER_
 #define MAIN_REQUEST_HANDLER_
 
-#include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
 
-#include "base/file-reader.h"
 #include "base/scoped-fd.h"
 #include "base/task-runner.h"
+#include "main/byte-range.h"
 #include "main/compression-cache.h"
+#include "main/content-encoding.h"
+#include "main/file-cache.h"
+#include "main/http-response.h"
 #include "main/request-parser.h"
+#include "main/response-cache.h"
 
+class Reactor;
 class Thttpd;
 
 class RequestHandler {
  public:
   RequestHandler(absl::string_view client_ip, Thttpd* thttpd,
-                 TaskRunner* task_runner, ScopedFd fd);
+                 Reactor* reactor, TaskRunner* task_runner, ScopedFd fd);
   RequestHandler(const RequestHandler&) = delete;
   RequestHandler operator=(const RequestHandler&) = delete;
 
   void Init(std::shared_ptr<RequestHandler> shared_this);
 
-  void HandleUpdate(bool can_read, bool can_write);
+  // With |Reactor::Backend::kEpoll|. |peer_closed| is set once the peer shut
+  // down its side, which may come with the last of its data.
+  void HandleUpdate(bool can_read, bool can_write, bool peer_closed);
+
+  // With |Reactor::Backend::kIoUring|, which receives |data| on our behalf.
+  // Empty |data| means the peer shut down its side.
+  void HandleReceived(absl::string_view data);
+  void HandleWritable();
 
   const std::string client_ip() const { return client_ip_; }
   TaskRunner* task_runner() const { return task_runner_; }
@@ -38,25 +51,82 @@ class RequestHandler {
     kStreamOpened,
     kSendingResponseHeader,
     kSendingResponseBody,
+    kWaitingForResponseBody,
+    kSendingFileBody,
     kSocketClosed,
   };
   void Run();
 
+  // Reads from |fd_| into |buf| like recv(), or from |received_| with
+  // |Reactor::Backend::kIoUring|.
+  ssize_t Receive(absl::Span<char> buf);
+  // Has |reactor_| close |fd_|, once it drops its reference to us. Used when
+  // a response can't be completed, since its header may already be out.
+  State CloseSocket();
+  // Releases what the body of the last response was sent from.
+  void ResetResponseBody();
+
   // Attempt to write bytes to |fd_| from |source|. Assumes that
   // |tx_buf_offset_| is the offset into |source| to write from and
   // |tx_buf_bytes_| is the total number of bytes in |source|.
   // Returns true if all bytes were written.
   // Returns an error if an error happened.
-  Result<bool> WriteBytes(const char* source);
+  // |more| sets MSG_MORE, telling the kernel more data follows right away.
+  Result<bool> WriteBytes(const char* source, bool more);
 
   State HandlePendingRequest();
-  void OnCompressedFileRead(Result<CompressionCache::File> file);
+  // Appends a response with status |code| and no body to
+  // |response_header_string_|. A 400 announces that the connection closes.
+  void AppendErrorResponse(HttpResponse::Code code);
+  // Returns |kPendingRequest| if the response to |request| was entirely
+  // appended to |response_header_string_|, errors included.
+  State HandleRequest(const HttpRequest& request);
+  // |can_chunk| is set if the client understands the chunked transfer coding,
+  // needed to stream a file which is still being encoded.
+  State OpenCompressedFile(std::shared_ptr<const FileCache::Entry> source,
+                           content_encoding::Encoding encoding, bool can_chunk,
+                           Result<CompressionCache::File> file);
+  void OnCompressedFileRead(std::shared_ptr<const FileCache::Entry> source,
+                            content_encoding::Encoding encoding,
+                            bool can_chunk,
+                            Result<CompressionCache::File> file);
+  // Appends the ETag and Last-Modified header fields of a representation of
+  // |file|, and Vary if |vary| because it has several.
+  static void AppendRepresentationHeaders(const FileCache::Entry& file,
+                                          absl::string_view etag, bool vary,
+                                          std::string* out);
+  void AppendCachedResponse(const ResponseCache::Response& response);
+  State StartSendingResponseHeader();
+  // Sets up a 200 response with the identity representation of |file|.
+  State SendIdentity(std::shared_ptr<const FileCache::Entry> file,
+                     absl::string_view content_type, bool vary);
+  // Sets up a 200 response with |sidecar| of |file|.
+  State SendSidecar(std::shared_ptr<const FileCache::Entry> file,
+                    absl::string_view content_type,
+                    const FileCache::Entry::Sidecar& sidecar);
+  // Sets up a 200 response with |file| encoded with |encoding| as it is sent,
+  // in chunks.
+  State SendEncodedStream(std::shared_ptr<const FileCache::Entry> file,
+                          absl::string_view content_type,
+                          content_encoding::Encoding encoding,
+                          absl::string_view etag);
+  // Sets up a 206 or 416 response for |ranges| of |file|.
+  State SendRanges(std::shared_ptr<const FileCache::Entry> file,
+                   absl::string_view content_type, bool vary,
+                   const std::vector<byte_range::Range>& ranges);
   State HandleStreamOpened();
   State HandleSendingResponseHeader();
+  // Reads the next part of the body from |reader_| into |tx_buf_|, framed as
+  // a chunk if |chunked_|. Returns the number of bytes to send, 0 if |reader_|
+  // has to wait for more data, or -1 at the end of the body.
+  Result<ssize_t> ReadBody();
   State HandleSendingResponseBody();
+  void OnResponseBodyReadable();
+  State HandleSendingFileBody();
 
   const std::string client_ip_;
   Thttpd* const thttpd_;
+  Reactor* const reactor_;
   TaskRunner* const task_runner_;
   const ScopedFd fd_;
   std::shared_ptr<RequestHandler> shared_this_;
@@ -64,11 +134,50 @@ class RequestHandler {
   State state_ = State::kPendingRequest;
   bool can_read_ = false;
   bool can_write_ = false;
-
-  std::map<std::string, std::string> response_header_fields_;
+  bool peer_closed_ = false;
+  // Set once the parser rejected the received data. Requests parsed before it
+  // are still answered.
+  bool bad_request_ = false;
+  // Set once the last response was appended; the connection closes after it
+  // is sent.
+  bool closing_ = false;
+  // Data received by io_uring which wasn't parsed yet.
+  std::string received_;
+
+  // Also holds entire responses, e.g. from |ResponseCache|, possibly several
+  // for pipelined requests.
   std::string response_header_string_;
+  size_t response_header_offset_ = 0;
+  // Where the header of a streamed response starts, or of one waiting for
+  // |CompressionCache|. Earlier responses are kept if it's replaced.
+  size_t response_start_ = 0;
+  // Set while |CompressionCache::RequestFile| runs, to take a cache hit.
+  absl::optional<Result<CompressionCache::File>>* compressed_hit_ = nullptr;
+
+  // Part of a body sent from |file_|: |prefix| is sent as is, followed by
+  // bytes [offset, end) of the file.
+  struct FileSegment {
+    std::string prefix;
+    off_t offset = 0;
+    off_t end = 0;
+  };
 
+  // Body is either streamed from |reader_| through |tx_buf_|, or sent
+  // straight from |file_fd_| with sendfile(). |file_fd_| is the descriptor of
+  // |file_|, of one of its sidecars, or of its complete |encoded_file_|.
   std::unique_ptr<Reader> reader_;
+  std::shared_ptr<const FileCache::Entry> file_;
+  absl::optional<CompressionCache::File> encoded_file_;
+  int file_fd_ = -1;
+  // Set if |reader_| is a file which is still being encoded.
+  CompressionCache::File* encoding_file_ = nullptr;
+  // Set if the body is sent with the chunked transfer coding, since its length
+  // isn't known up front.
+  bool chunked_ = false;
+  bool sent_last_chunk_ = false;
+  std::string chunk_framing_;
+  std::vector<FileSegment> file_segments_;
+  size_t cur_file_segment_ = 0;
   char tx_buf_[BUFSIZ];
   size_t tx_buf_offset_ = 0;
   size_t tx_buf_bytes_ = 0;
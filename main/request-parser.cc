@@ -1,159 +1,278 @@
 #include "main/request-parser.h"
 
+#include <string.h>
+
 #include <algorithm>
-#include <locale>
+#include <array>
 
-#include "absl/strings/str_cat.h"
-#include "absl/strings/str_split.h"
+#include "absl/base/macros.h"
+#include "absl/strings/ascii.h"
 #include "base/logging.h"
+#include "main/http-scan.h"
 
 namespace {
 
 constexpr char kLineEnd[] = "\r\n";
 constexpr char kVersionPrefix[] = "HTTP/1";
 
+// The buffer starts at |kInitialBufferSize| and doubles when a request doesn't
+// fit. Requests with heads larger than |kMaxBufferSize| are rejected.
+constexpr size_t kInitialBufferSize = 8 * 1024;
+constexpr size_t kMaxBufferSize = 64 * 1024;
+
+// rfc7230 - 3.2.6.  Field Value Components
+// tchar = "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" / "-" / "." /
+//         "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA
+std::array<bool, 256> BuildTokenChars() {
+  std::array<bool, 256> result{};
+  for (int c = 0; c < 256; ++c) {
+    result[c] = absl::ascii_isalnum(c);
+  }
+  for (unsigned char c : absl::string_view("!#$%&'*+-.^_`|~")) {
+    result[c] = true;
+  }
+  return result;
+}
+
+const std::array<bool, 256> kTokenChars = BuildTokenChars();
+
+bool IsValidFieldName(absl::string_view name) {
+  return !name.empty() &&
+         std::all_of(name.begin(), name.end(), [](unsigned char c) {
+           return kTokenChars[c];
+         });
+}
+
 }  // namespace
 
-RequestParser::State RequestParser::AddData(absl::string_view data) {
-  buf_.append(data.begin(), data.end());
-
-  auto state = State::kPending;
-  size_t offset = 0;
-  while (true) {
-    size_t old_offset = offset;
-    offset = buf_.find(kLineEnd, old_offset);
-    if (offset == std::string::npos) {
-      break;
+absl::Span<char> RequestParser::GetWriteBuffer() {
+  ABSL_ASSERT(!HasRequest());
+
+  // Move the partial request to the front.
+  if (request_start_ > 0) {
+    size_t pending = data_end_ - request_start_;
+    memmove(buf_.get(), buf_.get() + request_start_, pending);
+    line_start_ -= request_start_;
+    scan_offset_ -= request_start_;
+    request_start_ = 0;
+    data_end_ = pending;
+  }
+
+  if (data_end_ == buf_capacity_) {
+    // |CommitWrite| rejects requests which fill a buffer of |kMaxBufferSize|.
+    size_t new_capacity = buf_capacity_ == 0
+                              ? kInitialBufferSize
+                              : std::min(buf_capacity_ * 2, kMaxBufferSize);
+    ABSL_ASSERT(new_capacity > buf_capacity_);
+    std::unique_ptr<char[]> new_buf(new char[new_capacity]);
+    if (data_end_ > 0) {
+      memcpy(new_buf.get(), buf_.get(), data_end_);
     }
+    buf_ = std::move(new_buf);
+    buf_capacity_ = new_capacity;
+  }
+
+  return {buf_.get() + data_end_, buf_capacity_ - data_end_};
+}
 
-    size_t len = offset - old_offset;
-    absl::string_view line(buf_.data() + old_offset, len);
-    offset += strlen(kLineEnd);
+RequestParser::State RequestParser::CommitWrite(size_t size) {
+  data_end_ += size;
+  ABSL_ASSERT(data_end_ <= buf_capacity_);
 
-    state = ProcessLine(line);
-    if (state == State::kInvalid) {
+  // Find line ends and validate in one pass. Any control character other
+  // than HTAB must be the CR of a CRLF.
+  while (scan_offset_ < data_end_) {
+    size_t control =
+        scan_offset_ + http_scan::FindControl({&buf_[scan_offset_],
+                                               data_end_ - scan_offset_});
+    if (control == data_end_) {
+      scan_offset_ = data_end_;
+      break;
+    }
+    if (buf_[control] != '\r') {
+      VLOG(1) << "Invalid character in request: "
+              << static_cast<int>(buf_[control]);
       Reset();
+      return State::kInvalid;
     }
-    if (state != State::kPending) {
+    if (control + 1 == data_end_) {
+      // Wait for the LF.
+      scan_offset_ = control;
       break;
     }
+    if (buf_[control + 1] != '\n') {
+      VLOG(1) << "CR without LF in request";
+      Reset();
+      return State::kInvalid;
+    }
+
+    size_t next_line = control + strlen(kLineEnd);
+    scan_offset_ = next_line;
+    if (control != line_start_) {
+      line_start_ = next_line;
+      continue;
+    }
+
+    // An empty line. rfc7230 - 3.5: Ignore empty lines before a request line.
+    if (line_start_ == request_start_) {
+      request_start_ = line_start_ = next_line;
+      continue;
+    }
+
+    // Otherwise it ends the head.
+    HttpRequest request;
+    absl::string_view head(&buf_[request_start_],
+                           control - strlen(kLineEnd) - request_start_);
+    if (!ParseRequest(head, &request)) {
+      Reset();
+      return State::kInvalid;
+    }
+    ready_requests_.push_back(std::move(request));
+    request_start_ = line_start_ = next_line;
   }
 
-  // Move unused data to the beginning.
-  size_t remain = offset - buf_.size();
-  memcpy(&buf_[0], buf_.data() + offset, remain);
-  buf_.resize(remain);
+  if (data_end_ - request_start_ >= kMaxBufferSize) {
+    VLOG(1) << "Request too large";
+    Reset();
+    return State::kInvalid;
+  }
 
-  return state;
+  return HasRequest() ? State::kReady : State::kPending;
 }
 
-HttpRequest RequestParser::GetRequestAndReset() {
-  auto ret = std::move(current_request_);
-  current_request_ = {};
+RequestParser::State RequestParser::AddData(absl::string_view data) {
+  // Copy everything before parsing, |GetWriteBuffer| can't be called while
+  // requests are queued.
+  while (!data.empty()) {
+    if (data_end_ - request_start_ >= kMaxBufferSize) {
+      VLOG(1) << "Data too large";
+      Reset();
+      return State::kInvalid;
+    }
+
+    absl::Span<char> buf = GetWriteBuffer();
+    size_t size = std::min(buf.size(), data.size());
+    memcpy(buf.data(), data.data(), size);
+    data.remove_prefix(size);
+    data_end_ += size;
+  }
+
+  return CommitWrite(0);
+}
+
+HttpRequest RequestParser::PopRequest() {
+  ABSL_ASSERT(HasRequest());
+  auto ret = std::move(ready_requests_[next_ready_request_++]);
+  if (next_ready_request_ == ready_requests_.size()) {
+    ready_requests_.clear();
+    next_ready_request_ = 0;
+  }
   return ret;
 }
 
 void RequestParser::Reset() {
-  buf_.clear();
-  current_request_ = {};
+  request_start_ = 0;
+  line_start_ = 0;
+  data_end_ = 0;
+  scan_offset_ = 0;
 }
 
-RequestParser::State RequestParser::ProcessLine(absl::string_view line) {
-  bool has_request_line =
-      current_request_.method != HttpRequest::Method::kInvalid;
+bool RequestParser::ParseRequest(absl::string_view head,
+                                 HttpRequest* request) {
+  // |CommitWrite| made sure every CR starts a CRLF.
+  size_t line_end = head.find('\r');
+  if (!ParseRequestLine(head.substr(0, line_end), request)) {
+    return false;
+  }
 
-  // Empty line signals end of the request. It's valid if we got a valid request
-  // line.
-  if (line.size() == 0) {
-    if (!has_request_line) {
-      VLOG(1) << "Request is missing request line";
-      return State::kInvalid;
+  while (line_end != absl::string_view::npos) {
+    size_t line_start = line_end + strlen(kLineEnd);
+    line_end = head.find('\r', line_start);
+    if (!ParseHeaderField(head.substr(line_start, line_end - line_start),
+                          request)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool RequestParser::ParseRequestLine(absl::string_view line,
+                                     HttpRequest* request) {
+  // rfc7230 - 3.1.1.  Request Line
+  absl::string_view tokens[3];
+  size_t num_tokens = 0;
+  size_t pos = 0;
+  while (pos < line.size()) {
+    if (line[pos] == ' ') {
+      ++pos;
+      continue;
     }
-    return State::kReady;
-  }
-
-  // If we don't have a request line, then the first line must be a request
-  // line.
-  if (!has_request_line) {
-    // rfc7230 - 3.1.1.  Request Line
-    for (auto token : absl::StrSplit(line, ' ', absl::SkipEmpty())) {
-      if (!current_request_.version.empty()) {
-        VLOG(1) << "Request line trailing characters: " << line;
-        return State::kInvalid;
-      }
-
-      // Method.
-      if (current_request_.method == HttpRequest::Method::kInvalid) {
-        auto method = HttpRequest::ParseMethod(token);
-        if (method == HttpRequest::Method::kInvalid) {
-          VLOG(1) << "Invalid request method: " << token
-                  << ". Request: " << line;
-          return State::kInvalid;
-        }
-        current_request_.method = method;
-        continue;
-      }
-
-      // Target. We only support origin-form now.
-      if (current_request_.target.empty()) {
-        if (token[0] != '/') {
-          VLOG(1) << "Invalid request-target: " << token
-                  << ". Request: " << line;
-          return State::kInvalid;
-        }
-        current_request_.target = std::string(token);
-        continue;
-      }
-
-      if (current_request_.version.empty()) {
-        if (token.find(kVersionPrefix) != 0) {
-          VLOG(1) << "Expected version prefix: " << kVersionPrefix
-                  << ". Got: " << token << ". Request: " << line;
-          return State::kInvalid;
-        }
-        current_request_.version = std::string(token);
-        continue;
-      }
+    if (num_tokens == ABSL_ARRAYSIZE(tokens)) {
+      VLOG(1) << "Request line trailing characters: " << line;
+      return false;
     }
 
-    return State::kPending;
+    size_t end = std::min(line.find(' ', pos), line.size());
+    tokens[num_tokens++] = line.substr(pos, end - pos);
+    pos = end;
   }
+  if (num_tokens != ABSL_ARRAYSIZE(tokens)) {
+    VLOG(1) << "Incomplete request line: " << line;
+    return false;
+  }
+
+  request->method = HttpRequest::ParseMethod(tokens[0]);
+  if (request->method == HttpRequest::Method::kInvalid) {
+    VLOG(1) << "Invalid request method: " << tokens[0]
+            << ". Request: " << line;
+    return false;
+  }
+
+  // Target. We only support origin-form now.
+  if (tokens[1][0] != '/') {
+    VLOG(1) << "Invalid request-target: " << tokens[1]
+            << ". Request: " << line;
+    return false;
+  }
+  request->target = tokens[1];
+
+  if (tokens[2].find(kVersionPrefix) != 0) {
+    VLOG(1) << "Expected version prefix: " << kVersionPrefix
+            << ". Got: " << tokens[2] << ". Request: " << line;
+    return false;
+  }
+  request->version = tokens[2];
+
+  return true;
+}
 
-  // Parse a header.
+bool RequestParser::ParseHeaderField(absl::string_view line,
+                                     HttpRequest* request) {
   // rfc7230 - 3.2.  Header Fields
+  size_t colon_idx = line.find(':');
+  if (colon_idx == absl::string_view::npos) {
+    VLOG(1) << "Missing colon in header: " << line;
+    return false;
+  }
 
-  std::locale c_locale("C");
-  size_t colon_idx = 0;
-  for (; colon_idx < line.size(); ++colon_idx) {
-    char c = line[colon_idx];
-    if (!std::isprint(c, c_locale)) {
-      VLOG(1) << "Invalid character while parsing header: " << line;
-      return State::kInvalid;
-    }
-    // rfc7230 - 3.2.4.  Field Parsing
-    // No whitespace is allowed between the header field-name and colon.
-    if (std::isspace(c, c_locale)) {
-      VLOG(1) << "Space before colon in header: " << line;
-      return State::kInvalid;
-    }
-    if (c == ':') {
-      break;
-    }
+  // rfc7230 - 3.2.4.  Field Parsing
+  // No whitespace is allowed between the header field-name and colon.
+  absl::string_view name = line.substr(0, colon_idx);
+  if (!IsValidFieldName(name)) {
+    VLOG(1) << "Invalid header field name: " << line;
+    return false;
   }
 
-  auto header_name = std::string(line.substr(0, colon_idx));
-  size_t value_start = std::min(colon_idx + 1, line.size());
-  auto header_value = line.substr(value_start);
+  // Strip the optional whitespace around the value. Its characters were
+  // validated by |CommitWrite|.
+  absl::string_view value =
+      absl::StripAsciiWhitespace(line.substr(colon_idx + 1));
 
-  auto& value = current_request_.header_to_value_[header_name];
-  if (value.empty()) {
-    value = std::string(header_value);
-  } else {
-    // RFC2616 - Multiple message-header fields with the same field-name MAY be
-    // present in a message if and only if the entire field-value for that
-    // header field is defined as a comma-separated list.
-    absl::StrAppend(&value, ", ", header_value);
+  auto header = HttpRequest::ParseHeader(name);
+  if (header != HttpRequest::Header::kUnknown) {
+    request->AddHeader(header, value);
   }
 
-  return State::kPending;
+  return true;
 }
@@ -1,13 +1,20 @@
 #ifndef MAIN_REQUEST_PARSER_H_
 #define MAIN_REQUEST_PARSER_H_
 
+#include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "main/http-request.h"
 
 // HTTP request parser. See https://tools.ietf.org/html/rfc7230
+//
+// Works in place: data is received straight into the parser's buffer and
+// parsed requests are views into it. Apart from growing the buffer for large
+// requests, parsing doesn't allocate.
 class RequestParser {
  public:
   enum class State {
@@ -17,20 +24,53 @@ class RequestParser {
   };
 
   RequestParser() = default;
+  RequestParser(const RequestParser&) = delete;
+  RequestParser& operator=(const RequestParser&) = delete;
 
-  // Add data to the current request. Returns the current state of the parser.
+  // Returns the free space to receive data into. Never empty. Invalidates
+  // requests returned earlier, so all queued requests must have been popped.
+  absl::Span<char> GetWriteBuffer();
+
+  // Parses |size| bytes that were written to the span returned by
+  // |GetWriteBuffer|. Every complete request is queued, so pipelined requests
+  // are handled. Returns |kReady| if requests are queued. Returns |kInvalid| if
+  // the data was invalid or a request is too large, in which case it is
+  // discarded but requests parsed before it stay queued.
+  State CommitWrite(size_t size);
+
+  // Copies |data| to the buffer and parses it. Same requirements as
+  // |GetWriteBuffer|. |data| may hold at most 64 KiB of unparsed requests.
   State AddData(absl::string_view data);
 
-  // If |AddData| returns |kReady|, returns the last parsed request and resets
-  // the parser to parse the next request.
-  HttpRequest GetRequestAndReset();
+  bool HasRequest() const {
+    return next_ready_request_ < ready_requests_.size();
+  }
+
+  // Returns the oldest queued request. |HasRequest| must be true.
+  HttpRequest PopRequest();
 
  private:
   void Reset();
-  State ProcessLine(absl::string_view line);
 
-  std::string buf_;
-  HttpRequest current_request_;
+  // |head| is the request line and header fields, without the final CRLFs.
+  bool ParseRequest(absl::string_view head, HttpRequest* request);
+  bool ParseRequestLine(absl::string_view line, HttpRequest* request);
+  bool ParseHeaderField(absl::string_view line, HttpRequest* request);
+
+  std::unique_ptr<char[]> buf_;
+  size_t buf_capacity_ = 0;
+
+  // Start of the first request that isn't parsed yet and end of the data.
+  size_t request_start_ = 0;
+  size_t data_end_ = 0;
+  // Start of the current line and where to continue scanning it.
+  size_t line_start_ = 0;
+  size_t scan_offset_ = 0;
+
+  // A vector with a read index rather than a deque, so queueing requests
+  // doesn't allocate once the vector has grown.
+  std::vector<HttpRequest> ready_requests_;
+  size_t next_ready_request_ = 0;
 };
 
 #endif  // MAIN_REQUEST_PARSER_H_
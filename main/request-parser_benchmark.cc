@@ -0,0 +1,77 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "main/request-parser.h"
+
+namespace {
+
+constexpr int kIterations = 200000;
+
+// A typical browser request.
+constexpr char kBrowserRequest[] =
+    "GET /static/js/app.3f9c2b.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/74.0.3729.131 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=6b1f0e9d2c7a4d3e8f5a1b2c3d4e5f60; theme=dark; "
+    "_ga=GA1.2.1234567890.1556745600; _gid=GA1.2.987654321.1556745600; "
+    "consent=yes; tracking=abcdefabcdefabcdefabcdefabcdefabcdefabcdef\r\n"
+    "If-None-Match: \"1a2b3c-4d5e-6f70\"\r\n"
+    "\r\n";
+
+// A browser request with large cookies.
+std::string HeavyRequest() {
+  return absl::StrCat("GET / HTTP/1.1\r\nHost: www.example.com\r\n",
+                      "Cookie: ", std::string(4096, 'c'), "\r\n",
+                      "Cookie: ", std::string(2048, 'd'), "\r\n\r\n");
+}
+
+// A minimal request, e.g. from a load balancer health check.
+constexpr char kSmallRequest[] = "GET / HTTP/1.1\r\nHost: a\r\n\r\n";
+
+// Parses |request| |kIterations| times, |pipeline| requests per AddData().
+void Benchmark(const char* name, const std::string& request, int pipeline) {
+  std::string data;
+  for (int i = 0; i < pipeline; ++i) {
+    data += request;
+  }
+
+  RequestParser parser;
+  size_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations / pipeline; ++i) {
+    if (parser.AddData(data) != RequestParser::State::kReady) {
+      std::cerr << "Parsing failed\n";
+      exit(EXIT_FAILURE);
+    }
+    while (parser.HasRequest()) {
+      checksum += parser.PopRequest().target.size();
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  double ns_per_request =
+      std::chrono::duration<double, std::nano>(elapsed).count() / kIterations;
+  std::cout << absl::StrCat(name, ": ", static_cast<int>(ns_per_request),
+                            " ns/request (checksum ", checksum, ")\n");
+}
+
+}  // namespace
+
+// Measures request parsing throughput.
+int main() {
+  Benchmark("browser", kBrowserRequest, 1);
+  Benchmark("browser pipelined x8", kBrowserRequest, 8);
+  Benchmark("cookie-heavy", HeavyRequest(), 1);
+  Benchmark("small", kSmallRequest, 1);
+  Benchmark("small pipelined x8", kSmallRequest, 8);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+#include "main/request-parser.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+TEST(RequestParserTest, SingleRequest) {
+  RequestParser parser;
+  EXPECT_EQ(RequestParser::State::kPending,
+            parser.AddData("GET /index.html HTTP/1.1\r\nHost: a"));
+  EXPECT_FALSE(parser.HasRequest());
+  EXPECT_EQ(RequestParser::State::kPending,
+            parser.AddData("\r\nAccept-Encoding:  gzip \r\nX-Other: b\r\n\r"));
+  EXPECT_EQ(RequestParser::State::kReady, parser.AddData("\n"));
+  ASSERT_TRUE(parser.HasRequest());
+
+  HttpRequest request = parser.PopRequest();
+  EXPECT_EQ(HttpRequest::Method::kGet, request.method);
+  EXPECT_EQ("/index.html", request.target);
+  EXPECT_EQ("HTTP/1.1", request.version);
+  EXPECT_EQ("a", request.header(HttpRequest::Header::kHost));
+  EXPECT_EQ("gzip", request.header(HttpRequest::Header::kAcceptEncoding));
+  EXPECT_EQ("", request.header(HttpRequest::Header::kRange));
+  EXPECT_FALSE(parser.HasRequest());
+}
+
+TEST(RequestParserTest, HeaderNamesAreCaseInsensitive) {
+  RequestParser parser;
+  ASSERT_EQ(RequestParser::State::kReady,
+            parser.AddData("GET / HTTP/1.1\r\nIF-NONE-MATCH: \"a\"\r\n"
+                           "if-modified-since: x\r\n\r\n"));
+  HttpRequest request = parser.PopRequest();
+  EXPECT_EQ("\"a\"", request.header(HttpRequest::Header::kIfNoneMatch));
+  EXPECT_EQ("x", request.header(HttpRequest::Header::kIfModifiedSince));
+}
+
+TEST(RequestParserTest, RepeatedHeadersAreCombined) {
+  RequestParser parser;
+  ASSERT_EQ(RequestParser::State::kReady,
+            parser.AddData("GET / HTTP/1.1\r\nAccept-Encoding: gzip\r\n"
+                           "Accept-Encoding: br\r\n\r\n"));
+  HttpRequest request = parser.PopRequest();
+
+  // Moving the request keeps the combined value valid.
+  HttpRequest moved = std::move(request);
+  EXPECT_EQ("gzip, br", moved.header(HttpRequest::Header::kAcceptEncoding));
+}
+
+TEST(RequestParserTest, Body) {
+  RequestParser parser;
+  ASSERT_EQ(RequestParser::State::kReady,
+            parser.AddData("GET /a HTTP/1.1\r\n\r\n"
+                           "GET /b HTTP/1.1\r\nContent-Length: 0\r\n\r\n"
+                           "GET /c HTTP/1.1\r\nContent-Length: 5\r\n\r\n"));
+  EXPECT_FALSE(parser.PopRequest().HasBody());
+  EXPECT_FALSE(parser.PopRequest().HasBody());
+  EXPECT_TRUE(parser.PopRequest().HasBody());
+
+  ASSERT_EQ(RequestParser::State::kReady,
+            parser.AddData("GET /d HTTP/1.1\r\n"
+                           "transfer-encoding: chunked\r\n\r\n"));
+  EXPECT_TRUE(parser.PopRequest().HasBody());
+}
+
+TEST(RequestParserTest, PipelinedRequests) {
+  RequestParser parser;
+  EXPECT_EQ(RequestParser::State::kReady,
+            parser.AddData("GET /a HTTP/1.1\r\n\r\n"
+                           "\r\n"  // Empty lines between requests are ignored.
+                           "GET /b HTTP/1.1\r\nHost: x\r\n\r\n"
+                           "GET /c HT"));
+
+  ASSERT_TRUE(parser.HasRequest());
+  EXPECT_EQ("/a", parser.PopRequest().target);
+  ASSERT_TRUE(parser.HasRequest());
+  EXPECT_EQ("/b", parser.PopRequest().target);
+  EXPECT_FALSE(parser.HasRequest());
+
+  // The partial request is completed by the next chunk.
+  EXPECT_EQ(RequestParser::State::kReady, parser.AddData("TP/1.1\r\n\r\n"));
+  ASSERT_TRUE(parser.HasRequest());
+  HttpRequest request = parser.PopRequest();
+  EXPECT_EQ("/c", request.target);
+  EXPECT_EQ("HTTP/1.1", request.version);
+}
+
+TEST(RequestParserTest, WriteBufferInPlace) {
+  const std::string data = "GET /in-place HTTP/1.1\r\nRange: bytes=0-1\r\n\r\n";
+
+  // Feed one byte at a time to split the head end across writes.
+  RequestParser parser;
+  for (size_t i = 0; i < data.size(); ++i) {
+    EXPECT_FALSE(parser.HasRequest());
+    absl::Span<char> buf = parser.GetWriteBuffer();
+    ASSERT_FALSE(buf.empty());
+    buf[0] = data[i];
+    parser.CommitWrite(1);
+  }
+
+  ASSERT_TRUE(parser.HasRequest());
+  HttpRequest request = parser.PopRequest();
+  EXPECT_EQ("/in-place", request.target);
+  EXPECT_EQ("bytes=0-1", request.header(HttpRequest::Header::kRange));
+}
+
+TEST(RequestParserTest, LargeRequest) {
+  std::string cookie(32 * 1024, 'c');
+  RequestParser parser;
+  ASSERT_EQ(RequestParser::State::kReady,
+            parser.AddData("GET / HTTP/1.1\r\nCookie: " + cookie +
+                           "\r\nHost: big\r\n\r\n"));
+  EXPECT_EQ("big", parser.PopRequest().header(HttpRequest::Header::kHost));
+
+  std::string huge(128 * 1024, 'c');
+  EXPECT_EQ(RequestParser::State::kInvalid,
+            parser.AddData("GET / HTTP/1.1\r\nCookie: " + huge));
+
+  // The parser recovers.
+  EXPECT_EQ(RequestParser::State::kReady,
+            parser.AddData("GET /next HTTP/1.1\r\n\r\n"));
+  EXPECT_EQ("/next", parser.PopRequest().target);
+}
+
+TEST(RequestParserTest, InvalidRequests) {
+  for (const char* data : {
+           "POST / HTTP/1.1\r\n\r\n",
+           "GET /\r\n\r\n",
+           "GET / HTTP/1.1 extra\r\n\r\n",
+           "GET index.html HTTP/1.1\r\n\r\n",
+           "GET / FTP/1.1\r\n\r\n",
+           "GET / HTTP/1.1\r\nNo colon\r\n\r\n",
+           "GET / HTTP/1.1\r\nHost : a\r\n\r\n",
+           "GET / HTTP/1.1\r\n: a\r\n\r\n",
+           "GET / HTTP/1.1\r\nHost: a\x01\r\n\r\n",
+       }) {
+    RequestParser parser;
+    EXPECT_EQ(RequestParser::State::kInvalid, parser.AddData(data)) << data;
+    EXPECT_FALSE(parser.HasRequest());
+  }
+}
+
+TEST(RequestParserTest, InvalidRequestKeepsEarlierRequests) {
+  RequestParser parser;
+  EXPECT_EQ(RequestParser::State::kInvalid,
+            parser.AddData("GET /a HTTP/1.1\r\n\r\nPOST /b HTTP/1.1\r\n\r\n"));
+  ASSERT_TRUE(parser.HasRequest());
+  EXPECT_EQ("/a", parser.PopRequest().target);
+  EXPECT_FALSE(parser.HasRequest());
+
+  // Parsing continues after the invalid data was dropped.
+  EXPECT_EQ(RequestParser::State::kReady,
+            parser.AddData("GET /c HTTP/1.1\r\n\r\n"));
+  EXPECT_EQ("/c", parser.PopRequest().target);
+}
@@ -0,0 +1,139 @@
+#include "main/response-cache.h"
+
+#include <unistd.h>
+
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "base/util.h"
+
+namespace {
+
+constexpr char kDateHeader[] = "\r\nDate: ";
+
+// Returns a response holding |header| followed by room for |body_size| bytes.
+std::shared_ptr<ResponseCache::Response> NewResponse(
+    const FileCache::Entry& file, std::string header, size_t body_size) {
+  auto response = std::make_shared<ResponseCache::Response>();
+  response->mtime = file.mtime;
+  response->file_size = file.size;
+  response->inode = file.inode;
+
+  size_t date_pos = header.find(kDateHeader);
+  if (date_pos != std::string::npos) {
+    response->date_offset = date_pos + strlen(kDateHeader);
+    response->date_length =
+        header.find("\r\n", response->date_offset) - response->date_offset;
+  }
+
+  size_t header_size = header.size();
+  response->data = std::move(header);
+  response->data.resize(header_size + body_size);
+  return response;
+}
+
+}  // namespace
+
+// static
+Result<std::shared_ptr<const ResponseCache::Response>> ResponseCache::Build(
+    const FileCache::Entry& file, std::string header) {
+  size_t header_size = header.size();
+  auto response = NewResponse(file, std::move(header), file.size);
+
+  size_t offset = 0;
+  while (offset < file.size) {
+    ssize_t num_read = pread(*file.fd, &response->data[header_size + offset],
+                             file.size - offset, offset);
+    if (num_read < 0) {
+      return BuildPosixErr(absl::StrCat("Read failed on ", file.path));
+    }
+    if (num_read == 0) {
+      return Err(absl::StrCat("File truncated: ", file.path));
+    }
+    offset += num_read;
+  }
+
+  return std::shared_ptr<const Response>(std::move(response));
+}
+
+// static
+Result<std::shared_ptr<const ResponseCache::Response>> ResponseCache::Build(
+    const FileCache::Entry& file, std::string header, Reader* body,
+    size_t body_size) {
+  size_t header_size = header.size();
+  auto response = NewResponse(file, std::move(header), body_size);
+
+  size_t offset = 0;
+  while (offset < body_size) {
+    ssize_t num_read = TRY(body->Read(
+        {&response->data[header_size + offset], body_size - offset}));
+    if (num_read == -1) {
+      return Err(absl::StrCat("Encoded body truncated: ", file.path));
+    }
+    offset += num_read;
+  }
+
+  return std::shared_ptr<const Response>(std::move(response));
+}
+
+ResponseCache::ResponseCache(size_t max_size_bytes, size_t max_file_size)
+    : max_size_bytes_(max_size_bytes), max_file_size_(max_file_size) {}
+
+std::shared_ptr<const ResponseCache::Response> ResponseCache::Lookup(
+    const FileCache::Entry& file, content_encoding::Encoding encoding) {
+  absl::MutexLock lock(&mu_);
+  auto it = key_to_node_.find(Key(file.path, encoding));
+  if (it == key_to_node_.end()) {
+    return nullptr;
+  }
+
+  const Response& response = *it->second->response;
+  if (response.mtime != file.mtime || response.file_size != file.size ||
+      response.inode != file.inode) {
+    EraseLocked(it->second);
+    return nullptr;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->response;
+}
+
+void ResponseCache::Insert(const FileCache::Entry& file,
+                           content_encoding::Encoding encoding,
+                           std::shared_ptr<const Response> response) {
+  size_t size = response->data.size();
+  if (size > max_size_bytes_) {
+    return;
+  }
+
+  absl::MutexLock lock(&mu_);
+  auto it = key_to_node_.find(Key(file.path, encoding));
+  if (it != key_to_node_.end()) {
+    EraseLocked(it->second);
+  }
+
+  while (size_bytes_ + size > max_size_bytes_) {
+    EraseLocked(std::prev(lru_.end()));
+  }
+
+  lru_.push_front({file.path, encoding, std::move(response)});
+  key_to_node_.emplace(Key(lru_.front().path, encoding), lru_.begin());
+  size_bytes_ += size;
+}
+
+void ResponseCache::Invalidate(absl::string_view path) {
+  absl::MutexLock lock(&mu_);
+  for (auto it = lru_.begin(); it != lru_.end();) {
+    auto next = std::next(it);
+    if (util::IsPathWithin(it->path, path)) {
+      EraseLocked(it);
+    }
+    it = next;
+  }
+}
+
+void ResponseCache::EraseLocked(Lru::iterator it) {
+  size_bytes_ -= it->response->data.size();
+  key_to_node_.erase(Key(it->path, it->encoding));
+  lru_.erase(it);
+}
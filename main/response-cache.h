@@ -0,0 +1,92 @@
+#ifndef MAIN_RESPONSE_CACHE_H_
+#define MAIN_RESPONSE_CACHE_H_
+
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "base/err.h"
+#include "base/reader.h"
+#include "main/content-encoding.h"
+#include "main/file-cache.h"
+
+// Keeps complete serialized responses (status line, headers and body) for
+// small files so a hit can be sent with a single send(). Only the Date header
+// needs to be patched per request. Every content coding of a file is cached
+// separately.
+class ResponseCache {
+ public:
+  struct Response {
+    std::string data;
+
+    // Offset and length of the Date header value inside |data|.
+    size_t date_offset = 0;
+    size_t date_length = 0;
+
+    // The file the response was built from. If it changed, the response is
+    // stale.
+    time_t mtime = 0;
+    size_t file_size = 0;
+    ino_t inode = 0;
+  };
+
+  // Builds a response by appending the contents of |file| to |header|.
+  static Result<std::shared_ptr<const Response>> Build(
+      const FileCache::Entry& file, std::string header);
+
+  // Builds a response by appending the |body_size| bytes |body| reads to
+  // |header|. |body| is an encoded representation of |file|.
+  static Result<std::shared_ptr<const Response>> Build(
+      const FileCache::Entry& file, std::string header, Reader* body,
+      size_t body_size);
+
+  // |max_size_bytes| bounds the total size of cached responses. Only files up
+  // to |max_file_size| bytes are cached.
+  ResponseCache(size_t max_size_bytes, size_t max_file_size);
+  ResponseCache(const ResponseCache&) = delete;
+  ResponseCache& operator=(const ResponseCache&) = delete;
+
+  bool ShouldCache(const FileCache::Entry& file) const {
+    return max_size_bytes_ > 0 && file.size <= max_file_size_;
+  }
+
+  // Returns nullptr on a miss or if |file| changed. Thread safe.
+  std::shared_ptr<const Response> Lookup(const FileCache::Entry& file,
+                                         content_encoding::Encoding encoding);
+
+  // Thread safe.
+  void Insert(const FileCache::Entry& file, content_encoding::Encoding encoding,
+              std::shared_ptr<const Response> response);
+
+  // Drops the responses for |path| and for everything inside of it. Thread
+  // safe.
+  void Invalidate(absl::string_view path);
+
+ private:
+  struct Node {
+    std::string path;
+    content_encoding::Encoding encoding;
+    std::shared_ptr<const Response> response;
+  };
+  using Lru = std::list<Node>;
+  // The path is a view of |Node::path|, so lookups don't allocate.
+  using Key = std::pair<absl::string_view, content_encoding::Encoding>;
+
+  void EraseLocked(Lru::iterator it) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const size_t max_size_bytes_;
+  const size_t max_file_size_;
+
+  absl::Mutex mu_;
+
+  // Most recently used first.
+  Lru lru_ GUARDED_BY(mu_);
+  absl::flat_hash_map<Key, Lru::iterator> key_to_node_ GUARDED_BY(mu_);
+  size_t size_bytes_ GUARDED_BY(mu_) = 0;
+};
+
+#endif  // MAIN_RESPONSE_CACHE_H_
@@ -0,0 +1,134 @@
+#include "main/response-cache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+constexpr auto kIdentity = content_encoding::Encoding::kIdentity;
+constexpr auto kGzip = content_encoding::Encoding::kGzip;
+
+constexpr char kHeader[] =
+    "HTTP/1.1 200 OK\r\nDate: Thu, 01 Jan 1970 00:00:00 GMT\r\n\r\n";
+
+FileCache::Entry MakeEntry(const std::string& path,
+                           const std::string& contents) {
+  FILE* fp = fopen(path.c_str(), "w");
+  EXPECT_NE(nullptr, fp);
+  fwrite(contents.data(), 1, contents.size(), fp);
+  fclose(fp);
+
+  FileCache::Entry entry;
+  entry.path = path;
+  entry.fd = ScopedFd(open(path.c_str(), O_RDONLY));
+  entry.size = contents.size();
+  entry.mtime = 1;
+  entry.inode = 2;
+  return entry;
+}
+
+class StringReader : public Reader {
+ public:
+  explicit StringReader(absl::string_view data) : data_(data) {}
+
+  Result<ssize_t> Read(absl::Span<char> buf) override {
+    if (data_.empty()) {
+      return -1;
+    }
+    size_t size = std::min(buf.size(), data_.size());
+    memcpy(buf.data(), data_.data(), size);
+    data_.remove_prefix(size);
+    return size;
+  }
+
+ private:
+  absl::string_view data_;
+};
+
+class ResponseCacheTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = testing::TempDir() + "/response-cache_testXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(&dir_[0]));
+  }
+
+  void TearDown() override {
+    ASSERT_EQ(0, system(("rm -rf " + dir_).c_str()));
+  }
+
+  std::string dir_;
+};
+
+}  // namespace
+
+TEST_F(ResponseCacheTest, Build) {
+  auto entry = MakeEntry(dir_ + "/a", "body");
+  auto response = ResponseCache::Build(entry, kHeader);
+  ASSERT_TRUE(response.ok());
+  EXPECT_EQ(std::string(kHeader) + "body", (*response)->data);
+  EXPECT_EQ("Thu, 01 Jan 1970 00:00:00 GMT",
+            (*response)->data.substr((*response)->date_offset,
+                                     (*response)->date_length));
+}
+
+TEST_F(ResponseCacheTest, LookupAndInvalidate) {
+  ResponseCache cache(/*max_size_bytes=*/1000, /*max_file_size=*/100);
+  auto entry = MakeEntry(dir_ + "/a", "body");
+  EXPECT_TRUE(cache.ShouldCache(entry));
+  EXPECT_EQ(nullptr, cache.Lookup(entry, kIdentity));
+
+  auto response = ResponseCache::Build(entry, kHeader);
+  ASSERT_TRUE(response.ok());
+  cache.Insert(entry, kIdentity, *response);
+  EXPECT_EQ(response->get(), cache.Lookup(entry, kIdentity).get());
+
+  // Modified file.
+  entry.mtime = 5;
+  EXPECT_EQ(nullptr, cache.Lookup(entry, kIdentity));
+}
+
+TEST_F(ResponseCacheTest, EncodingsAreSeparate) {
+  ResponseCache cache(/*max_size_bytes=*/1000, /*max_file_size=*/100);
+  auto entry = MakeEntry(dir_ + "/a", "body");
+
+  StringReader body("encoded");
+  auto encoded = ResponseCache::Build(entry, kHeader, &body, 7);
+  ASSERT_TRUE(encoded.ok());
+  EXPECT_EQ(std::string(kHeader) + "encoded", (*encoded)->data);
+  cache.Insert(entry, kGzip, *encoded);
+  EXPECT_EQ(nullptr, cache.Lookup(entry, kIdentity));
+  EXPECT_EQ(encoded->get(), cache.Lookup(entry, kGzip).get());
+
+  auto identity = ResponseCache::Build(entry, kHeader);
+  ASSERT_TRUE(identity.ok());
+  cache.Insert(entry, kIdentity, *identity);
+  EXPECT_EQ(identity->get(), cache.Lookup(entry, kIdentity).get());
+  EXPECT_EQ(encoded->get(), cache.Lookup(entry, kGzip).get());
+
+  // A body shorter than promised fails.
+  StringReader short_body("enc");
+  EXPECT_FALSE(ResponseCache::Build(entry, kHeader, &short_body, 7).ok());
+}
+
+TEST_F(ResponseCacheTest, ByteBudget) {
+  auto a = MakeEntry(dir_ + "/a", std::string(50, 'a'));
+  auto b = MakeEntry(dir_ + "/b", std::string(50, 'b'));
+  auto c = MakeEntry(dir_ + "/c", std::string(500, 'c'));
+  size_t response_size = strlen(kHeader) + 50;
+  ResponseCache cache(/*max_size_bytes=*/response_size * 2 - 1,
+                      /*max_file_size=*/100);
+  EXPECT_FALSE(cache.ShouldCache(c));
+
+  cache.Insert(a, kIdentity, *ResponseCache::Build(a, kHeader));
+  EXPECT_NE(nullptr, cache.Lookup(a, kIdentity));
+  cache.Insert(b, kIdentity, *ResponseCache::Build(b, kHeader));
+  EXPECT_EQ(nullptr, cache.Lookup(a, kIdentity));
+  EXPECT_NE(nullptr, cache.Lookup(b, kIdentity));
+}
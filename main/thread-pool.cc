@@ -1,8 +1,15 @@
 #include "main/thread-pool.h"
 
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
 #include <utility>
 
 #include "absl/memory/memory.h"
+#include "base/logging.h"
 
 namespace {
 
@@ -19,7 +26,20 @@ std::vector<std::shared_ptr<TaskRunner>> MakeTaskRunners(size_t num) {
 
 }  // namespace
 
-ThreadPool::ThreadPool(size_t size) : task_runners_(MakeTaskRunners(size)) {}
+ThreadPool::ThreadPool(size_t size, int nice)
+    : task_runners_(MakeTaskRunners(size)) {
+  if (nice <= 0) {
+    return;
+  }
+  // On Linux, the nice value is per thread.
+  for (const auto& task_runner : task_runners_) {
+    task_runner->PostTask(BindOnce([nice] {
+      if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) < 0) {
+        LOG(WARN) << "setpriority failed: " << strerror(errno);
+      }
+    }));
+  }
+}
 
 void ThreadPool::PostTask(OnceCallback task) {
   GetNextRunner()->PostTask(std::move(task));
@@ -10,13 +10,18 @@
 
 class ThreadPool {
  public:
-  explicit ThreadPool(size_t size);
+  // The threads get |nice| as their nice value if it's positive, to yield the
+  // CPU to other threads.
+  explicit ThreadPool(size_t size, int nice = 0);
 
   // Thread safe.
   void PostTask(OnceCallback task);
 
   TaskRunner* GetNextRunner();
 
+  size_t size() const { return task_runners_.size(); }
+  TaskRunner* runner(size_t idx) const { return task_runners_[idx].get(); }
+
  private:
   const std::vector<std::shared_ptr<TaskRunner>> task_runners_;
   std::atomic<uint64_t> next_task_runner_{0};
@@ -1,246 +1,239 @@
 #include "main/thttpd.h"
 
-#include <arpa/inet.h>
-#include <fcntl.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <sys/epoll.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-#include <array>
-#include <cstdint>
-#include <cstdlib>
-#include <string>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
 #include <utility>
 
 #include "absl/base/macros.h"
 #include "absl/memory/memory.h"
-#include "absl/strings/numbers.h"
-#include "absl/types/span.h"
+#include "absl/strings/match.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
 #include "base/logging.h"
-#include "base/scoped-fd.h"
 
 namespace {
 
-constexpr int kListenBacklog = 128;
-constexpr int kMaxEvents = 4096;
+// Connections come first when the cores are busy.
+constexpr int kCompressionNice = 10;
+
+// Share of the open files limit the cached files may hold, the rest is left
+// for connections and files being sent. It's split evenly between the
+// FileCache and the CompressionCache.
+constexpr rlim_t kCachedFdsDivisor = 2;
+
+// Raises the soft limit on open files to the hard limit, and returns it.
+Result<rlim_t> RaiseOpenFilesLimit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    return BuildPosixErr("getrlimit failed");
+  }
+  if (limit.rlim_cur == limit.rlim_max) {
+    return limit.rlim_cur;
+  }
+
+  rlimit raised = limit;
+  raised.rlim_cur = limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &raised) < 0) {
+    // An unlimited hard limit can't be set, it's bounded by fs.nr_open.
+    LOG(WARN) << "Keeping the open files limit at " << limit.rlim_cur << ": "
+              << strerror(errno);
+    return limit.rlim_cur;
+  }
+  return raised.rlim_cur;
+}
 
 }  // namespace
 
 // static
 Result<std::unique_ptr<Thttpd>> Thttpd::Create(const Config& config_in) {
   Config config = config_in;
-  if (config.num_worker_threads < 0) {
+  if (config.num_worker_threads < 0 || config.num_compression_threads < 0) {
     return Err("Must specify a positive number of threads, or 0 to auto pick");
   }
 
+  for (int level : {config.compression_level, config.fast_compression_level,
+                    config.best_compression_level}) {
+    if (level < 1 || level > 9) {
+      return Err("Compression levels must be between 1 and 9");
+    }
+  }
+
   if (config.num_worker_threads == 0) {
     // TODO(bcf): Choose based number of cores.
     config.num_worker_threads = 16;
   }
 
-  return absl::WrapUnique(new Thttpd(config));
-}
-
-Thttpd::Thttpd(const Config& config)
-    : config_(config),
-      thread_pool_(config.num_worker_threads),
-      compression_cache_(config.compression_cache_size) {}
+  if (config.hot_set_interval_ms <= 0 || config.warm_up_timeout_ms < 0) {
+    return Err("Invalid hot set interval or warm-up timeout");
+  }
 
-Result<void> Thttpd::Start() {
-  ScopedFd listen_fd(
-      socket(PF_INET6, SOCK_STREAM | SOCK_NONBLOCK, /*protocol=*/0));
-  if (*listen_fd < 0) {
-    return BuildPosixErr("socket failed");
+  if (config.num_compression_threads == 0) {
+    config.num_compression_threads =
+        std::max(std::thread::hardware_concurrency(), 1u);
   }
 
-  {
-    int opt = 1;
-    if (setsockopt(*listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) <
-        0) {
-      return BuildPosixErr("socksockopt failed");
-    }
+  if (config.compression_cache_shards == 0) {
+    config.compression_cache_shards =
+        std::max(std::thread::hardware_concurrency(), 1u);
   }
 
-  {
-    sockaddr_in6 addr = {
-        .sin6_family = AF_INET6, .sin6_port = htons(config_.port),
-    };
-    addr.sin6_addr = in6addr_any;
-    if (bind(*listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) <
-        0) {
-      return BuildPosixErr("bind failed");
+  // Each entry of the FileCache holds its file open, and its sidecars. Each
+  // file in the CompressionCache holds one descriptor.
+  auto fd_limit = RaiseOpenFilesLimit();
+  if (fd_limit.ok()) {
+    rlim_t fds_per_cache = *fd_limit / kCachedFdsDivisor / 2;
+    rlim_t fds_per_entry =
+        1 + (config.serve_precompressed
+                 ? ABSL_ARRAYSIZE(content_encoding::kSidecarEncodings)
+                 : 0);
+    rlim_t max_entries = fds_per_cache / fds_per_entry;
+    if (config.file_cache_size > max_entries) {
+      LOG(WARN) << "Caching at most " << max_entries
+                << " files, for an open files limit of " << *fd_limit;
+      config.file_cache_size = max_entries;
     }
-
-    if (listen(*listen_fd, kListenBacklog) < 0) {
-      return BuildPosixErr("listen failed");
+    if (config.compression_cache_max_files > fds_per_cache) {
+      LOG(WARN) << "Caching at most " << fds_per_cache
+                << " compressed files, for an open files limit of "
+                << *fd_limit;
+      config.compression_cache_max_files = fds_per_cache;
     }
+  } else {
+    LOG(WARN) << fd_limit.err();
   }
 
-  ScopedFd epoll_fd(epoll_create1(/*flags=*/0));
-  if (*epoll_fd < 0) {
-    return BuildPosixErr("epoll_create1 failed");
+  auto file_watcher = FileWatcher::Create(config.path_to_serve);
+  if (!file_watcher.ok()) {
+    LOG(WARN) << "Not watching files, changes are picked up after "
+              << config.file_cache_ttl_ms << "ms: " << file_watcher.err();
   }
 
-  {
-    epoll_event event{
-        .events = EPOLLIN,
-    };
-    event.data.fd = *listen_fd;
-    if (epoll_ctl(*epoll_fd, EPOLL_CTL_ADD, *listen_fd, &event) < 0) {
-      return BuildPosixErr("epoll_ctl on listen_fd failed");
+  std::unique_ptr<DiskCache> disk_cache;
+  if (!config.compression_cache_dir.empty()) {
+    auto disk_cache_or = DiskCache::Create(config.compression_cache_dir,
+                                           config.compression_disk_cache_size);
+    if (disk_cache_or.ok()) {
+      disk_cache = std::move(*disk_cache_or);
+    } else {
+      LOG(WARN) << "Not keeping compressed files on disk: "
+                << disk_cache_or.err();
     }
   }
 
-  int pipe_fds[2];
-  if (pipe(pipe_fds) < 0) {
-    return BuildPosixErr("pipe failed");
-  }
-  ScopedFd event_read_fd = ScopedFd(pipe_fds[0]);
-  event_write_fd_ = ScopedFd(pipe_fds[1]);
+  return absl::WrapUnique(new Thttpd(
+      config, file_watcher.ok() ? std::move(*file_watcher) : nullptr,
+      std::move(disk_cache)));
+}
 
-  {
-    // Set event_read_fd as nonblocking.
-    int flags = fcntl(*event_read_fd, F_GETFL, 0);
-    if (flags < 0) {
-      return BuildPosixErr("fcntl(F_GETFL) on event_read_fd failed");
-    }
-    flags |= O_NONBLOCK;
-    if (fcntl(*event_read_fd, F_SETFL, flags) < 0) {
-      return BuildPosixErr("fcntl(F_SETFL) on event_read_fd failed");
-    }
+Thttpd::Thttpd(const Config& config, std::unique_ptr<FileWatcher> file_watcher,
+               std::unique_ptr<DiskCache> disk_cache)
+    : config_(config),
+      file_watcher_(std::move(file_watcher)),
+      disk_cache_(std::move(disk_cache)),
+      thread_pool_(config.num_worker_threads),
+      compression_pool_(config.num_compression_threads, kCompressionNice),
+      compression_policy_(config),
+      compression_cache_(config.compression_cache_size,
+                         config.compression_cache_max_files,
+                         config.compression_cache_max_file_size,
+                         config.compression_cache_shards,
+                         &compression_policy_, &compression_pool_,
+                         disk_cache_.get()),
+      file_cache_(config.path_to_serve, config.file_cache_size,
+                  file_watcher_
+                      ? absl::InfiniteDuration()
+                      : absl::Milliseconds(config.file_cache_ttl_ms),
+                  config.serve_precompressed),
+      response_cache_(config.response_cache_size,
+                      config.response_cache_max_file_size),
+      cache_warmer_(config, &file_cache_, &compression_cache_,
+                    &compression_pool_) {}
 
-    // Add epoll event for event_read_fd.
-    epoll_event event{
-        .events = EPOLLIN,
-    };
-    event.data.fd = *event_read_fd;
-    if (epoll_ctl(*epoll_fd, EPOLL_CTL_ADD, *event_read_fd, &event) < 0) {
-      return BuildPosixErr("epoll_ctl on event_read_fd failed");
-    }
-  }
+Result<void> Thttpd::Start() {
+  // Requests are served while warming up.
+  cache_warmer_.Start();
 
-  const auto events = absl::make_unique<std::array<epoll_event, kMaxEvents>>();
+  if (config_.reuse_port) {
+    return StartReusePort();
+  }
 
-  LOG(INFO) << "Listening on port " << config_.port;
-  while (true) {
-    int num_fds =
-        epoll_wait(*epoll_fd, events->data(), events->size(), /*timeout=*/-1);
-    if (num_fds < 0) {
-      return BuildPosixErr("epoll_wait failed");
-    }
+  reactors_.push_back(TRY(Reactor::Create(this, Reactor::Mode::kDispatch)));
+  if (file_watcher_) {
+    TRY(reactors_.back()->WatchFiles(file_watcher_.get()));
+  }
+  return reactors_.back()->Run();
+}
 
-    for (auto& event : absl::MakeSpan(events->data(), num_fds)) {
-      int fd = event.data.fd;
-      if (fd == *listen_fd) {
-        AcceptNewClient(*listen_fd, *epoll_fd);
-      } else if (fd == *event_read_fd) {
-        HandleEvents(*event_read_fd);
-      } else {
-        HandleClient(fd, event.events);
-      }
+void Thttpd::InvalidatePath(absl::string_view path) {
+  // A sidecar belongs to the representations of its file.
+  for (auto encoding : content_encoding::kSidecarEncodings) {
+    absl::string_view extension = content_encoding::FileExtension(encoding);
+    if (absl::EndsWith(path, extension)) {
+      InvalidatePath(path.substr(0, path.size() - extension.size()));
     }
   }
 
-  return {};
-}
-
-void Thttpd::NotifySocketClosed(int fd) {
-  closed_fds_.Push(fd);
-  NotifyEvent(absl::StrCat("socket closed: ", fd));
+  file_cache_.Invalidate(path);
+  response_cache_.Invalidate(path);
+  compression_cache_.Invalidate(path);
 }
 
-void Thttpd::NotifyEvent(absl::string_view event) {
-  std::string str_event(event);
-  str_event.push_back('\n');
-  ssize_t ret = write(*event_write_fd_, str_event.data(), str_event.size());
-  if (ret != static_cast<ssize_t>(str_event.size())) {
-    LOG(ERR) << "Failed to write event: " << event;
-  }
+void Thttpd::OnFileWatcherIncomplete() {
+  LOG(WARN) << "Not all directories are watched, changes are picked up after "
+            << config_.file_cache_ttl_ms << "ms";
+  // Responses and compressed files are checked against the file metadata.
+  file_cache_.SetTtl(absl::Milliseconds(config_.file_cache_ttl_ms));
 }
 
-void Thttpd::AcceptNewClient(int listen_fd, int epoll_fd) {
-  sockaddr_storage remote_addr;
-  socklen_t remote_addr_len = sizeof(remote_addr);
-  ScopedFd conn_sock(accept4(listen_fd,
-                             reinterpret_cast<sockaddr*>(&remote_addr),
-                             &remote_addr_len, SOCK_NONBLOCK));
-  if (*conn_sock < 0) {
-    LOG(ERR) << "accept failed : " << strerror(errno);
-    return;
-  }
-  epoll_event new_event{
-      .events = EPOLLIN | EPOLLOUT | EPOLLET,
-  };
-  new_event.data.fd = *conn_sock;
-  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *conn_sock, &new_event) < 0) {
-    LOG(ERR) << "epoll_ctl on conn_sock failed failed : " << strerror(errno);
-    return;
-  }
-
-  char addr_str[INET6_ADDRSTRLEN];
-  void* in_addr = nullptr;
-  if (remote_addr.ss_family == AF_INET) {
-    in_addr = &(reinterpret_cast<sockaddr_in*>(&remote_addr)->sin_addr);
-  } else {
-    in_addr = &(reinterpret_cast<sockaddr_in6*>(&remote_addr)->sin6_addr);
+Result<void> Thttpd::StartReusePort() {
+  for (size_t i = 0; i < thread_pool_.size(); ++i) {
+    reactors_.push_back(TRY(Reactor::Create(this, Reactor::Mode::kInline)));
   }
-  if (inet_ntop(remote_addr.ss_family, in_addr, addr_str, sizeof(addr_str)) ==
-      nullptr) {
-    LOG(WARN) << "inet_ntop failed: " << strerror(errno);
-  } else {
-    addr_str[sizeof(addr_str) - 1] = '\0';
-    VLOG(2) << "Connection from: " << addr_str;
+  if (file_watcher_) {
+    TRY(reactors_.front()->WatchFiles(file_watcher_.get()));
   }
 
-  int raw_conn_sock = *conn_sock;
+  absl::Mutex mu;
+  absl::optional<Err> err;
+  size_t num_running = reactors_.size();
 
-  auto request_handler = std::make_shared<RequestHandler>(
-      addr_str, this, thread_pool_.GetNextRunner(), std::move(conn_sock));
-  request_handler->Init(request_handler);
+  for (size_t i = 0; i < reactors_.size(); ++i) {
+    Reactor* reactor = reactors_[i].get();
+    thread_pool_.runner(i)->PostTask(
+        BindOnce([reactor, &mu, &err, &num_running] {
+          auto result = reactor->Run();
 
-  conn_fd_to_handler_.emplace(raw_conn_sock, std::move(request_handler));
-}
-
-bool Thttpd::HandleEvents(int event_fd) {
-  char buf[BUFSIZ];
-  while (true) {
-    ssize_t ret = read(event_fd, buf, sizeof(buf));
-    if (ret < 0) {
-      if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        LOG(ERR) << "Read event_fd failed: " << strerror(errno);
-      }
-      break;
-    }
+          absl::MutexLock lock(&mu);
+          if (!result.ok() && !err) {
+            err = std::move(result.err());
+          }
+          --num_running;
+        }));
   }
 
-  while (!closed_fds_.Empty()) {
-    int fd = closed_fds_.Pop();
-    auto it = conn_fd_to_handler_.find(fd);
-    if (it == conn_fd_to_handler_.end()) {
-      LOG(ERR) << "Unknown socket!";
-      continue;
-    }
+  absl::MutexLock lock(&mu);
+  auto failed_or_done = [&] {
+    mu.AssertHeld();
+    return err.has_value() || num_running == 0;
+  };
+  mu.Await(absl::Condition(&failed_or_done));
 
-    VLOG(2) << "Disconnected: " << it->second->client_ip();
-    conn_fd_to_handler_.erase(it);
+  // One reactor failing takes the others down with it.
+  for (const auto& reactor : reactors_) {
+    reactor->Stop();
   }
-  return false;
-}
+  auto done = [&] {
+    mu.AssertHeld();
+    return num_running == 0;
+  };
+  mu.Await(absl::Condition(&done));
 
-void Thttpd::HandleClient(int fd, uint32_t epoll_events) {
-  auto it = conn_fd_to_handler_.find(fd);
-  if (it == conn_fd_to_handler_.end()) {
-    LOG(ERR) << "Unknown socket!";
-    return;
+  if (err) {
+    return *err;
   }
-  bool can_read = epoll_events & EPOLLIN;
-  bool can_write = epoll_events & EPOLLOUT;
-
-  const auto& request_handler = it->second;
-
-  request_handler->task_runner()->PostTask(BindOnce(
-      &RequestHandler::HandleUpdate, request_handler, can_read, can_write));
+  return {};
 }
@@ -2,14 +2,20 @@
 #define MAIN_THTTPD_H_
 
 #include <memory>
+#include <vector>
 
 #include "absl/base/attributes.h"
-#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
 #include "base/err.h"
-#include "base/mpsc-queue.h"
+#include "main/cache-warmer.h"
 #include "main/compression-cache.h"
+#include "main/compression-policy.h"
 #include "main/config.h"
-#include "main/request-handler.h"
+#include "main/disk-cache.h"
+#include "main/file-cache.h"
+#include "main/file-watcher.h"
+#include "main/reactor.h"
+#include "main/response-cache.h"
 #include "main/thread-pool.h"
 
 class Thttpd {
@@ -25,30 +31,47 @@ class Thttpd {
   const Config& config() const { return config_; }
 
  private:
+  friend class Reactor;
   friend class RequestHandler;
 
-  explicit Thttpd(const Config& config);
+  // Files are watched for changes if |file_watcher| is set. Otherwise cached
+  // metadata expires after |Config::file_cache_ttl_ms|. Compressed files are
+  // kept on disk if |disk_cache| is set.
+  Thttpd(const Config& config, std::unique_ptr<FileWatcher> file_watcher,
+         std::unique_ptr<DiskCache> disk_cache);
+
+  // Runs one Reactor per worker thread. Blocks until one of them fails.
+  Result<void> StartReusePort();
 
   // Friend methods:
-  void NotifySocketClosed(int fd);
+  // Drops everything cached for |path| or anything inside of it.
+  void InvalidatePath(absl::string_view path);
+  // Called once |file_watcher_| stopped reporting every change. Cached
+  // metadata expires after |Config::file_cache_ttl_ms| from then on.
+  void OnFileWatcherIncomplete();
+  ThreadPool* thread_pool() { return &thread_pool_; }
+  const CompressionPolicy* compression_policy() const {
+    return &compression_policy_;
+  }
   CompressionCache* compression_cache() { return &compression_cache_; }
-
-  void NotifyEvent(absl::string_view event);
-  void AcceptNewClient(int listen_fd, int epoll_fd);
-
-  // Returns true if the main loop should exit.
-  bool HandleEvents(int event_fd);
-  void HandleClient(int fd, uint32_t epoll_events);
+  FileCache* file_cache() { return &file_cache_; }
+  ResponseCache* response_cache() { return &response_cache_; }
 
   const Config config_;
+  const std::unique_ptr<FileWatcher> file_watcher_;
+  const std::unique_ptr<DiskCache> disk_cache_;
 
+  // Runs the workers, or the reactors with |Config::reuse_port|.
   ThreadPool thread_pool_;
-  absl::flat_hash_map<int, std::shared_ptr<RequestHandler>> conn_fd_to_handler_;
+  // Runs |compression_cache_|'s parallel gzip, recompressions and disk
+  // accesses, and |cache_warmer_|, at a lower priority than |thread_pool_|.
+  ThreadPool compression_pool_;
+  CompressionPolicy compression_policy_;
   CompressionCache compression_cache_;
-
-  // Used for notifying the main loop of events.
-  ScopedFd event_write_fd_;
-  MpscQueue<int> closed_fds_;
+  FileCache file_cache_;
+  ResponseCache response_cache_;
+  CacheWarmer cache_warmer_;
+  std::vector<std::unique_ptr<Reactor>> reactors_;
 };
 
 #endif  // MAIN_THTTPD_H_